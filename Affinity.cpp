@@ -0,0 +1,142 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Affinity.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the Affinity class
+//  On Linux the nodes come from sysfs.  Elsewhere every core is
+//  on node zero.
+//
+
+#include "Affinity.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__linux__)
+// Reads a list like "0-3,8-11" and calls back for every cpu in it
+template <typename Callback>
+static void parse_cpu_list(const std::string& list, Callback callback)
+{
+  const char * next = list.c_str();
+  while (*next)
+  {
+    char * end;
+    auto first = std::strtol(next, &end, 10);
+    if (end == next)
+      break;
+
+    auto last = first;
+    if (*end == '-')
+    {
+      next = end + 1;
+      last = std::strtol(next, &end, 10);
+    }
+
+    for (auto cpu = first; cpu <= last; cpu++)
+      callback(static_cast<int>(cpu));
+
+    next = (*end == ',') ? end + 1 : end;
+  }
+}
+#endif
+
+Affinity::cpu_vector_t Affinity::get_cpus()
+{
+  cpu_vector_t cpus;
+
+#if defined(__linux__)
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+  {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &allowed))
+        cpus.push_back({ cpu, 0 });
+  }
+
+  if (auto dir = opendir("/sys/devices/system/node"))
+  {
+    while (auto entry = readdir(dir))
+    {
+      std::string name(entry->d_name);
+      if (name.compare(0, 4, "node") != 0 || name.size() == 4 || name.find_first_not_of("0123456789", 4) != std::string::npos)
+        continue;
+
+      auto node = std::atoi(name.c_str() + 4);
+      std::ifstream file("/sys/devices/system/node/" + name + "/cpulist");
+      std::string list;
+      std::getline(file, list);
+
+      parse_cpu_list(list, [&](int cpu)
+      {
+        for (auto& entry : cpus)
+          if (entry.cpu == cpu)
+            entry.node = node;
+      });
+    }
+
+    closedir(dir);
+  }
+#endif
+
+  if (cpus.empty())
+  {
+    int count = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u));
+    for (int cpu = 0; cpu < count; cpu++)
+      cpus.push_back({ cpu, 0 });
+  }
+
+  std::sort(cpus.begin(), cpus.end(), [](const cpu_t& lhs, const cpu_t& rhs)
+  {
+    return (lhs.node != rhs.node) ? lhs.node < rhs.node : lhs.cpu < rhs.cpu;
+  });
+
+  return cpus;
+}
+
+int Affinity::get_node_count(const cpu_vector_t& cpus)
+{
+  int count = 0;
+  for (std::size_t i = 0; i < cpus.size(); i++)
+    if (i == 0 || cpus[i].node != cpus[i - 1].node)
+      count++;
+
+  return count;
+}
+
+bool Affinity::pin(std::thread& thread, int cpu)
+{
+  if (!thread.joinable() || cpu < 0)
+    return false;
+
+#if defined(_WIN32)
+  if (cpu >= 64)
+    return false;
+
+  return SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << cpu) != 0;
+#elif defined(__linux__)
+  if (cpu >= CPU_SETSIZE)
+    return false;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
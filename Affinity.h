@@ -0,0 +1,45 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Affinity.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Affinity declaration:
+//  This finds the cores we are allowed on and pins threads to
+//  them.  The cores come back grouped by NUMA node, so handing
+//  neighboring parts of a Partition to neighboring cores keeps
+//  the bottles between them on one node.
+//
+
+#if !defined(__AFFINITY_H__)
+#define __AFFINITY_H__
+
+#include <thread>
+#include <vector>
+
+class Affinity
+{
+public:
+  struct cpu_t
+  {
+    int cpu;
+    int node;
+  };
+
+  typedef std::vector<cpu_t> cpu_vector_t;
+
+public:
+  // Sorted by node and then by cpu.  Never empty.
+  static cpu_vector_t get_cpus();
+
+  static int get_node_count(const cpu_vector_t& cpus);
+
+  // Returns false if the thread can't be pinned
+  static bool pin(std::thread& thread, int cpu);
+
+private:
+  Affinity() = delete;
+};
+
+#endif // #if !defined(__AFFINITY_H__)
@@ -0,0 +1,176 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Arena.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the Arena class
+//  On Linux the chunks are mapped directly.  Huge pages are
+//  transparent ones, so the chunks are aligned to one, and the
+//  node is set with mbind.  Windows can only pick the node, as
+//  large pages need a privilege we don't ask for.
+//
+
+#include "Arena.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && !defined(MPOL_PREFERRED)
+// From <numaif.h>, which comes with libnuma
+#define MPOL_PREFERRED 1
+#endif
+
+constexpr std::size_t Arena::chunk_size;
+
+Arena::Arena(bool huge_pages, int node)
+  : huge_pages_(huge_pages)
+  , node_(node)
+  , lock_()
+  , chunks_()
+  , next_(nullptr)
+  , end_(nullptr)
+  , free_()
+  , reserved_(0)
+  , used_(0)
+{
+}
+
+Arena::~Arena()
+{
+  for (auto& chunk : chunks_)
+    unmap(chunk);
+}
+
+void * Arena::allocate(std::size_t size, std::size_t align)
+{
+  // Keeps every block at least pointer aligned and the free lists few
+  size = std::max<std::size_t>((size + sizeof(void *) - 1) & ~(sizeof(void *) - 1), sizeof(void *));
+  align = std::max(align, sizeof(void *));
+
+  std::unique_lock<std::mutex> lock(lock_);
+
+  auto entry = free_.find(size);
+  if (entry != free_.end() && !entry->second.empty()
+    && (reinterpret_cast<std::uintptr_t>(entry->second.back()) & (align - 1)) == 0)
+  {
+    auto block = entry->second.back();
+    entry->second.pop_back();
+    used_ += size;
+    return block;
+  }
+
+  auto aligned = [align](char * at)
+  {
+    return reinterpret_cast<char *>((reinterpret_cast<std::uintptr_t>(at) + align - 1) & ~(std::uintptr_t(align) - 1));
+  };
+
+  auto block = aligned(next_);
+  if (!next_ || block + size > end_)
+  {
+    // Whatever is left of the newest chunk goes to waste
+    auto chunk = map(std::max(chunk_size, (size + align + chunk_size - 1) / chunk_size * chunk_size));
+    if (!chunk.base)
+      throw std::bad_alloc();
+
+    chunks_.push_back(chunk);
+    reserved_ += chunk.size;
+    next_ = chunk.base;
+    end_ = chunk.base + chunk.size;
+    block = aligned(next_);
+  }
+
+  next_ = block + size;
+  used_ += size;
+  return block;
+}
+
+void Arena::deallocate(void * block, std::size_t size)
+{
+  if (!block)
+    return;
+
+  size = std::max<std::size_t>((size + sizeof(void *) - 1) & ~(sizeof(void *) - 1), sizeof(void *));
+
+  std::unique_lock<std::mutex> lock(lock_);
+  free_[size].push_back(block);
+  used_ -= size;
+}
+
+std::size_t Arena::get_reserved()
+{
+  std::unique_lock<std::mutex> lock(lock_);
+  return reserved_;
+}
+
+std::size_t Arena::get_used()
+{
+  std::unique_lock<std::mutex> lock(lock_);
+  return used_;
+}
+
+Arena::chunk_t Arena::map(std::size_t size)
+{
+#if defined(_WIN32)
+  void * base = (node_ >= 0)
+    ? VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, static_cast<DWORD>(node_))
+    : VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  return { static_cast<char *>(base), size };
+#elif defined(__linux__)
+  // Map an extra huge page so the chunk can start on one
+  auto mapped = size + (huge_pages_ ? chunk_size : 0);
+  auto base = ::mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return { nullptr, 0 };
+
+  auto start = static_cast<char *>(base);
+  if (huge_pages_)
+  {
+    auto aligned = reinterpret_cast<char *>((reinterpret_cast<std::uintptr_t>(start) + chunk_size - 1) & ~(std::uintptr_t(chunk_size) - 1));
+    if (aligned > start)
+      ::munmap(start, static_cast<std::size_t>(aligned - start));
+    if (aligned + size < start + mapped)
+      ::munmap(aligned + size, static_cast<std::size_t>(start + mapped - (aligned + size)));
+
+    start = aligned;
+    ::madvise(start, size, MADV_HUGEPAGE);
+  }
+
+  // Nothing is touched yet, so every page lands on the node
+  if (node_ >= 0)
+  {
+    unsigned long mask[16] = {};
+    auto bits = 8 * sizeof(unsigned long);
+    if (static_cast<std::size_t>(node_) < bits * 16)
+    {
+      mask[static_cast<std::size_t>(node_) / bits] = 1UL << (static_cast<std::size_t>(node_) % bits);
+      ::syscall(SYS_mbind, start, size, MPOL_PREFERRED, mask, bits * 16, 0);
+    }
+  }
+
+  return { start, size };
+#else
+  return { static_cast<char *>(::operator new(size, std::nothrow)), size };
+#endif
+}
+
+void Arena::unmap(const chunk_t& chunk)
+{
+#if defined(_WIN32)
+  VirtualFree(chunk.base, 0, MEM_RELEASE);
+#elif defined(__linux__)
+  ::munmap(chunk.base, chunk.size);
+#else
+  ::operator delete(chunk.base);
+#endif
+}
@@ -0,0 +1,147 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Arena.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Arena declaration:
+//  This hands out memory from big chunks, one after another, so
+//  things allocated together sit together.  A table lays its
+//  philosophers and their bottle records out in one instead of
+//  scattering them over the heap.
+//
+//  Chunks can be asked for on huge pages and on one NUMA node.
+//  Freed blocks are kept by size for the next allocation of that
+//  size, and the chunks only go back when the arena goes away.
+//
+//  ArenaAllocator lets the standard containers use one.  Without
+//  an arena it uses the heap.
+//
+
+#if !defined(__ARENA_H__)
+#define __ARENA_H__
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+class Arena
+{
+public:
+  // One huge page.  Bigger allocations get chunks of their own.
+  static constexpr std::size_t chunk_size = 2 * 1024 * 1024;
+
+  struct chunk_t
+  {
+    char * base;
+    std::size_t size;
+  };
+
+public:
+  // A node below zero takes memory from wherever the allocating thread
+  // runs.  Both are only hints where the system doesn't support them.
+  Arena(bool huge_pages = false, int node = -1);
+  virtual ~Arena();
+
+public:
+  // Safe to call from any thread
+  void * allocate(std::size_t size, std::size_t align);
+  void deallocate(void * block, std::size_t size);
+
+  bool get_huge_pages() const { return huge_pages_; };
+  int get_node() const { return node_; };
+
+  // Bytes taken from the system and bytes handed out and not freed
+  std::size_t get_reserved();
+  std::size_t get_used();
+
+private:
+  chunk_t map(std::size_t size);
+  void unmap(const chunk_t& chunk);
+
+private:
+  bool huge_pages_;
+  int node_;
+
+  std::mutex lock_;
+  std::vector<chunk_t> chunks_;
+  char * next_;   // Free space in the newest chunk
+  char * end_;
+  std::unordered_map<std::size_t, std::vector<void *>> free_;   // By size
+  std::size_t reserved_;
+  std::size_t used_;
+
+private:
+  Arena(const Arena& rhs) = delete;
+  Arena& operator =(const Arena& rhs) = delete;
+};
+
+// Holds on to the arena so it outlives whatever was allocated from it
+template <typename T>
+class ArenaAllocator
+{
+public:
+  typedef T value_type;
+
+  // A container takes its allocator along when it is moved
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  template <typename U>
+  struct rebind
+  {
+    typedef ArenaAllocator<U> other;
+  };
+
+public:
+  ArenaAllocator() noexcept : arena_() {};
+  ArenaAllocator(std::shared_ptr<Arena> arena) noexcept : arena_(std::move(arena)) {};
+
+  // No moves, as a moved from allocator still has to free what it gave out
+  ArenaAllocator(const ArenaAllocator& rhs) noexcept = default;
+  ArenaAllocator& operator =(const ArenaAllocator& rhs) noexcept = default;
+
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& rhs) noexcept : arena_(rhs.get_arena()) {};
+
+public:
+  T * allocate(std::size_t count)
+  {
+    if (!arena_)
+      return static_cast<T *>(::operator new(count * sizeof(T)));
+
+    return static_cast<T *>(arena_->allocate(count * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T * block, std::size_t count)
+  {
+    if (!arena_)
+      ::operator delete(block);
+    else
+      arena_->deallocate(block, count * sizeof(T));
+  }
+
+  const std::shared_ptr<Arena>& get_arena() const { return arena_; };
+
+private:
+  std::shared_ptr<Arena> arena_;
+};
+
+template <typename T, typename U>
+inline bool operator ==(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs)
+{
+  return lhs.get_arena() == rhs.get_arena();
+}
+
+template <typename T, typename U>
+inline bool operator !=(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs)
+{
+  return !(lhs == rhs);
+}
+
+#endif // #if !defined(__ARENA_H__)
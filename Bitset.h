@@ -0,0 +1,141 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Bitset.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Bitset declaration:
+//  This is a growable set of bits packed into machine words.
+//  The words are exposed so callers can test and update a
+//  whole word of neighbors with one operation.  They can come
+//  from an Arena.
+//
+
+#if !defined(__BITSET_H__)
+#define __BITSET_H__
+
+#include "Arena.h"
+
+#include <cstdint>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+class Bitset
+{
+public:
+  typedef std::uint64_t word_t;
+  typedef ArenaAllocator<word_t> allocator_t;
+  static constexpr std::size_t word_bits = 64;
+
+public:
+  Bitset() : words_(), size_(0) {};
+  explicit Bitset(const allocator_t& allocator) : words_(allocator), size_(0) {};
+  virtual ~Bitset() = default;
+
+  Bitset(const Bitset& rhs) = default;
+  Bitset& operator =(const Bitset& rhs) = default;
+
+  // Moving takes the allocator along
+  Bitset(Bitset&& rhs) = default;
+  Bitset& operator =(Bitset&& rhs) = default;
+
+public:
+  std::size_t size() const { return size_; };
+  std::size_t word_count() const { return words_.size(); };
+
+  word_t * data() { return words_.data(); };
+  const word_t * data() const { return words_.data(); };
+
+  word_t& word(std::size_t index) { return words_[index]; };
+  word_t word(std::size_t index) const { return words_[index]; };
+
+  void reserve(std::size_t size) { words_.reserve((size + word_bits - 1) / word_bits); };
+
+  // Grows or shrinks the set.  New bits start out clear.
+  void resize(std::size_t size)
+  {
+    words_.resize((size + word_bits - 1) / word_bits, 0);
+    size_ = size;
+    trim();
+  }
+
+  bool test(std::size_t bit) const
+  {
+    return (words_[bit / word_bits] & mask(bit)) != 0;
+  }
+
+  void set(std::size_t bit) { words_[bit / word_bits] |= mask(bit); };
+  void reset(std::size_t bit) { words_[bit / word_bits] &= ~mask(bit); };
+
+  void set(std::size_t bit, bool value)
+  {
+    if (value)
+      set(bit);
+    else
+      reset(bit);
+  }
+
+  void set_all()
+  {
+    for (auto& word : words_)
+      word = ~word_t(0);
+    trim();
+  }
+
+  void reset_all()
+  {
+    for (auto& word : words_)
+      word = 0;
+  }
+
+  bool any() const
+  {
+    for (auto word : words_)
+      if (word)
+        return true;
+    return false;
+  }
+
+public:
+  // Index of the lowest set bit.  The word must not be zero.
+  static unsigned int lowest_bit(word_t word)
+  {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return static_cast<unsigned int>(index);
+#else
+    return static_cast<unsigned int>(__builtin_ctzll(word));
+#endif
+  }
+
+  static unsigned int count_bits(word_t word)
+  {
+#if defined(_MSC_VER)
+    return static_cast<unsigned int>(__popcnt64(word));
+#else
+    return static_cast<unsigned int>(__builtin_popcountll(word));
+#endif
+  }
+
+private:
+  static word_t mask(std::size_t bit) { return word_t(1) << (bit % word_bits); };
+
+  // Keeps the bits past size() clear so whole word tests stay honest
+  void trim()
+  {
+    auto used = size_ % word_bits;
+    if (used && !words_.empty())
+      words_.back() &= (word_t(1) << used) - 1;
+  }
+
+private:
+  std::vector<word_t, allocator_t> words_;
+  std::size_t size_;
+};
+
+#endif // #if !defined(__BITSET_H__)
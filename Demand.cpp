@@ -0,0 +1,157 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Demand.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the demand models
+//
+
+#include "Demand.h"
+#include "Random.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+// Every episode gets its own generator, which is what makes the
+// random models independent of scheduling
+static Random episode_random(unsigned long long seed, int id, std::uint64_t episode)
+{
+  std::uint64_t state = seed ^ episode;
+  return Random(Random::split_mix(state), static_cast<std::uint64_t>(static_cast<unsigned>(id)));
+}
+
+RandomDemand::RandomDemand(double probability, unsigned long long seed)
+  : threshold_(0)
+  , seed_(seed)
+{
+  // Compare against the top 53 bits so p = 1 needs everything
+  probability = std::min(std::max(probability, 0.0), 1.0);
+  threshold_ = static_cast<std::uint64_t>(probability * static_cast<double>(1ULL << 53));
+}
+
+void RandomDemand::get_demand(int id, std::uint64_t episode,
+  const std::vector<int>& neighbor_ids, Bitset& need)
+{
+  auto random = episode_random(seed_, id, episode);
+  for (std::size_t slot = 0; slot < neighbor_ids.size(); slot++)
+    if ((random.next() >> 11) < threshold_)
+      need.set(slot);
+}
+
+FixedDemand::FixedDemand(std::size_t count, unsigned long long seed)
+  : count_(count)
+  , seed_(seed)
+{
+}
+
+void FixedDemand::get_demand(int id, std::uint64_t episode,
+  const std::vector<int>& neighbor_ids, Bitset& need)
+{
+  auto slots = neighbor_ids.size();
+  if (count_ >= slots)
+  {
+    need.set_all();
+    return;
+  }
+
+  // Floyd's algorithm picks count_ distinct slots in count_ draws
+  auto random = episode_random(seed_, id, episode);
+  for (auto j = slots - count_; j < slots; j++)
+  {
+    auto slot = static_cast<std::size_t>(random.next_below(j + 1));
+    need.set(need.test(slot) ? j : slot);
+  }
+}
+
+bool ScheduleDemand::load(const std::string& path)
+{
+  std::ifstream file(path);
+  if (!file)
+    return false;
+
+  schedule_.clear();
+
+  std::string line;
+  while (std::getline(file, line))
+  {
+    auto comment = line.find('#');
+    if (comment != std::string::npos)
+      line.erase(comment);
+
+    auto colon = line.find(':');
+    if (colon == std::string::npos)
+      continue;
+
+    std::istringstream head(line.substr(0, colon));
+    int id;
+    if (!(head >> id))
+      continue;
+
+    std::vector<int> wanted;
+    std::istringstream tail(line.substr(colon + 1));
+    int neighbor;
+    while (tail >> neighbor)
+      wanted.push_back(neighbor);
+
+    std::sort(wanted.begin(), wanted.end());
+    schedule_[id].push_back(std::move(wanted));
+  }
+
+  return true;
+}
+
+void ScheduleDemand::get_demand(int id, std::uint64_t episode,
+  const std::vector<int>& neighbor_ids, Bitset& need)
+{
+  auto entry = schedule_.find(id);
+  if (entry == schedule_.end())
+  {
+    need.set_all();
+    return;
+  }
+
+  // Anyone named that isn't a neighbor is ignored
+  auto& episodes = entry->second;
+  auto& wanted = episodes[static_cast<std::size_t>(episode % episodes.size())];
+  for (std::size_t slot = 0; slot < neighbor_ids.size(); slot++)
+    if (std::binary_search(wanted.begin(), wanted.end(), neighbor_ids[slot]))
+      need.set(slot);
+}
+
+bool Demand::make(const std::string& spec, std::unique_ptr<IDemandModel>& model,
+  unsigned long long seed)
+{
+  if (spec == "all")
+  {
+    model.reset();
+    return true;
+  }
+
+  if (spec.compare(0, 7, "random=") == 0)
+  {
+    model.reset(new RandomDemand(::atof(spec.c_str() + 7), seed));
+    return true;
+  }
+
+  if (spec.compare(0, 6, "fixed=") == 0)
+  {
+    model.reset(new FixedDemand(static_cast<std::size_t>(::atoll(spec.c_str() + 6)), seed));
+    return true;
+  }
+
+  if (spec.compare(0, 9, "schedule=") == 0)
+  {
+    std::unique_ptr<ScheduleDemand> schedule(new ScheduleDemand());
+    if (!schedule->load(spec.substr(9)))
+      return false;
+
+    model = std::move(schedule);
+    return true;
+  }
+
+  return false;
+}
@@ -0,0 +1,103 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Demand.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Demand declaration:
+//  These are the demand models a table can be run with.  The
+//  random ones are a pure function of the seed, the guest and
+//  the episode, so a run asks for the same bottles no matter
+//  how the threads are scheduled.
+//
+//  A schedule file has one line per thirsty spell, "a: b c d"
+//  meaning guest a needs the bottles it shares with b, c and d.
+//  A guest's lines are used in order and start over when they
+//  run out.  Guests without a line need every bottle.  Blank
+//  lines and anything after a '#' are ignored.
+//
+
+#if !defined(__DEMAND_H__)
+#define __DEMAND_H__
+
+#include "IDemandModel.h"
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Each bottle is needed with probability p
+class RandomDemand
+  : public IDemandModel
+{
+public:
+  RandomDemand(double probability, unsigned long long seed = 0);
+
+public:
+  // IDemandModel interface
+  void get_demand(int id, std::uint64_t episode,
+    const std::vector<int>& neighbor_ids, Bitset& need) override;
+
+private:
+  std::uint64_t threshold_;
+  unsigned long long seed_;
+};
+
+// Exactly count bottles picked at random, or all of them if there
+// aren't that many
+class FixedDemand
+  : public IDemandModel
+{
+public:
+  FixedDemand(std::size_t count, unsigned long long seed = 0);
+
+public:
+  // IDemandModel interface
+  void get_demand(int id, std::uint64_t episode,
+    const std::vector<int>& neighbor_ids, Bitset& need) override;
+
+private:
+  std::size_t count_;
+  unsigned long long seed_;
+};
+
+// Replays a schedule file
+class ScheduleDemand
+  : public IDemandModel
+{
+public:
+  typedef std::vector<std::vector<int>> episode_vector_t;
+  typedef std::unordered_map<int, episode_vector_t> schedule_map_t;
+
+public:
+  ScheduleDemand() = default;
+
+  // Returns false if the file can't be read
+  bool load(const std::string& path);
+
+public:
+  // IDemandModel interface
+  void get_demand(int id, std::uint64_t episode,
+    const std::vector<int>& neighbor_ids, Bitset& need) override;
+
+private:
+  // Each episode's neighbor ids are kept sorted
+  schedule_map_t schedule_;
+};
+
+class Demand
+{
+public:
+  // Builds a model from all, random=P, fixed=K or schedule=path.  all
+  // leaves model empty, which is how a philosopher runs without one.
+  // Returns false for a spec we don't understand or can't load.
+  static bool make(const std::string& spec, std::unique_ptr<IDemandModel>& model,
+    unsigned long long seed = 0);
+
+private:
+  Demand() = delete;
+};
+
+#endif // #if !defined(__DEMAND_H__)
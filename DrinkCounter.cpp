@@ -0,0 +1,159 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// DrinkCounter.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the DrinkCounter class
+//
+
+#include "DrinkCounter.h"
+
+#include <algorithm>
+#include <limits>
+
+constexpr std::size_t DrinkCounter::cache_line;
+constexpr std::uint64_t DrinkCounter::vacant;
+
+DrinkCounter::DrinkCounter(std::size_t count, int first_id)
+  : counts_(new counter_t[count])
+  , size_(count)
+  , first_id_(first_id)
+  , minimum_(0)
+  , at_minimum_(static_cast<long long>(count))
+  , wait_target_(std::numeric_limits<std::size_t>::max())
+{
+  // Everyone starts at the minimum of zero drinks
+  for (std::size_t i = 0; i < size_; i++)
+  {
+    counts_[i].value = 1;
+    counts_[i].base = 0;
+  }
+}
+
+std::size_t DrinkCounter::get_total() const
+{
+  std::size_t total = 0;
+  for (std::size_t i = 0; i < size_; i++)
+    total += get_count(i);
+
+  return total;
+}
+
+std::vector<std::size_t> DrinkCounter::get_counts() const
+{
+  std::vector<std::size_t> counts(size_);
+  for (std::size_t i = 0; i < size_; i++)
+    counts[i] = get_count(i);
+
+  return counts;
+}
+
+bool DrinkCounter::wait_for_minimum(std::size_t target, std::chrono::milliseconds max_wait)
+{
+  auto end_time = std::chrono::steady_clock::now() + max_wait;
+
+  std::unique_lock<std::mutex> lock(wait_lock_);
+  wait_target_ = target;
+
+  bool reached = wait_cv_.wait_until(lock, end_time, [this, target] { return minimum_ >= target; });
+
+  wait_target_ = std::numeric_limits<std::size_t>::max();
+  return reached;
+}
+
+void DrinkCounter::leave(std::size_t index)
+{
+  if (index >= size_)
+    return;
+
+  std::uint64_t value;
+
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(seats_lock_);
+    value = counts_[index].value.exchange(vacant);
+  }
+
+  // Same as a drink if the guest was holding the minimum back
+  if ((value & 1) && at_minimum_.fetch_sub(1) == 1)
+    advance_minimum();
+}
+
+// The newcomer is marked at the minimum, so it is counted in this
+// round whether or not anyone is finding the next one
+void DrinkCounter::join(std::size_t index)
+{
+  if (index >= size_)
+    return;
+
+  std::unique_lock<std::mutex> lock(seats_lock_);
+  auto& counter = counts_[index];
+  if (counter.value.load() >> 1 != vacant >> 1)
+    return;
+
+  std::uint64_t minimum = minimum_;
+  counter.base = minimum;
+  counter.value = (minimum << 1) | 1;
+  at_minimum_++;
+}
+
+// IDrinkListener interface
+void DrinkCounter::report_drink(int id)
+{
+  id -= first_id_;
+  if (id < 0 || static_cast<std::size_t>(id) >= size_)
+    return;
+
+  // Count the drink and drop the minimum mark in one step
+  auto& counter = counts_[id].value;
+  auto value = counter.load(std::memory_order_relaxed);
+  while (!counter.compare_exchange_weak(value, (value + 2) & ~std::uint64_t(1)))
+    ;
+
+  // If we were the last one holding the minimum back, move it along
+  if ((value & 1) && at_minimum_.fetch_sub(1) == 1)
+    advance_minimum();
+}
+
+// Finds the new minimum and marks the counters sitting at it.  A
+// counter can move on while we are marking, which can leave nobody at
+// the minimum we publish.  Then it is on us to go around again.
+void DrinkCounter::advance_minimum()
+{
+  std::unique_lock<std::mutex> lock(seats_lock_);
+
+  for (;;)
+  {
+    // Empty seats never hold the minimum.  With nobody seated there
+    // is no new one, and whoever joins is counted at the old one.
+    auto minimum = vacant >> 1;
+    for (std::size_t i = 0; i < size_; i++)
+      minimum = std::min(minimum, counts_[i].value.load() >> 1);
+
+    if (minimum == vacant >> 1)
+      return;
+
+    long long marked = 0;
+    for (std::size_t i = 0; i < size_; i++)
+    {
+      auto expected = minimum << 1;
+      if (counts_[i].value.compare_exchange_strong(expected, expected | 1))
+        marked++;
+    }
+
+    minimum_ = static_cast<std::size_t>(minimum);
+    if (minimum_ >= wait_target_)
+    {
+      // Taking the lock means the waiter is either still ahead of its
+      // check or already asleep
+      std::unique_lock<std::mutex> wait_lock(wait_lock_);
+      wait_cv_.notify_all();
+    }
+
+    // Counters that left after we marked them have already taken
+    // themselves off.  If that covers everyone, the minimum is stale.
+    if (at_minimum_.fetch_add(marked) + marked != 0)
+      return;
+  }
+}
@@ -0,0 +1,105 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// DrinkCounter.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// DrinkCounter declaration:
+//  This counts the drinks of a range of guests and keeps the
+//  lowest count up to date as they come in, so waiting for
+//  everyone to reach a count doesn't mean polling them all.
+//
+//  Guests can leave and join while it counts.  An empty seat
+//  doesn't hold the minimum back, and a guest who sits down
+//  starts out at the minimum.
+//
+
+#if !defined(__DRINKCOUNTER_H__)
+#define __DRINKCOUNTER_H__
+
+#include "IDrinkListener.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class DrinkCounter
+  : public IDrinkListener
+{
+public:
+  static constexpr std::size_t cache_line = 64;
+
+  // Every guest bumps its own counter so they are kept a cache line
+  // apart.  The low bit marks a counter that is still counted in
+  // at_minimum_.  Base is where the guest in the seat started.
+  struct counter_t
+  {
+    std::atomic<std::uint64_t> value;
+    std::atomic<std::uint64_t> base;
+    char padding[cache_line - 2 * sizeof(std::atomic<std::uint64_t>)];
+  };
+
+  // What an empty seat's counter holds, above any real count
+  static constexpr std::uint64_t vacant = ~std::uint64_t(1);
+
+public:
+  // Counts the guests numbered [first_id, first_id + count)
+  DrinkCounter(std::size_t count, int first_id = 0);
+  virtual ~DrinkCounter() = default;
+
+public:
+  std::size_t size() const { return size_; };
+  std::size_t get_minimum() const { return minimum_; };
+  std::size_t get_count(std::size_t index) const
+  {
+    auto value = counts_[index].value.load(std::memory_order_relaxed) >> 1;
+    return (value == vacant >> 1) ? 0
+      : static_cast<std::size_t>(value - counts_[index].base.load(std::memory_order_relaxed));
+  };
+  std::size_t get_total() const;
+  std::vector<std::size_t> get_counts() const;
+
+  // Returns false if the minimum didn't reach the target in time
+  bool wait_for_minimum(std::size_t target, std::chrono::milliseconds max_wait);
+
+  // Empties a seat or seats someone new in an empty one.  The guest
+  // in the seat must not be drinking while this happens.
+  void leave(std::size_t index);
+  void join(std::size_t index);
+
+public:
+  // IDrinkListener interface
+  void report_drink(int id) override;
+
+private:
+  void advance_minimum();
+
+private:
+  std::unique_ptr<counter_t[]> counts_;
+  std::size_t size_;
+  int first_id_;
+
+  // at_minimum_ is how many counters are still at minimum_.  Whoever
+  // takes it to zero finds the new minimum.  Seats only change while
+  // nobody is finding it.
+  std::atomic<std::size_t> minimum_;
+  std::atomic<long long> at_minimum_;
+  std::mutex seats_lock_;
+
+  // The minimum a waiter is after.  Whoever moves the minimum past it
+  // wakes them up.
+  std::atomic<std::size_t> wait_target_;
+  std::mutex wait_lock_;
+  std::condition_variable wait_cv_;
+
+private:
+  DrinkCounter(const DrinkCounter& rhs) = delete;
+  DrinkCounter& operator =(const DrinkCounter& rhs) = delete;
+};
+
+#endif // #if !defined(__DRINKCOUNTER_H__)
@@ -0,0 +1,124 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Duration.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the duration models
+//
+
+#include "Duration.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+static std::chrono::nanoseconds from_ns(double ns)
+{
+  return std::chrono::nanoseconds(static_cast<long long>(std::max(ns, 0.0)));
+}
+
+static std::chrono::nanoseconds from_ms(double ms)
+{
+  return from_ns(ms * 1e6);
+}
+
+// Reads "a" or "a:b".  Returns false if there is nothing to read.
+static bool parse_pair(const std::string& text, double& first, double& second)
+{
+  char * end = nullptr;
+  first = std::strtod(text.c_str(), &end);
+  if (end == text.c_str())
+    return false;
+
+  if (*end == ':')
+  {
+    auto rest = end + 1;
+    second = std::strtod(rest, &end);
+    if (end == rest)
+      return false;
+  }
+
+  return *end == '\0';
+}
+
+ConstantDuration::ConstantDuration(std::chrono::nanoseconds duration)
+  : duration_(duration)
+{
+}
+
+std::chrono::nanoseconds ConstantDuration::get_duration(Random&) const
+{
+  return duration_;
+}
+
+UniformDuration::UniformDuration(std::chrono::nanoseconds minimum, std::chrono::nanoseconds maximum)
+  : minimum_(minimum)
+  , maximum_(std::max(minimum, maximum))
+{
+}
+
+std::chrono::nanoseconds UniformDuration::get_duration(Random& random) const
+{
+  auto range = static_cast<std::uint64_t>((maximum_ - minimum_).count());
+  if (!range)
+    return minimum_;
+
+  return minimum_ + std::chrono::nanoseconds(static_cast<long long>(random.next_below(range)));
+}
+
+ExponentialDuration::ExponentialDuration(std::chrono::nanoseconds mean)
+  : mean_ns_(static_cast<double>(mean.count()))
+{
+}
+
+std::chrono::nanoseconds ExponentialDuration::get_duration(Random& random) const
+{
+  return from_ns(-mean_ns_ * std::log(random.next_positive()));
+}
+
+ParetoDuration::ParetoDuration(std::chrono::nanoseconds minimum, double alpha)
+  : minimum_ns_(static_cast<double>(minimum.count()))
+  , inverse_alpha_(alpha > 0 ? 1.0 / alpha : 1.0)
+{
+}
+
+std::chrono::nanoseconds ParetoDuration::get_duration(Random& random) const
+{
+  // Capped at an hour so a freak sample can't overflow the clock
+  auto ns = minimum_ns_ / std::pow(random.next_positive(), inverse_alpha_);
+  return from_ns(std::min(ns, 3600e9));
+}
+
+const UniformDuration& Duration::get_default_wait()
+{
+  static const UniformDuration wait(std::chrono::milliseconds(5), std::chrono::milliseconds(25));
+  return wait;
+}
+
+bool Duration::make(const std::string& spec, std::unique_ptr<IDurationModel>& model)
+{
+  auto equals = spec.find('=');
+  if (equals == std::string::npos)
+    return false;
+
+  auto name = spec.substr(0, equals);
+  double first = 0;
+  double second = -1;
+  if (!parse_pair(spec.substr(equals + 1), first, second))
+    return false;
+
+  if (name == "constant")
+    model.reset(new ConstantDuration(from_ms(first)));
+  else if (name == "uniform" && second >= 0)
+    model.reset(new UniformDuration(from_ms(first), from_ms(second)));
+  else if (name == "exp")
+    model.reset(new ExponentialDuration(from_ms(first)));
+  else if (name == "pareto" && second > 0)
+    model.reset(new ParetoDuration(from_ms(first), second));
+  else
+    return false;
+
+  return true;
+}
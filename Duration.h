@@ -0,0 +1,100 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Duration.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Duration declaration:
+//  These are the duration models for the tranquil and drinking
+//  periods.  Times on the command line are in milliseconds and
+//  may have a fraction, so 0.01 is 10 microseconds.
+//
+
+#if !defined(__DURATION_H__)
+#define __DURATION_H__
+
+#include "IDurationModel.h"
+
+#include <memory>
+#include <string>
+
+// Always the same time
+class ConstantDuration
+  : public IDurationModel
+{
+public:
+  ConstantDuration(std::chrono::nanoseconds duration);
+
+public:
+  // IDurationModel interface
+  std::chrono::nanoseconds get_duration(Random& random) const override;
+
+private:
+  std::chrono::nanoseconds duration_;
+};
+
+// Anywhere from minimum up to but not including maximum
+class UniformDuration
+  : public IDurationModel
+{
+public:
+  UniformDuration(std::chrono::nanoseconds minimum, std::chrono::nanoseconds maximum);
+
+public:
+  // IDurationModel interface
+  std::chrono::nanoseconds get_duration(Random& random) const override;
+
+private:
+  std::chrono::nanoseconds minimum_;
+  std::chrono::nanoseconds maximum_;
+};
+
+// Memoryless, like arrivals at a server
+class ExponentialDuration
+  : public IDurationModel
+{
+public:
+  ExponentialDuration(std::chrono::nanoseconds mean);
+
+public:
+  // IDurationModel interface
+  std::chrono::nanoseconds get_duration(Random& random) const override;
+
+private:
+  double mean_ns_;
+};
+
+// Pareto: never less than minimum, with a tail that gets heavier
+// as alpha drops.  The mean is infinite for alpha of 1 or less.
+class ParetoDuration
+  : public IDurationModel
+{
+public:
+  ParetoDuration(std::chrono::nanoseconds minimum, double alpha);
+
+public:
+  // IDurationModel interface
+  std::chrono::nanoseconds get_duration(Random& random) const override;
+
+private:
+  double minimum_ns_;
+  double inverse_alpha_;
+};
+
+class Duration
+{
+public:
+  // Builds a model from constant=MS, uniform=MIN:MAX, exp=MEAN or
+  // pareto=MIN:ALPHA.  Returns false for a spec we don't understand.
+  static bool make(const std::string& spec, std::unique_ptr<IDurationModel>& model);
+
+  // What a philosopher waits between drinks without a tranquil model,
+  // 5 to 25 ms.  Every kind of philosopher uses this one.
+  static const UniformDuration& get_default_wait();
+
+private:
+  Duration() = delete;
+};
+
+#endif // #if !defined(__DURATION_H__)
@@ -0,0 +1,24 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Edge.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Edge declaration:
+//  An edge is a pair of guest ids that share a bottle, and the
+//  graph of who sits with whom is a list of them.  The tables,
+//  the topology generators, the partitioner and the transports
+//  all pass graphs around, so they share these on their own.
+//
+
+#if !defined(__EDGE_H__)
+#define __EDGE_H__
+
+#include <utility>
+#include <vector>
+
+typedef std::pair<int, int> edge_t;
+typedef std::vector<edge_t> edge_vector_t;
+
+#endif // #if !defined(__EDGE_H__)
@@ -0,0 +1,90 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Epoch.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the Epoch class
+//  Retiring an object moves the epoch along.  Anyone who entered
+//  after that saw the object already gone, so the object can be
+//  freed once nobody is left in an epoch at or before its own.
+//
+
+#include "Epoch.h"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+
+constexpr std::size_t Epoch::cache_line;
+
+Epoch::Epoch(std::size_t participants)
+  : epoch_(1)
+  , slots_(new slot_t[participants])
+  , count_(participants)
+  , retired_lock_()
+  , retired_()
+{
+  for (std::size_t i = 0; i < count_; i++)
+    slots_[i].epoch = 0;
+}
+
+std::uint64_t Epoch::retire(std::shared_ptr<void> object)
+{
+  std::unique_lock<std::mutex> lock(retired_lock_);
+  auto epoch = epoch_.fetch_add(1);
+  if (object)
+    retired_.push_back({ epoch, std::move(object) });
+
+  return epoch;
+}
+
+bool Epoch::passed(std::uint64_t epoch)
+{
+  return epoch < get_oldest();
+}
+
+std::size_t Epoch::collect()
+{
+  auto oldest = get_oldest();
+
+  // Let go of the objects outside of the lock in case freeing one
+  // retires another
+  std::vector<retired_t> freed;
+
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(retired_lock_);
+    auto keep = std::partition(retired_.begin(), retired_.end(),
+      [oldest](const retired_t& retired) { return retired.epoch >= oldest; });
+
+    std::move(keep, retired_.end(), std::back_inserter(freed));
+    retired_.erase(keep, retired_.end());
+  }
+
+  return freed.size();
+}
+
+// The oldest epoch anyone is still in, or the highest there is if
+// nobody is looking
+std::uint64_t Epoch::get_oldest()
+{
+  // Pairs with the fence in enter()
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  auto oldest = std::numeric_limits<std::uint64_t>::max();
+  for (std::size_t i = 0; i < count_; i++)
+  {
+    auto epoch = slots_[i].epoch.load(std::memory_order_acquire);
+    if (epoch)
+      oldest = std::min(oldest, epoch);
+  }
+
+  return oldest;
+}
+
+std::size_t Epoch::get_retired_count()
+{
+  std::unique_lock<std::mutex> lock(retired_lock_);
+  return retired_.size();
+}
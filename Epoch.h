@@ -0,0 +1,112 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Epoch.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Epoch declaration:
+//  This is epoch based reclamation.  Each participant says when
+//  it starts and stops looking at shared objects, which is one
+//  store each way.  An object that was taken out of sight is
+//  retired instead of freed, and freed once everyone who was
+//  looking when it was retired has stopped.
+//
+
+#if !defined(__EPOCH_H__)
+#define __EPOCH_H__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class Epoch
+{
+public:
+  static constexpr std::size_t cache_line = 64;
+
+  // Zero means the participant isn't looking
+  struct slot_t
+  {
+    std::atomic<std::uint64_t> epoch;
+    char padding[cache_line - sizeof(std::atomic<std::uint64_t>)];
+  };
+
+  struct retired_t
+  {
+    std::uint64_t epoch;
+    std::shared_ptr<void> object;
+  };
+
+  // Stays in the epoch for as long as it is in scope.  Does nothing
+  // without an epoch.
+  class Guard
+  {
+  public:
+    Guard(Epoch * epoch, std::size_t participant) : epoch_(epoch), participant_(participant) { if (epoch_) epoch_->enter(participant_); };
+    ~Guard() { if (epoch_) epoch_->exit(participant_); };
+
+  private:
+    Epoch * epoch_;
+    std::size_t participant_;
+
+  private:
+    Guard(const Guard& rhs) = delete;
+    Guard& operator =(const Guard& rhs) = delete;
+  };
+
+public:
+  Epoch(std::size_t participants);
+  virtual ~Epoch() = default;
+
+public:
+  // A participant must not enter twice without exiting
+  void enter(std::size_t participant)
+  {
+    slots_[participant].epoch.store(epoch_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+    // Pairs with the fence in collect().  Either it sees us or we see
+    // the object already gone.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  void exit(std::size_t participant)
+  {
+    slots_[participant].epoch.store(0, std::memory_order_release);
+  }
+
+  // The object must already be out of sight.  Whatever it holds is
+  // let go of by collect() or when we go away.  Returns the epoch it
+  // was retired in.
+  std::uint64_t retire(std::shared_ptr<void> object);
+
+  // True once nobody is left in the epoch or any before it.  For
+  // things that aren't objects, like a slot number going back on a
+  // free list, with an epoch from retire().
+  bool passed(std::uint64_t epoch);
+
+  // Frees what nobody can still be looking at.  Returns how many.
+  std::size_t collect();
+
+  std::size_t get_participant_count() const { return count_; };
+  std::size_t get_retired_count();
+
+private:
+  std::uint64_t get_oldest();
+
+private:
+  std::atomic<std::uint64_t> epoch_;
+  std::unique_ptr<slot_t[]> slots_;
+  std::size_t count_;
+
+  std::mutex retired_lock_;
+  std::vector<retired_t> retired_;
+
+private:
+  Epoch(const Epoch& rhs) = delete;
+  Epoch& operator =(const Epoch& rhs) = delete;
+};
+
+#endif // #if !defined(__EPOCH_H__)
@@ -0,0 +1,324 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Executor.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the Executor class
+//  Tasks posted from a worker stay on that worker so a burst
+//  of sends doesn't funnel through one queue.  Tasks posted
+//  from outside are dealt round robin.  A worker that runs
+//  dry steals half of a random victim's deque before parking.
+//
+
+#include "Executor.h"
+#include "Tsc.h"
+
+#include <limits>
+
+// Lets post() find the deque of the worker it is called from
+static thread_local Executor * current_executor = nullptr;
+static thread_local std::size_t current_worker = 0;
+
+static constexpr auto no_timer(std::numeric_limits<IScheduler::time_point_t::rep>::max());
+
+Executor::Executor(std::size_t workers)
+  : workers_()
+  , next_worker_(0)
+  , timers_()
+  , next_timer_(no_timer)
+  , firing_(0)
+  , sleepers_(0)
+  , quit_(false)
+{
+  if (workers == 0)
+    workers = std::thread::hardware_concurrency();
+
+  // hardware_concurrency is allowed to return zero when it can't tell
+  if (workers == 0)
+    workers = 1;
+
+  // All the workers have to exist before any of them can steal
+  for (std::size_t i = 0; i < workers; i++)
+  {
+    workers_.emplace_back(new worker_t());
+    workers_.back()->seed = static_cast<unsigned int>(i * 2654435761u + 1);
+  }
+
+  for (std::size_t i = 0; i < workers; i++)
+    workers_[i]->thread = std::thread(&Executor::work, this, i);
+}
+
+Executor::~Executor()
+{
+  stop();
+}
+
+void Executor::stop()
+{
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(park_lock_);
+    quit_ = true;
+    park_cv_.notify_all();
+  }
+
+  for (auto& worker : workers_)
+    if (worker->thread.joinable())
+      worker->thread.join();
+}
+
+void Executor::cancel(ITask * task)
+{
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(timers_lock_);
+
+    // A priority queue can't take out one entry, so sift the rest
+    // into a new one.  Only done when a guest leaves.
+    timer_queue_t kept;
+    for (; !timers_.empty(); timers_.pop())
+      if (timers_.top().task != task)
+        kept.push(timers_.top());
+
+    timers_.swap(kept);
+    next_timer_ = timers_.empty() ? no_timer : timers_.top().when.time_since_epoch().count();
+  }
+
+  // A worker may have taken the timer out before we got the lock
+  while (firing_.load() > 0)
+    std::this_thread::yield();
+}
+
+std::size_t Executor::pin(const Affinity::cpu_vector_t& cpus)
+{
+  if (cpus.empty())
+    return 0;
+
+  std::size_t pinned = 0;
+  for (std::size_t i = 0; i < workers_.size(); i++)
+    if (Affinity::pin(workers_[i]->thread, cpus[i % cpus.size()].cpu))
+      pinned++;
+
+  return pinned;
+}
+
+// IScheduler interface
+void Executor::post(ITask * task)
+{
+  // Keep work on the posting worker when we can.  It is most likely
+  // the one with the neighbor's state in cache.  A task placed with
+  // its neighbors knows better.
+  auto home = task->get_home();
+  auto index = (home >= 0)
+    ? static_cast<std::size_t>(home) % workers_.size()
+    : (current_executor == this)
+    ? current_worker
+    : next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+
+  auto& worker = *workers_[index];
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(worker.lock);
+    worker.tasks.push_back(task);
+  }
+
+  // Pairs with the fence in park() so either we see the sleeper or
+  // the sleeper sees our task
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers_.load(std::memory_order_relaxed) > 0)
+  {
+    std::unique_lock<std::mutex> lock(park_lock_);
+    park_cv_.notify_one();
+  }
+}
+
+void Executor::post_at(ITask * task, time_point_t when)
+{
+  bool earliest = false;
+
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(timers_lock_);
+    timers_.push({ when, task });
+
+    if (timers_.top().task == task && timers_.top().when == when)
+    {
+      next_timer_ = when.time_since_epoch().count();
+      earliest = true;
+    }
+  }
+
+  // Parked workers are sleeping until a later deadline
+  if (earliest && sleepers_.load() > 0)
+  {
+    std::unique_lock<std::mutex> lock(park_lock_);
+    park_cv_.notify_one();
+  }
+}
+
+void Executor::deliver(ITask * task, Mailbox * mailbox, Mailbox::message_t * message, std::uint8_t tokens)
+{
+  // Whoever queued the message already woke the task
+  if (mailbox->post(message, tokens))
+    task->wake();
+}
+
+IScheduler::time_point_t Executor::now()
+{
+  return std::chrono::steady_clock::now();
+}
+
+std::uint64_t Executor::get_ticks()
+{
+  return Tsc::now();
+}
+
+ITask * Executor::pop(worker_t& worker)
+{
+  std::unique_lock<std::mutex> lock(worker.lock);
+  if (worker.tasks.empty())
+    return nullptr;
+
+  auto task = worker.tasks.front();
+  worker.tasks.pop_front();
+  return task;
+}
+
+// Takes half of a victim's tasks.  Returns one to run right away
+// and puts the rest on our own deque.
+ITask * Executor::steal(std::size_t index)
+{
+  auto& self = *workers_[index];
+  auto count = workers_.size();
+  if (count < 2)
+    return nullptr;
+
+  // Start at a random victim so thieves spread out
+  self.seed = self.seed * 1103515245u + 12345u;
+  auto start = (self.seed >> 16) % count;
+
+  for (std::size_t i = 0; i < count; i++)
+  {
+    auto victim_index = (start + i) % count;
+    if (victim_index == index)
+      continue;
+
+    auto& victim = *workers_[victim_index];
+
+    { // Scope for lock
+      std::unique_lock<std::mutex> lock(victim.lock);
+      auto take = (victim.tasks.size() + 1) / 2;
+      for (std::size_t j = 0; j < take; j++)
+      {
+        self.scratch.push_back(victim.tasks.back());
+        victim.tasks.pop_back();
+      }
+    }
+
+    if (self.scratch.empty())
+      continue;
+
+    auto task = self.scratch.back();
+    self.scratch.pop_back();
+
+    if (!self.scratch.empty())
+    {
+      std::unique_lock<std::mutex> lock(self.lock);
+      for (auto stolen : self.scratch)
+        self.tasks.push_back(stolen);
+    }
+
+    self.scratch.clear();
+    return task;
+  }
+
+  return nullptr;
+}
+
+void Executor::fire_timers(worker_t& worker)
+{
+  auto now = std::chrono::steady_clock::now();
+  if (now.time_since_epoch().count() < next_timer_.load(std::memory_order_relaxed))
+    return;
+
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(timers_lock_);
+    while (!timers_.empty() && timers_.top().when <= now)
+    {
+      worker.scratch.push_back(timers_.top().task);
+      timers_.pop();
+    }
+
+    next_timer_ = timers_.empty() ? no_timer : timers_.top().when.time_since_epoch().count();
+    if (worker.scratch.empty())
+      return;
+
+    firing_++;
+  }
+
+  // Waking a task may post it, so this is done without the lock
+  for (auto task : worker.scratch)
+    task->wake();
+
+  worker.scratch.clear();
+  firing_--;
+}
+
+void Executor::park()
+{
+  std::unique_lock<std::mutex> lock(park_lock_);
+  sleepers_++;
+
+  // Pairs with the fence in post().  Look one more time for work now
+  // that anyone posting can see we are about to sleep.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  bool idle = true;
+  for (auto& worker : workers_)
+  {
+    std::unique_lock<std::mutex> worker_lock(worker->lock);
+    if (!worker->tasks.empty())
+    {
+      idle = false;
+      break;
+    }
+  }
+
+  if (idle && !quit_)
+  {
+    auto next = next_timer_.load();
+    if (next == no_timer)
+      park_cv_.wait(lock);
+    else
+      park_cv_.wait_until(lock, time_point_t(time_point_t::duration(next)));
+  }
+
+  sleepers_--;
+}
+
+void Executor::work(std::size_t index)
+{
+  current_executor = this;
+  current_worker = index;
+
+  auto& self = *workers_[index];
+
+  while (!quit_)
+  {
+    fire_timers(self);
+
+    auto task = pop(self);
+    if (!task)
+      task = steal(index);
+
+    if (task)
+    {
+      task->run();
+      continue;
+    }
+
+    // Nothing to run or steal.  Sleep until something is posted or the
+    // next timer fires.
+    park();
+  }
+
+  current_executor = nullptr;
+}
@@ -0,0 +1,117 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Executor.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Executor declaration:
+//  This is a fixed pool of worker threads that run tasks
+//  when they are posted.  Each worker has its own deque of
+//  tasks and an idle worker steals half of someone else's.
+//  Tasks can also ask to be woken at a later time which is
+//  used for the tranquil timer.  A task with a home is always
+//  posted to that worker, though idle workers may still steal it.
+//
+
+#if !defined(__EXECUTOR_H__)
+#define __EXECUTOR_H__
+
+#include "Affinity.h"
+#include "IScheduler.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class Executor final
+  : public IScheduler
+{
+public:
+  struct timer_entry_t
+  {
+    time_point_t when;
+    ITask * task;
+
+    // Sorts the earliest timer to the top of the priority queue
+    bool operator <(const timer_entry_t& rhs) const { return when > rhs.when; };
+  };
+
+  typedef std::priority_queue<timer_entry_t> timer_queue_t;
+  typedef std::vector<ITask *> task_vector_t;
+
+  struct worker_t
+  {
+    // The owner pops from the front and thieves take from the back
+    std::deque<ITask *> tasks;
+    std::mutex lock;
+
+    // Scratch space so stealing and timers don't allocate
+    task_vector_t scratch;
+    unsigned int seed;
+
+    std::thread thread;
+  };
+
+public:
+  // A worker count of zero sizes the pool to the core count
+  Executor(std::size_t workers = 0);
+  virtual ~Executor();
+
+public:
+  void stop();
+
+  // Pins worker i to cpus[i % size].  Returns how many were pinned.
+  std::size_t pin(const Affinity::cpu_vector_t& cpus);
+
+  std::size_t get_worker_count() const { return workers_.size(); };
+
+  // Drops the task's timers, including any a worker is firing right
+  // now, so it can be freed once it is idle
+  void cancel(ITask * task);
+
+public:
+  // IScheduler interface
+  void post(ITask * task) override;
+  void post_at(ITask * task, time_point_t when) override;
+  void deliver(ITask * task, Mailbox * mailbox, Mailbox::message_t * message, std::uint8_t tokens) override;
+  time_point_t now() override;
+  std::uint64_t get_ticks() override;
+  bool is_virtual() override { return false; };
+
+private:
+  ITask * pop(worker_t& worker);
+  ITask * steal(std::size_t index);
+  void fire_timers(worker_t& worker);
+  void park();
+  void work(std::size_t index);
+
+private:
+  std::vector<std::unique_ptr<worker_t>> workers_;
+  std::atomic<std::size_t> next_worker_;
+
+  // The earliest timer is mirrored in next_timer_ so workers
+  // don't have to take the timer lock to see nothing is due
+  timer_queue_t timers_;
+  std::mutex timers_lock_;
+  std::atomic<time_point_t::rep> next_timer_;
+  std::atomic<int> firing_;   // Workers waking timers outside the lock
+
+  // Idle workers park here until a task is posted
+  std::mutex park_lock_;
+  std::condition_variable park_cv_;
+  std::atomic<int> sleepers_;
+
+  std::atomic<bool> quit_;
+
+private:
+  Executor(const Executor& rhs) = delete;
+  Executor& operator =(const Executor& rhs) = delete;
+};
+
+#endif // #if !defined(__EXECUTOR_H__)
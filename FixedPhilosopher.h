@@ -0,0 +1,391 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// FixedPhilosopher.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// FixedPhilosopher declaration:
+//  This is Philosopher cut down to the drinking philosophers on a
+//  graph where nobody has more than Degree neighbors, with the
+//  degree and the way tokens travel fixed at compile time.  The
+//  bottles are one word of bits, the neighbors sit in arrays,
+//  the states are a switch and every send is a direct call that
+//  already knows which slot it lands in.  There is no lock: only
+//  our own worker ever touches our bottles.
+//
+//  It always runs on an Executor and needs every bottle for every
+//  drink.  Demand models, traces, stats and graphs of any degree
+//  are left to Philosopher.
+//
+//  Transport decides what a neighbor is and how a token reaches
+//  it.  It provides a peer_t and
+//    static void send(peer_t peer, std::size_t slot, Mailbox::message_type type, bool dirty);
+//  where slot is where the sender sits in the neighbor's arrays.
+//
+
+#if !defined(__FIXEDPHILOSOPHER_H__)
+#define __FIXEDPHILOSOPHER_H__
+
+#include "Bitset.h"
+#include "Duration.h"
+#include "Executor.h"
+#include "IDrinkListener.h"
+#include "IDurationModel.h"
+#include "Logger.h"
+#include "Mailbox.h"
+#include "Random.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+template <std::size_t Degree, typename Transport>
+class FixedPhilosopher final
+  : public ITask
+{
+  static_assert(Degree >= 1 && Degree <= 64, "The bottles must fit in one word");
+
+public:
+  typedef std::uint64_t mask_t;
+  typedef typename Transport::peer_t peer_t;
+
+  enum bottle_state {tranquil, thirsty, drinking};
+  enum task_state {task_idle, task_queued, task_running, task_rerun};
+
+public:
+  FixedPhilosopher()
+    : id_(-1)
+    , state_(tranquil)
+    , count_(0)
+    , neighbor_ids_()
+    , peers_()
+    , back_slots_()
+    , inbox_()
+    , bot_(0)
+    , reqb_(0)
+    , need_(0)
+    , dirty_(0)
+    , mailbox_()
+    , executor_(nullptr)
+    , listener_(nullptr)
+    , log_(nullptr)
+    , wait_(false)
+    , random_(0)
+    , tranquil_(nullptr)
+    , drinking_(nullptr)
+    , end_tranquil_()
+    , end_drinking_()
+    , timer_()
+    , start_(false)
+    , quit_(false)
+    , task_state_(task_idle)
+    , home_(-1)
+  {
+  }
+
+public:
+  // Must be called once before anything else
+  void init(int id, Logger& log, Executor& executor, IDrinkListener * listener)
+  {
+    id_ = id;
+    log_ = &log;
+    executor_ = &executor;
+    listener_ = listener;
+    random_ = Random(0, static_cast<std::uint64_t>(id));
+    end_tranquil_ = executor.now();
+  }
+
+  int get_id() const { return id_; };
+  std::size_t get_neighbor_count() const { return count_; };
+
+  inline void set_listener(IDrinkListener * listener) { listener_ = listener; };
+  inline void set_wait(bool wait) { wait_ = wait; };
+  inline void set_seed(std::uint64_t seed) { random_ = Random(seed, static_cast<std::uint64_t>(id_)); };
+  inline void set_tranquil(const IDurationModel * tranquil) { tranquil_ = tranquil; };
+  inline void set_drinking(const IDurationModel * drinking) { drinking_ = drinking; };
+  inline void set_home(int home) { home_ = home; };
+
+  // Same as Philosopher::add_neighbor, plus where we sit in the
+  // neighbor's arrays.  Returns false once we have Degree neighbors.
+  bool add_neighbor(int id, peer_t peer, std::size_t back_slot, bool bottle)
+  {
+    if (count_ == Degree)
+      return false;
+
+    auto slot = count_++;
+    neighbor_ids_[slot] = id;
+    peers_[slot] = peer;
+    back_slots_[slot] = back_slot;
+    inbox_[slot].next = nullptr;
+    inbox_[slot].slot = static_cast<std::uint32_t>(slot);
+    inbox_[slot].tokens = 0;
+
+    auto bit = mask_t(1) << slot;
+    if (bottle)
+    {
+      bot_ |= bit;
+      dirty_ |= bit;
+    }
+    else
+      reqb_ |= bit;
+
+    return true;
+  }
+
+  void start()
+  {
+    start_ = true;
+    wake();
+  }
+
+  void quit() { quit_ = true; };
+
+  // Runs on the sender's worker.  The token is applied on ours.
+  void push(std::size_t slot, Mailbox::message_type type, bool dirty)
+  {
+    mailbox_.post(&inbox_[slot], Mailbox::token(type, dirty));
+    wake();
+  }
+
+public:
+  // ITask interface
+  void run() override
+  {
+    task_state_ = task_running;
+
+    auto more = step();
+
+    auto expected = task_running;
+    if (!more && task_state_.compare_exchange_strong(expected, task_idle))
+      return;
+
+    task_state_ = task_queued;
+    executor_->post(this);
+  }
+
+  void wake() override
+  {
+    auto state = task_state_.load();
+    for (;;)
+    {
+      if (state == task_idle)
+      {
+        if (task_state_.compare_exchange_weak(state, task_queued))
+        {
+          executor_->post(this);
+          return;
+        }
+      }
+      else if (state == task_running)
+      {
+        if (task_state_.compare_exchange_weak(state, task_rerun))
+          return;
+      }
+      else
+        return;
+    }
+  }
+
+  int get_home() override { return home_; };
+
+private:
+  template <typename Callback>
+  static void for_each_bit(mask_t bits, Callback callback)
+  {
+    while (bits)
+    {
+      callback(static_cast<std::size_t>(Bitset::lowest_bit(bits)));
+      bits &= bits - 1;
+    }
+  }
+
+  mask_t all() const { return (count_ == 64) ? ~mask_t(0) : (mask_t(1) << count_) - 1; };
+
+  // (R3) and (R4), the same as Philosopher::receive
+  void receive()
+  {
+    auto message = mailbox_.drain();
+    while (message)
+    {
+      auto next = message->next;
+      auto bit = mask_t(1) << message->slot;
+      auto tokens = message->tokens.exchange(0, std::memory_order_acq_rel);
+
+      if (tokens & Mailbox::bottle_token)
+      {
+        bot_ |= bit;
+        dirty_ = (tokens & Mailbox::dirty_token) ? (dirty_ | bit) : (dirty_ & ~bit);
+      }
+      if (tokens & Mailbox::request_token)
+        reqb_ |= bit;
+
+      message = next;
+    }
+  }
+
+  void on_tranquil()
+  {
+    if (executor_->now() < end_tranquil_)
+      return;
+
+    state_ = thirsty;
+    need_ = all();
+  }
+
+  void on_thirsty()
+  {
+    // (R1) Request a Bottle:
+    //   thirsty, need(b), reqb(b), ~bot(b) -> Send request for bottle B
+    //   reqb(b) := false
+    auto fire = need_ & reqb_ & ~bot_;
+    reqb_ &= ~fire;
+    for_each_bit(fire, [this](std::size_t slot)
+    {
+      Transport::send(peers_[slot], back_slots_[slot], Mailbox::request, false);
+    });
+
+    if (need_ & ~bot_)
+      return;
+
+    state_ = drinking;
+    if (drinking_)
+      end_drinking_ = executor_->now()
+        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(drinking_->get_duration(random_));
+  }
+
+  void on_drinking()
+  {
+    if (drinking_ && executor_->now() < end_drinking_)
+      return;
+
+    log_->log("Philosopher[", id_, "] is drinking.");
+    if (listener_)
+      listener_->report_drink(id_);
+
+    need_ = 0;
+    dirty_ = all();
+
+    auto model = tranquil_ ? tranquil_ : (wait_ ? &Duration::get_default_wait() : nullptr);
+    if (model)
+      end_tranquil_ = executor_->now()
+        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(model->get_duration(random_));
+
+    state_ = tranquil;
+  }
+
+  // Returns true if we gave up a bottle we need
+  bool check_bottle_requests()
+  {
+    // (R2) Send a bottle:
+    //    reqb(b), bot(b), ~[need(b) and (drinking or ~dirty(b))] ->
+    //    send bottle b;
+    //    bot(b) := false
+    auto keep = need_ & ((state_ == drinking) ? ~mask_t(0) : ~dirty_);
+    auto fire = reqb_ & bot_ & ~keep;
+    bot_ &= ~fire;
+    dirty_ &= ~fire;
+    for_each_bit(fire, [this](std::size_t slot)
+    {
+      Transport::send(peers_[slot], back_slots_[slot], Mailbox::bottle, false);
+    });
+
+    return (fire & need_) != 0;
+  }
+
+  bool step()
+  {
+    if (!start_ || quit_)
+      return false;
+
+    for (int i = 0; i < 3; i++)
+    {
+      receive();
+
+      auto old_state = state_;
+      switch (state_)
+      {
+      case tranquil:
+        on_tranquil();
+        break;
+      case thirsty:
+        on_thirsty();
+        break;
+      case drinking:
+        on_drinking();
+        break;
+      }
+
+      // Giving up a bottle we need means asking for it back next pass
+      auto again = check_bottle_requests();
+
+      if (state_ == old_state && !again)
+      {
+        auto end = (state_ == tranquil) ? end_tranquil_ : end_drinking_;
+        if (state_ != thirsty && timer_ != end)
+        {
+          timer_ = end;
+          executor_->post_at(this, end);
+        }
+
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+private:
+  int id_;
+  bottle_state state_;
+
+  std::size_t count_;
+  std::array<int, Degree> neighbor_ids_;
+  std::array<peer_t, Degree> peers_;
+  std::array<std::size_t, Degree> back_slots_;
+  std::array<Mailbox::message_t, Degree> inbox_;
+
+  mask_t bot_;
+  mask_t reqb_;
+  mask_t need_;
+  mask_t dirty_;
+
+  Mailbox mailbox_;
+
+  Executor * executor_;
+  IDrinkListener * listener_;
+  Logger * log_;
+
+  bool wait_;
+  Random random_;
+  const IDurationModel * tranquil_;
+  const IDurationModel * drinking_;
+  std::chrono::steady_clock::time_point end_tranquil_;
+  std::chrono::steady_clock::time_point end_drinking_;
+  std::chrono::steady_clock::time_point timer_;
+
+  std::atomic<bool> start_;
+  std::atomic<bool> quit_;
+  std::atomic<task_state> task_state_;
+  int home_;
+
+private:
+  FixedPhilosopher(const FixedPhilosopher& rhs) = delete;
+  FixedPhilosopher& operator =(const FixedPhilosopher& rhs) = delete;
+};
+
+// Neighbors in the same process.  A send is a push straight into the
+// neighbor's mailbox.
+template <std::size_t Degree>
+struct LocalTransport
+{
+  typedef FixedPhilosopher<Degree, LocalTransport> * peer_t;
+
+  static void send(peer_t peer, std::size_t slot, Mailbox::message_type type, bool dirty)
+  {
+    peer->push(slot, type, dirty);
+  }
+};
+
+#endif // #if !defined(__FIXEDPHILOSOPHER_H__)
@@ -0,0 +1,146 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// FixedTable.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// FixedTable declaration:
+//  This seats FixedPhilosophers on a pool the way Table seats
+//  Philosophers.  The guests sit in one array, so a ring walks
+//  through memory in order.  with_degree() picks the smallest
+//  Degree we compile for that fits a graph.
+//
+
+#if !defined(__FIXEDTABLE_H__)
+#define __FIXEDTABLE_H__
+
+#include "DrinkCounter.h"
+#include "Executor.h"
+#include "FixedPhilosopher.h"
+#include "Logger.h"
+#include "Edge.h"
+#include "Partition.h"
+
+#include <memory>
+#include <vector>
+
+template <std::size_t Degree>
+class FixedTable
+{
+public:
+  typedef FixedPhilosopher<Degree, LocalTransport<Degree>> philosopher_t;
+  typedef ::edge_t edge_t;
+  typedef ::edge_vector_t edge_vector_t;
+
+public:
+  FixedTable(int philosophers, Logger& log, std::size_t workers = 0)
+    : executor_(new Executor(workers))
+    , count_(static_cast<std::size_t>(philosophers > 0 ? philosophers : 0))
+    , philosophers_(new philosopher_t[count_])
+    , drinks_(count_)
+    , log_(log)
+  {
+    for (std::size_t i = 0; i < count_; i++)
+      philosophers_[i].init(static_cast<int>(i), log_, *executor_, &drinks_);
+
+    log_.log("Running ", count_, " guests of degree ", Degree, " on a pool of ", executor_->get_worker_count(), " workers.");
+  }
+
+  ~FixedTable()
+  {
+    // Same as Table, the workers go before the philosophers
+    executor_->stop();
+  }
+
+public:
+  std::size_t size() const { return count_; };
+  philosopher_t& operator [](std::size_t index) { return philosophers_[index]; };
+
+  // Seats everyone along the edges, which must be normalized.  The
+  // lower id of each pair starts with the bottle.  Returns false if
+  // anyone has more than Degree neighbors.
+  bool wire(const edge_vector_t& edges)
+  {
+    auto count = static_cast<int>(count_);
+    for (auto& edge : edges)
+    {
+      if (edge.first < 0 || edge.second < 0 || edge.first >= count || edge.second >= count
+        || edge.first == edge.second)
+        continue;
+
+      auto& low = philosophers_[static_cast<std::size_t>(edge.first)];
+      auto& high = philosophers_[static_cast<std::size_t>(edge.second)];
+      auto low_slot = low.get_neighbor_count();
+      auto high_slot = high.get_neighbor_count();
+
+      if (!low.add_neighbor(edge.second, &high, high_slot, true)
+        || !high.add_neighbor(edge.first, &low, low_slot, false))
+        return false;
+    }
+
+    return true;
+  }
+
+  // Gives every guest a home worker so neighbors share one
+  void place(const edge_vector_t& edges, unsigned long long seed = 0)
+  {
+    auto parts = Partition::split(static_cast<int>(count_), edges, static_cast<int>(executor_->get_worker_count()), seed);
+    for (std::size_t i = 0; i < count_; i++)
+      philosophers_[i].set_home(parts[i]);
+  }
+
+  void start()
+  {
+    for (std::size_t i = 0; i < count_; i++)
+      philosophers_[i].start();
+  }
+
+  bool wait_for_minimum_drink_count(int drink_minimum, long long max_wait_ms)
+  {
+    if (!count_)
+    {
+      log_.log("Trying to wait with no registered drinkers.");
+      return false;
+    }
+
+    return drinks_.wait_for_minimum(static_cast<std::size_t>(drink_minimum > 0 ? drink_minimum : 0),
+      std::chrono::milliseconds(max_wait_ms));
+  }
+
+  std::size_t get_minimum_drink_count() const { return drinks_.get_minimum(); };
+  std::size_t get_total_drink_count() const { return drinks_.get_total(); };
+  std::vector<std::size_t> get_drink_counts() const { return drinks_.get_counts(); };
+
+private:
+  std::unique_ptr<Executor> executor_;
+  std::size_t count_;
+  std::unique_ptr<philosopher_t[]> philosophers_;
+  DrinkCounter drinks_;
+  Logger& log_;
+
+private:
+  FixedTable(const FixedTable& rhs) = delete;
+  FixedTable& operator =(const FixedTable& rhs) = delete;
+};
+
+// Calls callback.run<D>() for the smallest D we compile for that
+// holds degree.  Returns false if none does.
+template <typename Callback>
+bool with_degree(std::size_t degree, Callback& callback)
+{
+  if (degree <= 2)
+    callback.template run<2>();
+  else if (degree <= 4)
+    callback.template run<4>();
+  else if (degree <= 8)
+    callback.template run<8>();
+  else if (degree <= 16)
+    callback.template run<16>();
+  else
+    return false;
+
+  return true;
+}
+
+#endif // #if !defined(__FIXEDTABLE_H__)
@@ -0,0 +1,357 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// GuardKernel.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the guard kernels
+//  The vector versions are compiled with per-function target
+//  attributes so the rest of the program doesn't need to be
+//  built for AVX.  Only GCC and Clang on x86 get them, anything
+//  else runs the scalar version.
+//
+
+#include "GuardKernel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GUARD_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+typedef GuardKernel::word_t word_t;
+
+// Scalar versions.  These also finish off the words left over
+// by the vector versions.
+static bool request_scalar(const word_t * need, word_t * reqb, const word_t * bot,
+  word_t * fire, std::size_t words)
+{
+  word_t any = 0;
+  for (std::size_t i = 0; i < words; i++)
+  {
+    auto f = need[i] & reqb[i] & ~bot[i];
+    fire[i] = f;
+    reqb[i] &= ~f;
+    any |= f;
+  }
+
+  return any != 0;
+}
+
+static bool send_scalar(const word_t * reqb, word_t * bot, const word_t * need,
+  word_t * dirty, bool drinking, word_t * fire, std::size_t words)
+{
+  word_t drinking_mask = drinking ? ~word_t(0) : word_t(0);
+  word_t any = 0;
+  for (std::size_t i = 0; i < words; i++)
+  {
+    auto keep = need[i] & (drinking_mask | ~dirty[i]);
+    auto f = reqb[i] & bot[i] & ~keep;
+    fire[i] = f;
+    bot[i] &= ~f;
+    dirty[i] &= ~f;
+    any |= f;
+  }
+
+  return any != 0;
+}
+
+static bool release_scalar(const word_t * reqb, word_t * bot, const word_t * need,
+  const word_t * fork, bool drinking, word_t * fire, std::size_t words)
+{
+  word_t drinking_mask = drinking ? ~word_t(0) : word_t(0);
+  word_t any = 0;
+  for (std::size_t i = 0; i < words; i++)
+  {
+    auto keep = need[i] & (drinking_mask | fork[i]);
+    auto f = reqb[i] & bot[i] & ~keep;
+    fire[i] = f;
+    bot[i] &= ~f;
+    any |= f;
+  }
+
+  return any != 0;
+}
+
+static bool satisfied_scalar(const word_t * need, const word_t * bot, std::size_t words)
+{
+  word_t missing = 0;
+  for (std::size_t i = 0; i < words; i++)
+    missing |= need[i] & ~bot[i];
+
+  return missing == 0;
+}
+
+#if defined(GUARD_KERNEL_X86)
+
+// AVX2 handles 256 neighbors per step
+__attribute__((target("avx2")))
+static bool request_avx2(const word_t * need, word_t * reqb, const word_t * bot,
+  word_t * fire, std::size_t words)
+{
+  auto any = _mm256_setzero_si256();
+
+  std::size_t i = 0;
+  for (; i + 4 <= words; i += 4)
+  {
+    auto n = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(need + i));
+    auto r = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(reqb + i));
+    auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bot + i));
+
+    auto f = _mm256_andnot_si256(b, _mm256_and_si256(n, r));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(fire + i), f);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(reqb + i), _mm256_andnot_si256(f, r));
+    any = _mm256_or_si256(any, f);
+  }
+
+  bool fired = !_mm256_testz_si256(any, any);
+  return request_scalar(need + i, reqb + i, bot + i, fire + i, words - i) || fired;
+}
+
+__attribute__((target("avx2")))
+static bool send_avx2(const word_t * reqb, word_t * bot, const word_t * need,
+  word_t * dirty, bool drinking, word_t * fire, std::size_t words)
+{
+  auto ones = _mm256_set1_epi64x(-1);
+  auto drinking_mask = drinking ? ones : _mm256_setzero_si256();
+  auto any = _mm256_setzero_si256();
+
+  std::size_t i = 0;
+  for (; i + 4 <= words; i += 4)
+  {
+    auto r = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(reqb + i));
+    auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bot + i));
+    auto n = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(need + i));
+    auto d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dirty + i));
+
+    auto keep = _mm256_and_si256(n, _mm256_or_si256(drinking_mask, _mm256_andnot_si256(d, ones)));
+    auto f = _mm256_andnot_si256(keep, _mm256_and_si256(r, b));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(fire + i), f);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(bot + i), _mm256_andnot_si256(f, b));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dirty + i), _mm256_andnot_si256(f, d));
+    any = _mm256_or_si256(any, f);
+  }
+
+  bool fired = !_mm256_testz_si256(any, any);
+  return send_scalar(reqb + i, bot + i, need + i, dirty + i, drinking, fire + i, words - i) || fired;
+}
+
+__attribute__((target("avx2")))
+static bool release_avx2(const word_t * reqb, word_t * bot, const word_t * need,
+  const word_t * fork, bool drinking, word_t * fire, std::size_t words)
+{
+  auto drinking_mask = drinking ? _mm256_set1_epi64x(-1) : _mm256_setzero_si256();
+  auto any = _mm256_setzero_si256();
+
+  std::size_t i = 0;
+  for (; i + 4 <= words; i += 4)
+  {
+    auto r = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(reqb + i));
+    auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bot + i));
+    auto n = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(need + i));
+    auto k = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(fork + i));
+
+    auto keep = _mm256_and_si256(n, _mm256_or_si256(drinking_mask, k));
+    auto f = _mm256_andnot_si256(keep, _mm256_and_si256(r, b));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(fire + i), f);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(bot + i), _mm256_andnot_si256(f, b));
+    any = _mm256_or_si256(any, f);
+  }
+
+  bool fired = !_mm256_testz_si256(any, any);
+  return release_scalar(reqb + i, bot + i, need + i, fork + i, drinking, fire + i, words - i) || fired;
+}
+
+__attribute__((target("avx2")))
+static bool satisfied_avx2(const word_t * need, const word_t * bot, std::size_t words)
+{
+  auto missing = _mm256_setzero_si256();
+
+  std::size_t i = 0;
+  for (; i + 4 <= words; i += 4)
+  {
+    auto n = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(need + i));
+    auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bot + i));
+    missing = _mm256_or_si256(missing, _mm256_andnot_si256(b, n));
+  }
+
+  return _mm256_testz_si256(missing, missing) && satisfied_scalar(need + i, bot + i, words - i);
+}
+
+// AVX-512 handles 512 neighbors per step
+__attribute__((target("avx512f")))
+static bool request_avx512(const word_t * need, word_t * reqb, const word_t * bot,
+  word_t * fire, std::size_t words)
+{
+  auto any = _mm512_setzero_si512();
+
+  std::size_t i = 0;
+  for (; i + 8 <= words; i += 8)
+  {
+    auto n = _mm512_loadu_si512(need + i);
+    auto r = _mm512_loadu_si512(reqb + i);
+    auto b = _mm512_loadu_si512(bot + i);
+
+    auto f = _mm512_andnot_si512(b, _mm512_and_si512(n, r));
+    _mm512_storeu_si512(fire + i, f);
+    _mm512_storeu_si512(reqb + i, _mm512_andnot_si512(f, r));
+    any = _mm512_or_si512(any, f);
+  }
+
+  bool fired = _mm512_test_epi64_mask(any, any) != 0;
+  return request_scalar(need + i, reqb + i, bot + i, fire + i, words - i) || fired;
+}
+
+__attribute__((target("avx512f")))
+static bool send_avx512(const word_t * reqb, word_t * bot, const word_t * need,
+  word_t * dirty, bool drinking, word_t * fire, std::size_t words)
+{
+  auto ones = _mm512_set1_epi64(-1);
+  auto drinking_mask = drinking ? ones : _mm512_setzero_si512();
+  auto any = _mm512_setzero_si512();
+
+  std::size_t i = 0;
+  for (; i + 8 <= words; i += 8)
+  {
+    auto r = _mm512_loadu_si512(reqb + i);
+    auto b = _mm512_loadu_si512(bot + i);
+    auto n = _mm512_loadu_si512(need + i);
+    auto d = _mm512_loadu_si512(dirty + i);
+
+    auto keep = _mm512_and_si512(n, _mm512_or_si512(drinking_mask, _mm512_andnot_si512(d, ones)));
+    auto f = _mm512_andnot_si512(keep, _mm512_and_si512(r, b));
+    _mm512_storeu_si512(fire + i, f);
+    _mm512_storeu_si512(bot + i, _mm512_andnot_si512(f, b));
+    _mm512_storeu_si512(dirty + i, _mm512_andnot_si512(f, d));
+    any = _mm512_or_si512(any, f);
+  }
+
+  bool fired = _mm512_test_epi64_mask(any, any) != 0;
+  return send_scalar(reqb + i, bot + i, need + i, dirty + i, drinking, fire + i, words - i) || fired;
+}
+
+__attribute__((target("avx512f")))
+static bool release_avx512(const word_t * reqb, word_t * bot, const word_t * need,
+  const word_t * fork, bool drinking, word_t * fire, std::size_t words)
+{
+  auto drinking_mask = drinking ? _mm512_set1_epi64(-1) : _mm512_setzero_si512();
+  auto any = _mm512_setzero_si512();
+
+  std::size_t i = 0;
+  for (; i + 8 <= words; i += 8)
+  {
+    auto r = _mm512_loadu_si512(reqb + i);
+    auto b = _mm512_loadu_si512(bot + i);
+    auto n = _mm512_loadu_si512(need + i);
+    auto k = _mm512_loadu_si512(fork + i);
+
+    auto keep = _mm512_and_si512(n, _mm512_or_si512(drinking_mask, k));
+    auto f = _mm512_andnot_si512(keep, _mm512_and_si512(r, b));
+    _mm512_storeu_si512(fire + i, f);
+    _mm512_storeu_si512(bot + i, _mm512_andnot_si512(f, b));
+    any = _mm512_or_si512(any, f);
+  }
+
+  bool fired = _mm512_test_epi64_mask(any, any) != 0;
+  return release_scalar(reqb + i, bot + i, need + i, fork + i, drinking, fire + i, words - i) || fired;
+}
+
+__attribute__((target("avx512f")))
+static bool satisfied_avx512(const word_t * need, const word_t * bot, std::size_t words)
+{
+  auto missing = _mm512_setzero_si512();
+
+  std::size_t i = 0;
+  for (; i + 8 <= words; i += 8)
+  {
+    auto n = _mm512_loadu_si512(need + i);
+    auto b = _mm512_loadu_si512(bot + i);
+    missing = _mm512_or_si512(missing, _mm512_andnot_si512(b, n));
+  }
+
+  return _mm512_test_epi64_mask(missing, missing) == 0 && satisfied_scalar(need + i, bot + i, words - i);
+}
+
+#endif // #if defined(GUARD_KERNEL_X86)
+
+static const GuardKernel::table_t scalar_table = { request_scalar, send_scalar, release_scalar, satisfied_scalar };
+
+#if defined(GUARD_KERNEL_X86)
+static const GuardKernel::table_t avx2_table = { request_avx2, send_avx2, release_avx2, satisfied_avx2 };
+static const GuardKernel::table_t avx512_table = { request_avx512, send_avx512, release_avx512, satisfied_avx512 };
+#endif
+
+const GuardKernel::table_t& GuardKernel::get()
+{
+  // Only look at the CPU once
+  static const table_t& best = get(get_best_isa());
+  return best;
+}
+
+const GuardKernel::table_t& GuardKernel::select(std::size_t words)
+{
+  static const isa best = get_best_isa();
+
+  if (best == avx512 && words >= 8)
+    return get(avx512);
+  if (best != scalar && words >= 4)
+    return get(avx2);
+  return scalar_table;
+}
+
+const GuardKernel::table_t& GuardKernel::get(isa which)
+{
+  if (!is_supported(which))
+    return scalar_table;
+
+#if defined(GUARD_KERNEL_X86)
+  if (which == avx512)
+    return avx512_table;
+  if (which == avx2)
+    return avx2_table;
+#endif
+
+  return scalar_table;
+}
+
+GuardKernel::isa GuardKernel::get_best_isa()
+{
+  if (is_supported(avx512))
+    return avx512;
+  if (is_supported(avx2))
+    return avx2;
+  return scalar;
+}
+
+bool GuardKernel::is_supported(isa which)
+{
+  switch (which)
+  {
+  case scalar:
+    return true;
+
+#if defined(GUARD_KERNEL_X86)
+  // These also check that the OS saves the wider registers
+  case avx2:
+    return __builtin_cpu_supports("avx2") != 0;
+  case avx512:
+    return __builtin_cpu_supports("avx512f") != 0;
+#endif
+
+  default:
+    return false;
+  }
+}
+
+const char * GuardKernel::get_name(isa which)
+{
+  switch (which)
+  {
+  case avx2:
+    return "avx2";
+  case avx512:
+    return "avx512";
+  default:
+    return "scalar";
+  }
+}
@@ -0,0 +1,69 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// GuardKernel.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// GuardKernel declaration:
+//  These are the R1 and R2 guards and the drink test evaluated
+//  over whole bitset words.  There are AVX2 and AVX-512 versions
+//  for large neighbor sets and the best one the CPU supports is
+//  picked the first time the kernel is used.
+//
+
+#if !defined(__GUARDKERNEL_H__)
+#define __GUARDKERNEL_H__
+
+#include "Bitset.h"
+
+class GuardKernel
+{
+public:
+  typedef Bitset::word_t word_t;
+
+  enum isa {scalar, avx2, avx512};
+
+  struct table_t
+  {
+    // (R1) fire = need & reqb & ~bot
+    //      reqb &= ~fire
+    bool (*request)(const word_t * need, word_t * reqb, const word_t * bot,
+      word_t * fire, std::size_t words);
+
+    // (R2) fire = reqb & bot & ~(need & (drinking | ~dirty))
+    //      bot &= ~fire, dirty &= ~fire
+    bool (*send)(const word_t * reqb, word_t * bot, const word_t * need,
+      word_t * dirty, bool drinking, word_t * fire, std::size_t words);
+
+    // (R2) when the forks are kept apart from the bottles
+    //      fire = reqb & bot & ~(need & (drinking | fork))
+    //      bot &= ~fire
+    bool (*release)(const word_t * reqb, word_t * bot, const word_t * need,
+      const word_t * fork, bool drinking, word_t * fire, std::size_t words);
+
+    // (need & ~bot) == 0
+    bool (*satisfied)(const word_t * need, const word_t * bot, std::size_t words);
+  };
+
+public:
+  // The kernels for the best instruction set we can run
+  static const table_t& get();
+
+  // The best kernels for a given number of words.  Small sets don't
+  // fill a vector register and are faster with the scalar version.
+  static const table_t& select(std::size_t words);
+
+  // The kernels for a specific instruction set.  Falls back to scalar
+  // if the CPU can't run it.
+  static const table_t& get(isa which);
+
+  static isa get_best_isa();
+  static bool is_supported(isa which);
+  static const char * get_name(isa which);
+
+private:
+  GuardKernel() = delete;
+};
+
+#endif // #if !defined(__GUARDKERNEL_H__)
@@ -0,0 +1,150 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Histogram.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Histogram declaration:
+//  This is a log-linear histogram in the style of HDR histograms.
+//  Every power of two is split into 8 buckets, so a value is
+//  known to within 12.5% over the whole range.  Recording is a
+//  couple of shifts and a relaxed store.  Each histogram has one
+//  writer but anyone can read or merge it at any time.
+//
+
+#if !defined(__HISTOGRAM_H__)
+#define __HISTOGRAM_H__
+
+#include <atomic>
+#include <cstdint>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+class Histogram
+{
+public:
+  static constexpr unsigned sub_bucket_bits = 3;
+  static constexpr std::uint64_t sub_buckets = 1 << sub_bucket_bits;
+
+  // Values at or past 2^max_bits all land in the last bucket
+  static constexpr unsigned max_bits = 40;
+  static constexpr std::size_t bucket_count = sub_buckets * (max_bits - sub_bucket_bits + 1);
+
+public:
+  Histogram() { reset(); };
+  virtual ~Histogram() = default;
+
+public:
+  // Only the owner may call this
+  void record(std::uint64_t value)
+  {
+    auto& count = counts_[get_index(value)];
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  // Adds another histogram's counts to ours.  This is for histograms
+  // that nobody records into, like a total built up from many others.
+  void merge(const Histogram& rhs)
+  {
+    for (std::size_t i = 0; i < bucket_count; i++)
+      counts_[i].fetch_add(rhs.counts_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+
+  void reset()
+  {
+    for (auto& count : counts_)
+      count.store(0, std::memory_order_relaxed);
+  }
+
+  std::uint64_t get_count() const
+  {
+    std::uint64_t total = 0;
+    for (auto& count : counts_)
+      total += count.load(std::memory_order_relaxed);
+    return total;
+  }
+
+  // The value that fraction of the recorded values are at or below,
+  // rounded up to the top of its bucket.  Zero if nothing was recorded.
+  std::uint64_t get_percentile(double fraction) const
+  {
+    auto total = get_count();
+    if (!total)
+      return 0;
+
+    auto target = static_cast<std::uint64_t>(fraction * static_cast<double>(total) + 0.5);
+    if (target < 1)
+      target = 1;
+
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < bucket_count; i++)
+    {
+      seen += counts_[i].load(std::memory_order_relaxed);
+      if (seen >= target)
+        return get_upper_bound(i);
+    }
+
+    return get_upper_bound(bucket_count - 1);
+  }
+
+  std::uint64_t get_max() const
+  {
+    for (std::size_t i = bucket_count; i > 0; i--)
+      if (counts_[i - 1].load(std::memory_order_relaxed))
+        return get_upper_bound(i - 1);
+
+    return 0;
+  }
+
+  // The buckets are exposed for anyone who wants to dump the raw shape
+  std::uint64_t get_bucket(std::size_t index) const { return counts_[index].load(std::memory_order_relaxed); };
+
+  static std::size_t get_index(std::uint64_t value)
+  {
+    if (value < sub_buckets)
+      return static_cast<std::size_t>(value);
+
+    auto top = highest_bit(value);
+    if (top >= max_bits)
+      return bucket_count - 1;
+
+    // The bits just under the top one pick the bucket within the power of two
+    auto shift = top - sub_bucket_bits;
+    auto mantissa = (value >> shift) - sub_buckets;
+    return static_cast<std::size_t>((shift + 1) * sub_buckets + mantissa);
+  }
+
+  static std::uint64_t get_upper_bound(std::size_t index)
+  {
+    if (index < sub_buckets)
+      return index;
+
+    auto shift = index / sub_buckets - 1;
+    auto mantissa = index % sub_buckets + sub_buckets;
+    return ((mantissa + 1) << shift) - 1;
+  }
+
+private:
+  static unsigned highest_bit(std::uint64_t value)
+  {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return static_cast<unsigned>(index);
+#else
+    return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#endif
+  }
+
+private:
+  std::atomic<std::uint32_t> counts_[bucket_count];
+
+private:
+  Histogram(const Histogram& rhs) = delete;
+  Histogram& operator =(const Histogram& rhs) = delete;
+};
+
+#endif // #if !defined(__HISTOGRAM_H__)
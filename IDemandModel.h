@@ -0,0 +1,38 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// IDemandModel.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// IDemandModel interface:
+//  This picks which bottles a philosopher needs each time it
+//  gets thirsty.  Without one, every bottle is needed every time
+//
+
+#if !defined(__IDEMANDMODEL_H__)
+#define __IDEMANDMODEL_H__
+
+#include "Bitset.h"
+
+#include <cstdint>
+#include <vector>
+
+class IDemandModel
+{
+public:
+  IDemandModel() = default;
+  virtual ~IDemandModel() = default;
+
+public:
+  // IDemandModel interface
+  //  need comes in cleared and sized to the philosopher's neighbors,
+  //  with neighbor_ids giving the neighbor in each slot.  episode
+  //  counts the philosopher's thirsty spells from zero.  Called from
+  //  the philosopher's own thread, so it must be safe to call for
+  //  different philosophers at once.
+  virtual void get_demand(int id, std::uint64_t episode,
+    const std::vector<int>& neighbor_ids, Bitset& need) = 0;
+};
+
+#endif // #if !defined(__IDEMANDMODEL_H__)
@@ -0,0 +1,32 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// IDurationModel.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// IDurationModel interface:
+//  This picks how long a philosopher stays tranquil or keeps
+//  drinking.  The philosopher passes in its own generator so
+//  one model can be shared by the whole table
+//
+
+#if !defined(__IDURATIONMODEL_H__)
+#define __IDURATIONMODEL_H__
+
+#include "Random.h"
+
+#include <chrono>
+
+class IDurationModel
+{
+public:
+  IDurationModel() = default;
+  virtual ~IDurationModel() = default;
+
+public:
+  // IDurationModel interface
+  virtual std::chrono::nanoseconds get_duration(Random& random) const = 0;
+};
+
+#endif // #if !defined(__IDURATIONMODEL_H__)
@@ -28,6 +28,8 @@ public:
   virtual void introduce_neighbor(std::shared_ptr<INeighbor> neighbor) = 0;
   virtual void send_bottle(int sender_id, bool dirty) = 0;
   virtual void send_request(int sender_id) = 0;
+  virtual void send_fork(int sender_id) = 0;
+  virtual void send_fork_request(int sender_id) = 0;
   virtual bool has_bottle(int id) = 0;
   virtual bool has_request(int id) = 0;
 };
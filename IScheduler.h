@@ -0,0 +1,52 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// IScheduler.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// IScheduler interface:
+//  This is the interface a task uses to ask for time on a
+//  worker.  post() runs the task as soon as possible and
+//  post_at() wakes the task once the time has passed.
+//  Tasks read the time from the scheduler and send their
+//  messages through it, so a simulator can stand in for
+//  the clock and the network.
+//
+
+#if !defined(__ISCHEDULER_H__)
+#define __ISCHEDULER_H__
+
+#include "ITask.h"
+#include "Mailbox.h"
+
+#include <chrono>
+#include <cstdint>
+
+class IScheduler
+{
+public:
+  typedef std::chrono::steady_clock::time_point time_point_t;
+
+public:
+  IScheduler() = default;
+  virtual ~IScheduler() = default;
+
+public:
+  // IScheduler interface
+  virtual void post(ITask * task) = 0;
+  virtual void post_at(ITask * task, time_point_t when) = 0;
+
+  // Posts the tokens to the task's mailbox and wakes the task
+  virtual void deliver(ITask * task, Mailbox * mailbox, Mailbox::message_t * message, std::uint8_t tokens) = 0;
+
+  // The time for post_at() and the same time in Tsc ticks
+  virtual time_point_t now() = 0;
+  virtual std::uint64_t get_ticks() = 0;
+
+  // Whether the time is virtual.  Then every task runs and every
+  // message is delivered on the one thread that drives the clock.
+  virtual bool is_virtual() = 0;
+};
+
+#endif // #if !defined(__ISCHEDULER_H__)
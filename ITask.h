@@ -0,0 +1,34 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// ITask.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// ITask interface:
+//  This is implemented by anything that can be run by an
+//  IScheduler.  The task is responsible for making sure it
+//  is only posted once no matter how many times it is woken.
+//  A task can name the worker it would rather run on so that
+//  tasks that talk to each other share a cache.
+//
+
+#if !defined(__ITASK_H__)
+#define __ITASK_H__
+
+class ITask
+{
+public:
+  ITask() = default;
+  virtual ~ITask() = default;
+
+public:
+  // ITask interface
+  virtual void run() = 0;
+  virtual void wake() = 0;
+
+  // The worker to post the task to, or -1 for wherever is handy
+  virtual int get_home() = 0;
+};
+
+#endif // #if !defined(__ITASK_H__)
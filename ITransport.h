@@ -0,0 +1,52 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// ITransport.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// ITransport interface:
+//  This is implemented by anything that carries tokens between
+//  guests seated in different processes.  Each process seats a
+//  range of the guests, gets a stand-in from the transport for
+//  every neighbor seated somewhere else and attaches its own
+//  guests so the tokens that arrive can be handed to them.
+//
+
+#if !defined(__ITRANSPORT_H__)
+#define __ITRANSPORT_H__
+
+#include "INeighbor.h"
+
+#include <chrono>
+#include <memory>
+
+class ITransport
+{
+public:
+  ITransport() = default;
+  virtual ~ITransport() = default;
+
+public:
+  // ITransport interface
+  // The guests this process seats are [first, first + count)
+  virtual int get_first_guest() = 0;
+  virtual int get_guest_count() = 0;
+
+  // A stand-in for a guest seated somewhere else, or nullptr if the
+  // two were never neighbors.  The transport keeps it alive.
+  virtual std::shared_ptr<INeighbor> get_neighbor(int local_id, int remote_id) = 0;
+
+  // Where tokens for one of our own guests go.  Must be called for
+  // every local guest before start.
+  virtual void attach(int id, std::weak_ptr<INeighbor> guest) = 0;
+
+  virtual void start() = 0;
+  virtual void stop() = 0;
+
+  // Waits until every process has called this as many times as we
+  // have.  Returns false on a timeout.
+  virtual bool barrier(std::chrono::milliseconds timeout) = 0;
+};
+
+#endif // #if !defined(__ITRANSPORT_H__)
@@ -6,21 +6,338 @@
 // terms of the MIT license.
 //
 // Implementation of the logger class
+//  Callers fill in an entry from their own thread buffer and
+//  push it onto a lock-free list.  A single writer thread takes
+//  the whole list at once, formats it into one buffer, hands it
+//  to the OS with one write and gives the entries back.
 //
 
 #include "Logger.h"
 
+#include <cstdio>
 #include <ctime>
-#include <iostream>
 
-void Logger::log(const std::string& message)
+#if defined(_WIN32)
+#include <io.h>
+#define write_fd(fd, data, size) ::_write(fd, data, static_cast<unsigned int>(size))
+#else
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#define write_fd(fd, data, size) ::write(fd, data, size)
+#endif
+
+// The writer wakes up at least this often to empty the queue
+static constexpr auto flush_interval(std::chrono::milliseconds(10));
+
+static std::atomic<std::size_t> next_logger_id(1);
+
+// Remembers which buffer this thread uses.  When the thread exits
+// the buffer is left for the next new thread to pick up.
+struct thread_cache_t
+{
+  std::size_t logger_id;
+  std::shared_ptr<Logger::thread_buffer_t> buffer;
+
+  ~thread_cache_t()
+  {
+    if (buffer)
+      buffer->orphaned = true;
+  }
+};
+
+static thread_local thread_cache_t thread_cache;
+
+Logger::Logger(std::size_t capacity, overflow_policy policy, int fd)
+  : id_(next_logger_id++)
+  , head_(nullptr)
+  , pending_(0)
+  , dropped_(0)
+  , capacity_(capacity ? capacity : 1)
+  , policy_(policy)
+  , fd_(fd)
+  , buffers_()
+  , batch_()
+  , quit_(false)
+  , writer_()
+{
+  writer_ = std::thread(&Logger::work, this);
+}
+
+Logger::~Logger()
+{
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(lock_);
+    quit_ = true;
+    work_cv_.notify_all();
+  }
+
+  // The writer empties the queue before it exits
+  if (writer_.joinable())
+    writer_.join();
+}
+
+void Logger::flush()
+{
+  std::unique_lock<std::mutex> lock(lock_);
+  work_cv_.notify_all();
+
+  while (pending_ != 0)
+    space_cv_.wait_for(lock, flush_interval);
+}
+
+// Finds the buffer for the calling thread.  Only the first line a
+// thread logs has to take the lock.
+Logger::thread_buffer_t * Logger::get_buffer()
+{
+  if (thread_cache.logger_id == id_ && thread_cache.buffer)
+    return thread_cache.buffer.get();
+
+  // If this thread was logging somewhere else, let that buffer go
+  if (thread_cache.buffer)
+    thread_cache.buffer->orphaned = true;
+
+  std::unique_lock<std::mutex> lock(lock_);
+
+  std::shared_ptr<thread_buffer_t> buffer;
+  for (auto& candidate : buffers_)
+  {
+    bool orphaned = true;
+    if (candidate->orphaned.compare_exchange_strong(orphaned, false))
+    {
+      buffer = candidate;
+      break;
+    }
+  }
+
+  if (!buffer)
+  {
+    buffer = std::make_shared<thread_buffer_t>();
+    buffer->entries.reset(new entry[capacity_]);
+    buffer->free = nullptr;
+    buffer->returned = nullptr;
+    buffer->orphaned = false;
+
+    for (std::size_t i = 0; i < capacity_; i++)
+    {
+      auto& item = buffer->entries[i];
+      item.owner = buffer.get();
+      item.next = buffer->free;
+      buffer->free = &item;
+    }
+
+    buffers_.push_back(buffer);
+  }
+
+  thread_cache.logger_id = id_;
+  thread_cache.buffer = buffer;
+  return buffer.get();
+}
+
+Logger::entry * Logger::acquire()
+{
+  auto buffer = get_buffer();
+
+  for (;;)
+  {
+    // Take back everything the writer is done with
+    if (!buffer->free)
+      buffer->free = buffer->returned.exchange(nullptr, std::memory_order_acquire);
+
+    auto item = buffer->free;
+    if (item)
+    {
+      buffer->free = item->next;
+
+      // That was our last one.  Don't make the writer wait for its timer.
+      if (!buffer->free && !buffer->returned.load(std::memory_order_relaxed))
+        work_cv_.notify_all();
+
+      return item;
+    }
+
+    if (policy_ == drop)
+    {
+      dropped_++;
+      return nullptr;
+    }
+
+    // Blocking is the slow path.  Wait for the writer to give some back.
+    std::unique_lock<std::mutex> lock(lock_);
+    work_cv_.notify_all();
+    space_cv_.wait_for(lock, flush_interval);
+  }
+}
+
+void Logger::push(entry * item)
+{
+  pending_++;
+
+  auto head = head_.load(std::memory_order_relaxed);
+  do
+  {
+    item->next = head;
+  } while (!head_.compare_exchange_weak(head, item,
+    std::memory_order_release, std::memory_order_relaxed));
+}
+
+void Logger::append_number(std::string& line, bool value)
+{
+  // Matches what a stream prints
+  line += value ? '1' : '0';
+}
+
+void Logger::append_number(std::string& line, char value)
+{
+  line += value;
+}
+
+void Logger::append_number(std::string& line, signed char value)
+{
+  line += static_cast<char>(value);
+}
+
+void Logger::append_number(std::string& line, unsigned char value)
 {
-  std::unique_lock<std::mutex> scope_lock_(lock_);
+  line += static_cast<char>(value);
+}
+
+void Logger::append_number(std::string& line, long long value)
+{
+  char text[32];
+  auto length = std::snprintf(text, sizeof(text), "%lld", value);
+  line.append(text, static_cast<std::size_t>(length));
+}
 
-  auto t(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));
-  std::string time_string = std::ctime(&t);
+void Logger::append_number(std::string& line, unsigned long long value)
+{
+  char text[32];
+  auto length = std::snprintf(text, sizeof(text), "%llu", value);
+  line.append(text, static_cast<std::size_t>(length));
+}
 
-  time_string[time_string.length() - 1] = '\0';
-  std::cout << time_string << " | " << message.c_str() << std::endl;
+void Logger::append_number(std::string& line, long double value)
+{
+  char text[64];
+  auto length = std::snprintf(text, sizeof(text), "%Lg", value);
+  line.append(text, static_cast<std::size_t>(length));
 }
 
+// Writes out a list of entries (newest first) with a single write
+void Logger::write(entry * entries)
+{
+  // Put the entries back in the order they were logged
+  entry * oldest = nullptr;
+  while (entries)
+  {
+    auto next = entries->next;
+    entries->next = oldest;
+    oldest = entries;
+    entries = next;
+  }
+
+  // Entries are stamped in ticks.  Work back from a fresh pair of
+  // clock readings to get the wall clock time.
+  auto now_ticks = Tsc::now();
+  auto now_time = std::chrono::system_clock::now();
+  auto rate = Tsc::ticks_per_ns();
+
+  // Most lines in a batch land in the same second
+  std::time_t last_time = 0;
+  std::string time_string;
+
+  std::size_t count = 0;
+  batch_.clear();
+  while (oldest)
+  {
+    auto age = (now_ticks > oldest->ticks) ? static_cast<double>(now_ticks - oldest->ticks) / rate : 0.0;
+    auto time = now_time - std::chrono::duration_cast<std::chrono::system_clock::duration>(
+      std::chrono::duration<double, std::nano>(age));
+
+    auto t(std::chrono::system_clock::to_time_t(time));
+    if (t != last_time || time_string.empty())
+    {
+      last_time = t;
+      time_string = std::ctime(&t);
+      time_string.pop_back();
+    }
+
+    batch_ += time_string;
+    batch_ += " | ";
+    oldest->format(oldest->args, batch_);
+    batch_ += '\n';
+
+    // Hand the entry back to the thread it came from
+    auto next = oldest->next;
+    auto& returned = oldest->owner->returned;
+    auto head = returned.load(std::memory_order_relaxed);
+    do
+    {
+      oldest->next = head;
+    } while (!returned.compare_exchange_weak(head, oldest,
+      std::memory_order_release, std::memory_order_relaxed));
+
+    oldest = next;
+    count++;
+  }
+
+  auto data = batch_.data();
+  auto remaining = batch_.size();
+  while (remaining)
+  {
+    auto written = write_fd(fd_, data, remaining);
+    if (written < 0)
+    {
+#if !defined(_WIN32)
+      // A signal or a full non-blocking pipe or terminal isn't a
+      // reason to drop the rest of the batch
+      if (errno == EINTR)
+        continue;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        pollfd ready = { fd_, POLLOUT, 0 };
+        if (::poll(&ready, 1, -1) >= 0 || errno == EINTR)
+          continue;
+      }
+#endif
+      break;
+    }
+
+    if (written == 0)
+      break;
+
+    data += written;
+    remaining -= static_cast<std::size_t>(written);
+  }
+
+  pending_ -= count;
+  space_cv_.notify_all();
+}
+
+void Logger::work()
+{
+  // Get the tick rate measured before anything needs it
+  Tsc::ticks_per_ns();
+
+  for (;;)
+  {
+    // Look at quit before taking the list so nothing logged
+    // before the destructor ran gets left behind
+    bool quitting = quit_;
+
+    auto entries = head_.exchange(nullptr, std::memory_order_acquire);
+    if (entries)
+    {
+      write(entries);
+      continue;
+    }
+
+    if (quitting)
+      break;
+
+    std::unique_lock<std::mutex> lock(lock_);
+    if (!quit_ && head_.load() == nullptr)
+      work_cv_.wait_for(lock, flush_interval);
+  }
+}
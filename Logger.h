@@ -7,60 +7,323 @@
 //
 // Logger declaration:
 //  This is a simple logger that unpacks arguments and
-//  dumps them to cout
+//  queues them for a background thread that dumps them
+//  to stdout in batches.
+//
+//  The arguments are copied as raw bytes into an entry from
+//  a buffer owned by the calling thread.  Turning them into
+//  text is left to the writer thread, using a formatter that
+//  is picked at compile time from the argument types.
 //
 
 #if !defined(__LOGGER_H__)
 #define __LOGGER_H__
 
+#include "Tsc.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <mutex>
 #include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 class Logger
 {
 public:
+  // What log() does when the calling thread's buffer is full
+  enum overflow_policy {block, drop};
+
+  // Room for the arguments of one line
+  static constexpr std::size_t args_capacity = 192;
+
+  // Formats the captured arguments onto the end of a line
+  typedef void (*format_fn)(const char * args, std::string& line);
+
+  struct thread_buffer_t;
+
   struct entry
   {
-    const std::chrono::system_clock::time_point time;
-    const std::string line;
+    std::uint64_t ticks;   // Tsc::now() when the line was logged
+    format_fn format;
+    thread_buffer_t * owner;
     entry * next;
+    char args[args_capacity];
   };
 
+  // Each thread that logs gets one of these.  Entries go from the free
+  // list to the writer and come back through returned.
+  struct thread_buffer_t
+  {
+    std::unique_ptr<entry[]> entries;
+    entry * free;                    // Only touched by the owning thread
+    std::atomic<entry *> returned;   // Pushed by the writer
+    std::atomic<bool> orphaned;      // The owning thread is gone
+  };
+
+  typedef std::vector<std::shared_ptr<thread_buffer_t>> buffer_vector_t;
+
 public:
-  Logger() = default;
-  virtual ~Logger() = default;
+  // Capacity is the number of lines each thread can have waiting.
+  // Lines go to stdout unless another file descriptor is given.
+  Logger(std::size_t capacity = 64, overflow_policy policy = block, int fd = 1);
+  virtual ~Logger();
 
 public:
   // Public logging function that takes any arguments as long as they output to a stream
   template<typename... Args>
-  void log(Args... args)
+  void log(const Args&... args)
   {
-    std::stringstream ss;
-    log(ss, args...);
-    log(ss.str());
+    static_assert(fixed_size<Args...>::value <= args_capacity, "Too many arguments for one log line");
+
+    auto item = acquire();
+    if (!item)
+      return;
+
+    // Whatever space the fixed size arguments don't use is shared by the strings
+    std::size_t budget = args_capacity - fixed_size<Args...>::value;
+    char * out = item->args;
+    store(out, budget, args...);
+
+    item->ticks = Tsc::now();
+    item->format = &format<Args...>;
+    push(item);
   }
 
+  // Waits until everything logged so far has been written
+  void flush();
+
+  std::size_t get_dropped() const { return dropped_; };
+
 private:
-  // Final type for ending the recursion
+  // How each argument type is captured and formatted.  The default is
+  // for plain values that are copied as they are and streamed later.
+  template<typename T, typename Enable = void>
+  struct capture
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+      "Log arguments must be trivially copyable or strings");
+
+    static constexpr std::size_t size = sizeof(T);
+
+    static void store(char *& out, std::size_t&, const T& value)
+    {
+      std::memcpy(out, &value, sizeof(T));
+      out += sizeof(T);
+    }
+
+    static void append(const char *& in, std::string& line)
+    {
+      typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+      std::memcpy(&storage, in, sizeof(T));
+      in += sizeof(T);
+
+      std::ostringstream os;
+      os << *reinterpret_cast<const T *>(&storage);
+      line += os.str();
+    }
+  };
+
+  // Strings are copied inline behind a length.  The top bit of the
+  // length marks a string that had to be cut short.
+  struct capture_text
+  {
+    static constexpr std::size_t size = sizeof(std::uint16_t);
+    static constexpr std::uint16_t truncated = 0x8000;
+
+    static void store(char *& out, std::size_t& budget, const char * text, std::size_t length)
+    {
+      auto header = static_cast<std::uint16_t>(length);
+      if (length > budget)
+        header = static_cast<std::uint16_t>(budget) | truncated;
+
+      length = header & ~truncated;
+      budget -= length;
+
+      std::memcpy(out, &header, sizeof(header));
+      out += sizeof(header);
+
+      for (std::size_t i = 0; i < length; i++)
+        *out++ = text[i];
+    }
+
+    static void append(const char *& in, std::string& line)
+    {
+      std::uint16_t header;
+      std::memcpy(&header, in, sizeof(header));
+      std::size_t length = header & ~truncated;
+
+      line.append(in + sizeof(header), length);
+      if (header & truncated)
+        line += "...";
+
+      in += sizeof(header) + length;
+    }
+  };
+
+  template<std::size_t N>
+  struct capture<char[N]> : capture_text
+  {
+    static void store(char *& out, std::size_t& budget, const char (&value)[N])
+    {
+      capture_text::store(out, budget, value, ::strnlen(value, N));
+    }
+  };
+
+  template<typename T>
+  struct capture<T, typename std::enable_if<
+    std::is_same<T, const char *>::value || std::is_same<T, char *>::value>::type> : capture_text
+  {
+    static void store(char *& out, std::size_t& budget, const char * value)
+    {
+      if (!value)
+        value = "(null)";
+      capture_text::store(out, budget, value, std::strlen(value));
+    }
+  };
+
+  template<typename T>
+  struct capture<T, typename std::enable_if<std::is_same<T, std::string>::value>::type> : capture_text
+  {
+    static void store(char *& out, std::size_t& budget, const std::string& value)
+    {
+      capture_text::store(out, budget, value.data(), value.size());
+    }
+  };
+
+  // Numbers are formatted without going through a stream
   template<typename T>
-  void log(std::stringstream& os, T final)
+  struct capture<T, typename std::enable_if<std::is_arithmetic<T>::value>::type>
+  {
+    static constexpr std::size_t size = sizeof(T);
+
+    static void store(char *& out, std::size_t&, const T& value)
+    {
+      std::memcpy(out, &value, sizeof(T));
+      out += sizeof(T);
+    }
+
+    static void append(const char *& in, std::string& line)
+    {
+      T value;
+      std::memcpy(&value, in, sizeof(T));
+      in += sizeof(T);
+      append_number(line, value);
+    }
+  };
+
+  // Anything else that can only be streamed is turned into text up front
+  template<typename T>
+  struct capture<T, typename std::enable_if<!std::is_trivially_copyable<T>::value
+    && !std::is_same<T, std::string>::value>::type> : capture_text
+  {
+    static void store(char *& out, std::size_t& budget, const T& value)
+    {
+      std::ostringstream os;
+      os << value;
+      auto text = os.str();
+      capture_text::store(out, budget, text.data(), text.size());
+    }
+  };
+
+  // Adds up the bytes every argument needs no matter what its value is
+  template<typename... Args>
+  struct fixed_size
+  {
+    static constexpr std::size_t value = 0;
+  };
+
+  template<typename T, typename... Args>
+  struct fixed_size<T, Args...>
+  {
+    static constexpr std::size_t value = capture<T>::size + fixed_size<Args...>::value;
+  };
+
+  static void store(char *&, std::size_t&)
+  {
+  }
+
+  template<typename T, typename... Args>
+  static void store(char *& out, std::size_t& budget, const T& current, const Args&... next)
+  {
+    capture<T>::store(out, budget, current);
+    store(out, budget, next...);
+  }
+
+  static void append(const char *&, std::string&)
   {
-    os << final;
   }
 
-  // Expands to account for all types that can be output to a stream
   template<typename T, typename... Args>
-  void log(std::stringstream& os, T current, Args... next)
+  static void append(const char *& in, std::string& line, const T *, const Args *... next)
   {
-    os << current;
-    log(os, next...);
+    capture<T>::append(in, line);
+    append(in, line, next...);
   }
 
-  // Logs the final message
-  void log(const std::string& message);
+  // Runs on the writer thread
+  template<typename... Args>
+  static void format(const char * args, std::string& line)
+  {
+    append(args, line, static_cast<const Args *>(nullptr)...);
+  }
+
+  static void append_number(std::string& line, bool value);
+  static void append_number(std::string& line, char value);
+  static void append_number(std::string& line, signed char value);
+  static void append_number(std::string& line, unsigned char value);
+  static void append_number(std::string& line, long long value);
+  static void append_number(std::string& line, unsigned long long value);
+  static void append_number(std::string& line, long double value);
+
+  template<typename T>
+  static typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+    append_number(std::string& line, T value) { append_number(line, static_cast<long long>(value)); };
+
+  template<typename T>
+  static typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value>::type
+    append_number(std::string& line, T value) { append_number(line, static_cast<unsigned long long>(value)); };
+
+  template<typename T>
+  static typename std::enable_if<std::is_floating_point<T>::value>::type
+    append_number(std::string& line, T value) { append_number(line, static_cast<long double>(value)); };
+
+  entry * acquire();
+  thread_buffer_t * get_buffer();
+  void push(entry * item);
+
+  void write(entry * entries);
+  void work();
 
 private:
+  // Tells apart loggers that happen to reuse the same address
+  const std::size_t id_;
+
+  // Lock-free list of entries waiting to be written, newest first
+  std::atomic<entry *> head_;
+  std::atomic<std::size_t> pending_;
+  std::atomic<std::size_t> dropped_;
+
+  const std::size_t capacity_;
+  const overflow_policy policy_;
+  const int fd_;
+
+  // Only used to hand out thread buffers, to put the writer to sleep
+  // and to hold back blocked callers, never on the normal logging path
   std::mutex lock_;
+  std::condition_variable work_cv_;
+  std::condition_variable space_cv_;
+  buffer_vector_t buffers_;
+
+  std::string batch_;
+  std::atomic<bool> quit_;
+  std::thread writer_;
 
 private:
   // Disable assign / copy
@@ -69,4 +332,3 @@ private:
 };
 
 #endif // #if !defined(__LOGGER_H__)
-
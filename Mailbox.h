@@ -0,0 +1,105 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Mailbox.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Mailbox declaration:
+//  This is a lock-free multiple producer, single consumer
+//  queue of bottle, fork and request tokens.  Any neighbor can
+//  push, but only the owner drains.  Messages are intrusive
+//  and owned by the caller, so nothing is allocated here.
+//
+//  A message stands for one neighbor and carries a bit for each
+//  token it has sent us.  Posting a token sets its bit and only
+//  queues the message if it wasn't queued already, so one message
+//  per neighbor is enough no matter how many tokens are in flight.
+//
+
+#if !defined(__MAILBOX_H__)
+#define __MAILBOX_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+class Mailbox
+{
+public:
+  enum message_type {bottle, request, fork, fork_request};
+
+  // The bits of message_t::tokens, one per message_type.  The bottle
+  // can carry a dirty fork.
+  enum token_bits : std::uint8_t {bottle_token = 1, request_token = 2, fork_token = 4, fork_request_token = 8, dirty_token = 16};
+  static std::uint8_t token(message_type type, bool dirty = false)
+  {
+    return static_cast<std::uint8_t>((1 << type) | (dirty ? dirty_token : 0));
+  }
+
+  struct message_t
+  {
+    message_t * next;
+    std::uint32_t slot;                 // Where the sender sits in the owner's neighbor list
+    std::atomic<std::uint8_t> tokens;   // Zero unless queued
+  };
+
+public:
+  Mailbox() : head_(nullptr) {};
+  virtual ~Mailbox() = default;
+
+public:
+  // Safe to call from any thread.  The message must not be queued.
+  void push(message_t * message)
+  {
+    auto head = head_.load(std::memory_order_relaxed);
+    do
+    {
+      message->next = head;
+    } while (!head_.compare_exchange_weak(head, message,
+      std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  // Safe to call from any thread.  Adds the tokens to the message and
+  // queues it unless it already is.  Acquires the owner's exchange so
+  // its last use of next is done before we write it.  Returns true if
+  // we queued it, in which case it is on us to wake the owner.
+  bool post(message_t * message, std::uint8_t tokens)
+  {
+    if (message->tokens.fetch_or(tokens, std::memory_order_acq_rel) != 0)
+      return false;
+
+    push(message);
+    return true;
+  }
+
+  // Only the owner may drain.  Takes everything at once and hands
+  // it back oldest first.  Read next before taking the tokens, as a
+  // message can be queued again once they are gone.
+  message_t * drain()
+  {
+    auto head = head_.exchange(nullptr, std::memory_order_acquire);
+
+    message_t * oldest = nullptr;
+    while (head)
+    {
+      auto next = head->next;
+      head->next = oldest;
+      oldest = head;
+      head = next;
+    }
+
+    return oldest;
+  }
+
+  bool empty() const { return head_.load(std::memory_order_relaxed) == nullptr; };
+
+private:
+  std::atomic<message_t *> head_;
+
+private:
+  Mailbox(const Mailbox& rhs) = delete;
+  Mailbox& operator =(const Mailbox& rhs) = delete;
+};
+
+#endif // #if !defined(__MAILBOX_H__)
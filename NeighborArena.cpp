@@ -0,0 +1,83 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// NeighborArena.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the NeighborArena class
+//  The chunk list is reserved up front so adding a chunk never
+//  moves the ones readers are using.
+//
+
+#include "NeighborArena.h"
+
+constexpr NeighborArena::handle_t NeighborArena::no_handle;
+constexpr unsigned int NeighborArena::chunk_bits;
+constexpr std::size_t NeighborArena::chunk_size;
+constexpr std::size_t NeighborArena::max_chunks;
+
+NeighborArena::NeighborArena(std::size_t participants)
+  : chunks_()
+  , size_(0)
+  , lock_()
+  , epoch_(participants)
+{
+  chunks_.reserve(max_chunks);
+}
+
+NeighborArena::handle_t NeighborArena::add(INeighbor * guest, std::shared_ptr<INeighbor> owner)
+{
+  std::unique_lock<std::mutex> lock(lock_);
+
+  auto handle = size_.load(std::memory_order_relaxed);
+  if (handle >= no_handle || (handle >> chunk_bits) >= max_chunks)
+    return no_handle;
+
+  if ((handle & (chunk_size - 1)) == 0)
+  {
+    chunks_.emplace_back(new entry_t[chunk_size]);
+    for (std::size_t i = 0; i < chunk_size; i++)
+      chunks_.back()[i].guest.store(nullptr, std::memory_order_relaxed);
+  }
+
+  auto& entry = chunks_[handle >> chunk_bits][handle & (chunk_size - 1)];
+  entry.owner = std::move(owner);
+  entry.guest.store(guest, std::memory_order_release);
+
+  size_.store(handle + 1, std::memory_order_release);
+  return static_cast<handle_t>(handle);
+}
+
+std::uint64_t NeighborArena::remove(handle_t handle)
+{
+  std::shared_ptr<INeighbor> owner;
+
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(lock_);
+    if (handle >= size_.load(std::memory_order_relaxed))
+      return 0;
+
+    auto& entry = chunks_[handle >> chunk_bits][handle & (chunk_size - 1)];
+    entry.guest.store(nullptr, std::memory_order_release);
+    owner = std::move(entry.owner);
+  }
+
+  // Retired even without an owner, so the epoch moves past anyone
+  // who could still see the guest
+  auto epoch = epoch_.retire(std::move(owner));
+  epoch_.collect();
+  return epoch;
+}
+
+void NeighborArena::put(handle_t handle, std::shared_ptr<INeighbor> guest)
+{
+  std::unique_lock<std::mutex> lock(lock_);
+  if (handle >= size_.load(std::memory_order_relaxed))
+    return;
+
+  auto& entry = chunks_[handle >> chunk_bits][handle & (chunk_size - 1)];
+  auto raw = guest.get();
+  entry.owner = std::move(guest);
+  entry.guest.store(raw, std::memory_order_release);
+}
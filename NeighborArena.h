@@ -0,0 +1,92 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// NeighborArena.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// NeighborArena declaration:
+//  This is where a table keeps everyone its guests can send to,
+//  so a guest holds a small handle for each neighbor instead of
+//  a weak_ptr.  Turning a handle into the neighbor is one load,
+//  with no reference count to bump.
+//
+//  Entries never move, so handles stay good while guests come
+//  and go.  A removed neighbor reads back as nullptr and the
+//  arena's reference to it is retired through the Epoch, so
+//  anyone who read the pointer before it was removed can finish
+//  with it.  Readers must be inside the epoch.
+//
+
+#if !defined(__NEIGHBORARENA_H__)
+#define __NEIGHBORARENA_H__
+
+#include "Epoch.h"
+#include "INeighbor.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class NeighborArena
+{
+public:
+  typedef std::uint32_t handle_t;
+
+  static constexpr handle_t no_handle = ~handle_t(0);
+
+  // Entries come in chunks so the ones we have never move
+  static constexpr unsigned int chunk_bits = 12;
+  static constexpr std::size_t chunk_size = std::size_t(1) << chunk_bits;
+  static constexpr std::size_t max_chunks = std::size_t(1) << 16;
+
+  struct entry_t
+  {
+    std::atomic<INeighbor *> guest;
+    std::shared_ptr<INeighbor> owner;   // Keeps the guest alive
+  };
+
+public:
+  // Every thread that reads handles needs a participant number
+  NeighborArena(std::size_t participants);
+  virtual ~NeighborArena() = default;
+
+public:
+  // Without an owner the caller keeps the guest alive.  Returns
+  // no_handle once the arena is full.
+  handle_t add(INeighbor * guest, std::shared_ptr<INeighbor> owner = nullptr);
+  handle_t add(std::shared_ptr<INeighbor> guest) { auto raw = guest.get(); return add(raw, std::move(guest)); };
+
+  // nullptr once removed
+  INeighbor * get(handle_t handle) const
+  {
+    return chunks_[handle >> chunk_bits][handle & (chunk_size - 1)].guest.load(std::memory_order_acquire);
+  }
+
+  // Takes the guest out of sight and retires our reference to it.
+  // Returns the epoch it was retired in.
+  std::uint64_t remove(handle_t handle);
+
+  // Puts a guest in an entry that was added empty or removed, so a
+  // handle can be kept for whoever takes a seat next
+  void put(handle_t handle, std::shared_ptr<INeighbor> guest);
+
+  std::size_t size() const { return size_.load(std::memory_order_acquire); };
+  Epoch& get_epoch() { return epoch_; };
+
+private:
+  // Written once per chunk before size_ says the chunk is there
+  std::vector<std::unique_ptr<entry_t[]>> chunks_;
+  std::atomic<std::size_t> size_;
+  std::mutex lock_;
+
+  Epoch epoch_;
+
+private:
+  NeighborArena(const NeighborArena& rhs) = delete;
+  NeighborArena& operator =(const NeighborArena& rhs) = delete;
+};
+
+#endif // #if !defined(__NEIGHBORARENA_H__)
@@ -0,0 +1,69 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Parker.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the Parker class
+//  On Linux the state is the futex word, so parking is one
+//  system call that returns right away if we were unparked in
+//  the meantime.  Elsewhere it is a condition variable.
+//
+
+#include "Parker.h"
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+void Parker::park(time_point_t deadline)
+{
+#if defined(__linux__)
+  while (state_.load(std::memory_order_acquire) == parked)
+  {
+    // The futex takes a timeout rather than a deadline
+    timespec timeout;
+    timespec * wait = nullptr;
+    if (deadline != time_point_t::max())
+    {
+      auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+      if (left <= 0)
+        break;
+
+      timeout.tv_sec = static_cast<time_t>(left / 1000000000);
+      timeout.tv_nsec = static_cast<long>(left % 1000000000);
+      wait = &timeout;
+    }
+
+    ::syscall(SYS_futex, &state_, FUTEX_WAIT_PRIVATE, static_cast<std::uint32_t>(parked), wait, nullptr, 0);
+  }
+#else
+  std::unique_lock<std::mutex> lock(lock_);
+  auto unparked = [this] { return state_.load() != parked; };
+  if (deadline == time_point_t::max())
+    cv_.wait(lock, unparked);
+  else
+    cv_.wait_until(lock, deadline, unparked);
+#endif
+
+  state_.store(running, std::memory_order_relaxed);
+}
+
+void Parker::wake()
+{
+#if defined(__linux__)
+  ::syscall(SYS_futex, &state_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+  // Taking the lock means the owner is either still ahead of its
+  // check or already asleep
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(lock_);
+  }
+
+  cv_.notify_one();
+#endif
+}
@@ -0,0 +1,99 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Parker.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Parker declaration:
+//  This puts one thread to sleep until another thread has
+//  something for it.  The owner says it is about to park and
+//  then looks for work one last time, and whoever makes work
+//  for it does so before checking whether it is parked.  Either
+//  the owner sees the work or the waker sees the owner parked.
+//
+//  Waking a thread that isn't parked is a fence and a load.
+//
+
+#if !defined(__PARKER_H__)
+#define __PARKER_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#if !defined(__linux__)
+#include <condition_variable>
+#include <mutex>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+class Parker
+{
+public:
+  enum park_state : std::uint32_t {running, parked};
+
+  typedef std::chrono::steady_clock::time_point time_point_t;
+
+public:
+  Parker() : state_(running) {};
+  virtual ~Parker() = default;
+
+public:
+  // Owner only.  Look for work between prepare() and park(), and
+  // cancel() instead of parking if there is some.
+  void prepare()
+  {
+    state_.store(parked, std::memory_order_relaxed);
+
+    // Pairs with the fence in unpark()
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  void cancel() { state_.store(running, std::memory_order_relaxed); };
+
+  // Sleeps until unparked or the deadline passes
+  void park(time_point_t deadline = time_point_t::max());
+
+  // Anyone, once the work is where the owner will look
+  void unpark()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (state_.load(std::memory_order_relaxed) == parked && state_.exchange(running) == parked)
+      wake();
+  }
+
+  // Tells the core we are spinning
+  static void pause()
+  {
+#if defined(_MSC_VER)
+    _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+  }
+
+private:
+  void wake();
+
+private:
+  std::atomic<std::uint32_t> state_;
+
+#if !defined(__linux__)
+  std::mutex lock_;
+  std::condition_variable cv_;
+#endif
+
+private:
+  Parker(const Parker& rhs) = delete;
+  Parker& operator =(const Parker& rhs) = delete;
+};
+
+#endif // #if !defined(__PARKER_H__)
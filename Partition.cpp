@@ -0,0 +1,351 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Partition.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the Partition class
+//  Everything works on the graph in compressed rows, so a million
+//  edges split in a few passes over two flat arrays.
+//
+
+#include "Partition.h"
+#include "Random.h"
+#include "ShardTransport.h"
+#include "Topology.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <utility>
+
+// The neighbors of guest g are targets[offsets[g]] up to targets[offsets[g + 1]]
+struct graph_t
+{
+  std::vector<std::size_t> offsets;
+  std::vector<int> targets;
+};
+
+static graph_t make_graph(int guests, const Partition::edge_vector_t& edges)
+{
+  graph_t graph;
+  graph.offsets.assign(static_cast<std::size_t>(guests) + 1, 0);
+
+  auto valid = [guests](const Partition::edge_t& edge)
+  {
+    return edge.first != edge.second && edge.first >= 0 && edge.second >= 0
+      && edge.first < guests && edge.second < guests;
+  };
+
+  for (auto& edge : edges)
+  {
+    if (!valid(edge))
+      continue;
+
+    graph.offsets[static_cast<std::size_t>(edge.first) + 1]++;
+    graph.offsets[static_cast<std::size_t>(edge.second) + 1]++;
+  }
+
+  for (std::size_t i = 1; i < graph.offsets.size(); i++)
+    graph.offsets[i] += graph.offsets[i - 1];
+
+  auto next = graph.offsets;
+  graph.targets.resize(graph.offsets.back());
+  for (auto& edge : edges)
+  {
+    if (!valid(edge))
+      continue;
+
+    graph.targets[next[static_cast<std::size_t>(edge.first)]++] = edge.second;
+    graph.targets[next[static_cast<std::size_t>(edge.second)]++] = edge.first;
+  }
+
+  return graph;
+}
+
+// Appends everyone reachable from start in breadth first order
+static void visit(const graph_t& graph, int start, std::vector<int>& marks, int mark, std::vector<int>& order)
+{
+  auto head = order.size();
+  marks[static_cast<std::size_t>(start)] = mark;
+  order.push_back(start);
+
+  while (head < order.size())
+  {
+    auto guest = static_cast<std::size_t>(order[head++]);
+    for (auto i = graph.offsets[guest]; i < graph.offsets[guest + 1]; i++)
+    {
+      auto neighbor = graph.targets[i];
+      if (marks[static_cast<std::size_t>(neighbor)] == mark)
+        continue;
+
+      marks[static_cast<std::size_t>(neighbor)] = mark;
+      order.push_back(neighbor);
+    }
+  }
+}
+
+// Breadth first over every component.  Each one is walked from the
+// last guest a first walk reached, which is about as far from the
+// middle as we can get cheaply, so the layers stay narrow.
+static std::vector<int> make_order(const graph_t& graph, int guests)
+{
+  std::vector<int> order;
+  order.reserve(static_cast<std::size_t>(guests));
+
+  std::vector<int> marks(static_cast<std::size_t>(guests), 0);
+  std::vector<int> scratch;
+
+  for (int guest = 0; guest < guests; guest++)
+  {
+    if (marks[static_cast<std::size_t>(guest)] != 0)
+      continue;
+
+    scratch.clear();
+    visit(graph, guest, marks, 1, scratch);
+
+    // The second walk takes the component over from the first
+    visit(graph, scratch.back(), marks, 2, order);
+  }
+
+  return order;
+}
+
+// Moves guests from parts over their size to parts under it, the ones
+// that lose the fewest shared bottles first
+static void rebalance(const graph_t& graph, Partition::part_vector_t& parts,
+  std::vector<int>& sizes, const std::vector<int>& targets)
+{
+  struct move_t
+  {
+    int gain;
+    int guest;
+    int to;
+  };
+
+  auto part_count = static_cast<int>(sizes.size());
+  std::vector<int> counts(sizes.size(), 0);
+  std::vector<int> touched;
+  std::vector<move_t> moves;
+
+  for (;;)
+  {
+    moves.clear();
+    bool over = false;
+
+    for (std::size_t guest = 0; guest < parts.size(); guest++)
+    {
+      auto from = parts[guest];
+      if (sizes[from] <= targets[from])
+        continue;
+
+      over = true;
+      for (auto i = graph.offsets[guest]; i < graph.offsets[guest + 1]; i++)
+        if (counts[parts[graph.targets[i]]]++ == 0)
+          touched.push_back(parts[graph.targets[i]]);
+
+      int best = -1;
+      for (auto part : touched)
+        if (sizes[part] < targets[part] && (best < 0 || counts[part] > counts[best]))
+          best = part;
+
+      if (best >= 0)
+        moves.push_back({ counts[best] - counts[from], static_cast<int>(guest), best });
+
+      for (auto part : touched)
+        counts[part] = 0;
+      touched.clear();
+    }
+
+    if (!over)
+      return;
+
+    // No neighbor has room.  Move guests to the nearest part that
+    // does, which is also the nearest on the cores.
+    if (moves.empty())
+    {
+      for (std::size_t guest = 0; guest < parts.size(); guest++)
+      {
+        auto from = parts[guest];
+        if (sizes[from] <= targets[from])
+          continue;
+
+        int best = -1;
+        for (int part = 0; part < part_count; part++)
+          if (sizes[part] < targets[part] && (best < 0 || std::abs(part - from) < std::abs(best - from)))
+            best = part;
+
+        moves.push_back({ 0, static_cast<int>(guest), best });
+      }
+    }
+
+    std::stable_sort(moves.begin(), moves.end(),
+      [](const move_t& lhs, const move_t& rhs) { return lhs.gain > rhs.gain; });
+
+    for (auto& move : moves)
+    {
+      auto from = parts[static_cast<std::size_t>(move.guest)];
+      if (sizes[from] <= targets[from] || sizes[move.to] >= targets[move.to])
+        continue;
+
+      parts[static_cast<std::size_t>(move.guest)] = move.to;
+      sizes[from]--;
+      sizes[move.to]++;
+    }
+  }
+}
+
+// Label propagation.  A guest moves to the part with the most of its
+// neighbors if that part has room, staying put on a tie.  Then the
+// sizes are evened out again.
+static void refine(const graph_t& graph, Partition::part_vector_t& parts, const std::vector<int>& targets,
+  unsigned long long seed, int passes)
+{
+  // A little slack lets guests move before rebalance() evens it out
+  std::vector<int> caps(targets.size());
+  for (std::size_t part = 0; part < targets.size(); part++)
+    caps[part] = targets[part] + std::max(1, targets[part] / 32);
+
+  std::vector<int> sizes(targets.size(), 0);
+  for (auto part : parts)
+    sizes[part]++;
+
+  std::vector<int> order(parts.size());
+  for (std::size_t guest = 0; guest < order.size(); guest++)
+    order[guest] = static_cast<int>(guest);
+
+  Random random(seed, static_cast<std::uint64_t>(targets.size()));
+  std::vector<int> counts(targets.size(), 0);
+  std::vector<int> touched;
+
+  for (int pass = 0; pass < passes; pass++)
+  {
+    // A fresh order every pass so the parts don't drift one way
+    for (std::size_t i = order.size() - 1; i > 0; i--)
+      std::swap(order[i], order[random.next_below(i + 1)]);
+
+    std::size_t moved = 0;
+    for (auto guest : order)
+    {
+      auto index = static_cast<std::size_t>(guest);
+      auto own = parts[index];
+
+      for (auto i = graph.offsets[index]; i < graph.offsets[index + 1]; i++)
+        if (counts[parts[graph.targets[i]]]++ == 0)
+          touched.push_back(parts[graph.targets[i]]);
+
+      auto best = own;
+      for (auto part : touched)
+        if (counts[part] > counts[best] && sizes[part] < caps[part])
+          best = part;
+
+      for (auto part : touched)
+        counts[part] = 0;
+      touched.clear();
+
+      if (best == own)
+        continue;
+
+      parts[index] = best;
+      sizes[own]--;
+      sizes[best]++;
+      moved++;
+    }
+
+    if (moved == 0)
+      break;
+  }
+
+  rebalance(graph, parts, sizes, targets);
+}
+
+Partition::part_vector_t Partition::split(int guests, const edge_vector_t& edges, int parts,
+  unsigned long long seed, int passes)
+{
+  if (guests <= 0)
+    return part_vector_t();
+
+  if (parts <= 1)
+    return part_vector_t(static_cast<std::size_t>(guests), 0);
+
+  auto graph = make_graph(guests, edges);
+
+  std::vector<int> targets(static_cast<std::size_t>(parts));
+  for (int part = 0; part < parts; part++)
+    targets[part] = ShardTransport::get_first_guest(part + 1, parts, guests) - ShardTransport::get_first_guest(part, parts, guests);
+
+  // Cut the breadth first order into runs of the right sizes
+  part_vector_t result(static_cast<std::size_t>(guests));
+  auto order = make_order(graph, guests);
+  std::size_t next = 0;
+  for (int part = 0; part < parts; part++)
+    for (int i = 0; i < targets[part]; i++)
+      result[static_cast<std::size_t>(order[next++])] = part;
+
+  refine(graph, result, targets, seed, passes);
+
+  // Generators number grids by rows and rings in order, which a
+  // breadth first walk can't beat.  Start from the ids as well and
+  // keep whichever cuts less.
+  auto blocked = blocks(guests, parts);
+  refine(graph, blocked, targets, seed, passes);
+
+  if (count_cut(edges, blocked) < count_cut(edges, result))
+    return blocked;
+
+  return result;
+}
+
+Partition::part_vector_t Partition::blocks(int guests, int parts)
+{
+  part_vector_t result(static_cast<std::size_t>(std::max(guests, 0)), 0);
+  if (parts <= 1)
+    return result;
+
+  for (int guest = 0; guest < guests; guest++)
+    result[static_cast<std::size_t>(guest)] = ShardTransport::get_shard(guest, parts, guests);
+
+  return result;
+}
+
+std::size_t Partition::count_cut(const edge_vector_t& edges, const part_vector_t& parts)
+{
+  auto guests = static_cast<int>(parts.size());
+
+  std::size_t cut = 0;
+  for (auto& edge : edges)
+  {
+    if (edge.first < 0 || edge.second < 0 || edge.first >= guests || edge.second >= guests)
+      continue;
+
+    if (parts[static_cast<std::size_t>(edge.first)] != parts[static_cast<std::size_t>(edge.second)])
+      cut++;
+  }
+
+  return cut;
+}
+
+std::vector<int> Partition::relabel(const part_vector_t& parts, int part_count, edge_vector_t& edges)
+{
+  auto guests = static_cast<int>(parts.size());
+
+  std::vector<int> next(static_cast<std::size_t>(std::max(part_count, 1)));
+  for (int part = 0; part < part_count; part++)
+    next[part] = ShardTransport::get_first_guest(part, part_count, guests);
+
+  std::vector<int> ids(parts.size());
+  for (std::size_t guest = 0; guest < parts.size(); guest++)
+    ids[guest] = next[parts[guest]]++;
+
+  for (auto& edge : edges)
+  {
+    if (edge.first < 0 || edge.second < 0 || edge.first >= guests || edge.second >= guests)
+      continue;
+
+    edge.first = ids[static_cast<std::size_t>(edge.first)];
+    edge.second = ids[static_cast<std::size_t>(edge.second)];
+  }
+
+  Topology::normalize(edges);
+  return ids;
+}
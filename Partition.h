@@ -0,0 +1,58 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Partition.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Partition declaration:
+//  This splits the guests into parts so that as few bottles as
+//  possible are shared between parts.  A bottle between two
+//  workers or two shards costs a cache line transfer or a
+//  message every time it moves; inside a part it stays put.
+//
+//  The guests are laid out in breadth first order and cut into
+//  runs, so every part starts out connected and part p sits next
+//  to part p + 1.  Label propagation then moves guests to the
+//  part most of their neighbors are in, and a last pass evens out
+//  the sizes again.  Part p ends up with exactly as many guests as
+//  ShardTransport gives shard p.
+//
+
+#if !defined(__PARTITION_H__)
+#define __PARTITION_H__
+
+#include "Edge.h"
+
+#include <cstddef>
+#include <vector>
+
+class Partition
+{
+public:
+  typedef ::edge_t edge_t;
+  typedef ::edge_vector_t edge_vector_t;
+  typedef std::vector<int> part_vector_t;
+
+public:
+  // The part of every guest, by id.  The seed only breaks ties.
+  static part_vector_t split(int guests, const edge_vector_t& edges, int parts,
+    unsigned long long seed = 0, int passes = 8);
+
+  // Runs of consecutive ids, which is what we get without splitting
+  static part_vector_t blocks(int guests, int parts);
+
+  // Bottles whose guests are in different parts
+  static std::size_t count_cut(const edge_vector_t& edges, const part_vector_t& parts);
+
+  // Renumbers the guests so every part is a run of consecutive ids,
+  // the same runs as blocks(), keeping the order inside a part.  The
+  // edges are rewritten and normalized.  Returns the new id of every
+  // old one.
+  static std::vector<int> relabel(const part_vector_t& parts, int part_count, edge_vector_t& edges);
+
+private:
+  Partition() = delete;
+};
+
+#endif // #if !defined(__PARTITION_H__)
@@ -11,29 +11,83 @@
 //
 
 #include "Philosopher.h"
+#include "Affinity.h"
+#include "Duration.h"
+#include "GuardKernel.h"
 
-#include <functional>
+#include <algorithm>
 #include <vector>
 
-static constexpr auto tranquil_min(std::chrono::milliseconds(5));
-static constexpr auto tranquil_max(std::chrono::milliseconds(25));
-static constexpr auto tranquil_range(tranquil_max - tranquil_min);
+constexpr std::size_t Philosopher::no_slot;
+constexpr std::chrono::nanoseconds Philosopher::max_spin;
+constexpr int Philosopher::max_yields;
 
 // Start all philosophers in state of tranquil
-Philosopher::Philosopher(int id, Logger& log, IDrinkListener * listener)
+Philosopher::Philosopher(int id, Logger& log, IDrinkListener * listener, IScheduler * scheduler)
   : id_(id)
   , state_(tranquil)
-  , bottles_()
+  , neighbor_ids_()
+  , neighbors_()
+  , bot_()
+  , reqb_()
+  , need_()
+  , dirty_()
+  , fork_()
+  , reqf_()
+  , all_()
+  , fire_()
+  , held_()
+  , slot_map_(std::make_shared<slot_map_t>())
+  , slots_(slot_map_.get())
+  , retired_slots_()
+  , free_slots_()
+  , changes_lock_()
+  , changes_()
+  , changed_(false)
+  , changes_posted_(0)
+  , changes_made_(0)
+  , changes_taken_(0)
+  , deferred_()
+  , holding_(false)
+  , arena_(nullptr)
+  , own_arena_()
+  , participant_(0)
+  , requests_()
+  , forks_()
+  , inbox_()
   , wait_(false)
-  , end_tranquil_(std::chrono::system_clock::now())
+  , random_(0, static_cast<std::uint64_t>(id))
+  , tranquil_(nullptr)
+  , drinking_(nullptr)
+  , end_tranquil_(scheduler ? scheduler->now() : std::chrono::steady_clock::now())
+  , end_drinking_()
+  , timer_()
   , listener_(listener)
+  , trace_(nullptr)
+  , demand_(nullptr)
+  , episode_(0)
+  , hungry_(false)
+  , eating_(false)
+  , stats_()
+  , thirsty_since_(0)
+  , requested_at_()
+  , steps_(0)
   , log_(log)
   , quit_(false)
   , start_(false)
-  , worker_(std::thread(&Philosopher::work, this))
+  , scheduler_(scheduler)
+  , simulated_(scheduler && scheduler->is_virtual())
+  , task_state_(task_idle)
+  , home_(-1)
+  , worker_()
+  , parker_()
+  , handoff_(0)
+  , spin_limit_(0)
+  , max_spin_(0)
 {
-  // Initialize the randomizer
-  ::srand(static_cast<unsigned int>(::time(NULL)));
+  // Only spin up our own thread if nobody is scheduling us
+  if (!scheduler_)
+    worker_ = std::thread(&Philosopher::work, this);
 }
 
 Philosopher::~Philosopher()
@@ -43,14 +97,34 @@ Philosopher::~Philosopher()
 
 void Philosopher::start()
 {
-  std::unique_lock<std::mutex> lock(start_lock_);
-  start_ = true;
-  start_cv_.notify_all();
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(start_lock_);
+    start_ = true;
+    start_cv_.notify_all();
+  }
+
+  if (scheduler_)
+  {
+    log_.log("Philosopher[", id_, "] is starting.");
+    wake();
+  }
+}
+
+void Philosopher::set_arena(NeighborArena * arena, std::size_t participant)
+{
+  arena_ = arena;
+  participant_ = participant;
+}
+
+bool Philosopher::pin(int cpu)
+{
+  return Affinity::pin(worker_, cpu);
 }
 
 void Philosopher::quit()
 {
   quit_ = true;
+  parker_.unpark();
 
   if (worker_.joinable())
     worker_.join();
@@ -75,8 +149,22 @@ void Philosopher::introduce_neighbor(std::shared_ptr<INeighbor> neighbor)
   }
 
   // See if we already have a bottle for this neighbor
-  if (bottles_.find(id) != bottles_.end())
+  if (find_slot(id))
+    return;
+
+  // Introductions can happen without a table to put us in an arena
+  if (!arena_)
+  {
+    own_arena_.reset(new NeighborArena(1));
+    set_arena(own_arena_.get(), 0);
+  }
+
+  auto handle = arena_->add(neighbor.get());
+  if (handle == NeighborArena::no_handle)
+  {
+    log_.log("Error: No room for Philosopher[", id_, "] to meet Philosopher[", id, "].");
     return;
+  }
 
   // Set up our bottle for this neighbor
   // Assume we have the token and we will make
@@ -84,7 +172,8 @@ void Philosopher::introduce_neighbor(std::shared_ptr<INeighbor> neighbor)
   // If he doesn't know us yet, he will drop the bottle but will
   // then introduce himself back to us and give us the bottle
   // Forks are assumed dirty until someone drinks
-  bottles_[id] = { false, true, false, false, neighbor };
+  auto slot = add_slot(id, handle);
+  reqb_.set(slot);
 
   // Try to send the neighbor the bottle.  If he doesn't know us
   // yet, he should discard the request.
@@ -95,216 +184,823 @@ void Philosopher::introduce_neighbor(std::shared_ptr<INeighbor> neighbor)
   neighbor->introduce_neighbor(shared_from_this());
 
   // The neighbor may have given us the bottle back during introductions
-  auto& bottle = bottles_[id];
-  if (bottle.bot && bottle.reqb)
+  auto lock = lock_bottles();
+  receive();
+
+  if (bot_.test(slot) && reqb_.test(slot))
   {
     // We have both.  Drop the request as we can safely assume the
     // neighbor dropped the bottle
-    bottle.reqb = false;
+    reqb_.reset(slot);
   }
+
+  // The fork starts out wherever the bottle ended up
+  if (bot_.test(slot))
+    fork_.set(slot);
+  else
+    reqf_.set(slot);
 }
 
+// The send functions run on the sender's thread.  They only look up
+// the slot in the map we last published and post the token to our
+// mailbox.  The tokens are applied on our own thread in receive().
+//
+// Every slot has one message with a bit for each kind of token.  There
+// is only one of each token per pair, so a bit can never be set again
+// before we have drained it.
 void Philosopher::send_bottle(int sender_id, bool dirty)
 {
-  std::unique_lock<std::mutex> lock(bottles_lock_);
+  // Here we are receiving the bottle from a neighbor
+  deliver(sender_id, Mailbox::token(Mailbox::bottle, dirty));
+}
+
+void Philosopher::send_request(int sender_id)
+{
+  // Here we are receiving the request token from a neighbor
+  deliver(sender_id, Mailbox::request_token);
+}
+
+void Philosopher::send_fork(int sender_id)
+{
+  deliver(sender_id, Mailbox::fork_token);
+}
 
-  // Here we are receiving the request from a neighbor
+void Philosopher::send_fork_request(int sender_id)
+{
+  deliver(sender_id, Mailbox::fork_request_token);
+}
 
-  // (R4) Receive a Bottle:
-  //    upon receiving bottle b ->
-  //    bot(b) := true
-  auto entry = bottles_.find(sender_id);
-  if (entry == bottles_.end())
+// Without a scheduler we wake our own thread if it is parked.
+// Otherwise the scheduler posts the message, which for a simulator
+// means after the network delay.  Only whoever queues the message
+// wakes us, as any later token is drained along with it.
+void Philosopher::deliver(int sender_id, std::uint8_t tokens)
+{
+  auto slot = find_slot(sender_id);
+  if (!slot)
     return;
 
-  // We now own the bottle
-  auto& bottle = entry->second;
-  bottle.bot = true;
-  bottle.dirty = dirty;
+  if (scheduler_)
+    scheduler_->deliver(this, &mailbox_, slot->message, tokens);
+  else if (mailbox_.post(slot->message, tokens))
+    parker_.unpark();
 }
 
-void Philosopher::send_request(int sender_id)
+// Senders are inside the epoch, so the map they find can't be freed
+// under them
+const Philosopher::slot_t * Philosopher::find_slot(int id) const
 {
-  std::unique_lock<std::mutex> lock(bottles_lock_);
-  // Here we are receiving the request token from a neighbor
+  return find_slot(*slots_.load(std::memory_order_acquire), id);
+}
+
+// A binary search, which for the few neighbors most of us have is
+// about as quick as hashing and takes a lot less room
+const Philosopher::slot_t * Philosopher::find_slot(const slot_map_t& slots, int id)
+{
+  auto entry = std::lower_bound(slots.begin(), slots.end(), id,
+    [](const slot_t& slot, int id) { return slot.id < id; });
+
+  return (entry != slots.end() && entry->id == id) ? &*entry : nullptr;
+}
 
-  // (R3) Receive Request for a Bottle:
-  //    upon receiving request for bottle b ->
-  //    reqb(b) := true;
-  auto entry = bottles_.find(sender_id);
-  if (entry == bottles_.end())
+// Gives the neighbor a free slot, or the next one, in every array.
+// Doesn't hand out any tokens.
+std::size_t Philosopher::add_slot(int id, NeighborArena::handle_t neighbor)
+{
+  reuse_slots();
+
+  std::size_t slot;
+  if (!free_slots_.empty())
+  {
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+    neighbor_ids_[slot] = id;
+    neighbors_[slot] = neighbor;
+
+    for (auto bits : { &bot_, &reqb_, &need_, &dirty_, &fork_, &reqf_, &all_, &fire_, &held_ })
+      bits->reset(slot);
+  }
+  else
+  {
+    slot = neighbor_ids_.size();
+    neighbor_ids_.push_back(id);
+    neighbors_.push_back(neighbor);
+
+    for (auto bits : { &bot_, &reqb_, &need_, &dirty_, &fork_, &reqf_, &all_, &fire_, &held_ })
+      bits->resize(slot + 1);
+    if (stats_)
+      requested_at_.resize(slot + 1, 0);
+
+    inbox_.emplace_back();
+    inbox_.back().slot = static_cast<std::uint32_t>(slot);
+  }
+
+  all_.set(slot);
+
+  // Neighbors mostly come in id order, which keeps this an append
+  auto& slots = *slot_map_;
+  auto entry = std::upper_bound(slots.begin(), slots.end(), id,
+    [](int id, const slot_t& slot) { return id < slot.id; });
+  slots.insert(entry, { id, static_cast<std::uint32_t>(slot), &inbox_[slot] });
+
+  return slot;
+}
+
+// Takes the neighbor out of the map and drops whatever we held of
+// theirs.  The slot itself waits in retired_slots_.  Returns the slot,
+// or no_slot if we didn't know them.
+std::size_t Philosopher::remove_slot(int id)
+{
+  auto& slots = *slot_map_;
+  auto entry = std::lower_bound(slots.begin(), slots.end(), id,
+    [](const slot_t& slot, int id) { return slot.id < id; });
+  if (entry == slots.end() || entry->id != id)
+    return no_slot;
+
+  std::size_t slot = entry->slot;
+  slots.erase(entry);
+
+  for (auto bits : { &bot_, &reqb_, &need_, &dirty_, &fork_, &reqf_, &all_, &fire_, &held_ })
+    bits->reset(slot);
+  neighbor_ids_[slot] = -1;
+  if (slot < requested_at_.size())
+    requested_at_[slot] = 0;
+
+  return slot;
+}
+
+// A sender that found a slot in an old map can still post to it until
+// the epoch passes.  After that, whatever it sent is drained so the
+// next neighbor in the slot starts clean.  Must be called with the
+// bottles_lock_ held once we run.
+void Philosopher::reuse_slots()
+{
+  if (retired_slots_.empty() || !free_slots_.empty()
+    || (arena_ && !arena_->get_epoch().passed(retired_slots_.back().epoch)))
     return;
 
-  // We now own the request token
-  auto& bottle = entry->second;
-  bottle.reqb = true;
+  receive();
+  for (auto& retired : retired_slots_)
+    free_slots_.push_back(retired.slot);
+  retired_slots_.clear();
+}
+
+std::uint64_t Philosopher::connect(int id, NeighborArena::handle_t neighbor, bool bottle, Parker * waiter)
+{
+  return post_change({ id, neighbor, true, bottle, false, false, waiter, 0 });
+}
+
+std::uint64_t Philosopher::disconnect(int id, Parker * waiter)
+{
+  return post_change({ id, NeighborArena::no_handle, false, false, false, false, waiter, 0 });
+}
+
+std::uint64_t Philosopher::connect_after_drink(int id, NeighborArena::handle_t neighbor, Parker * waiter)
+{
+  return post_change({ id, neighbor, true, true, true, false, waiter, 0 });
+}
+
+std::uint64_t Philosopher::hold(Parker * waiter)
+{
+  return post_change({ -1, NeighborArena::no_handle, false, false, false, true, waiter, 0 });
+}
+
+std::uint64_t Philosopher::post_change(change_t change)
+{
+  std::uint64_t posted;
+
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(changes_lock_);
+    posted = ++changes_posted_;
+    change.number = posted;
+    changes_.push_back(change);
+    changed_ = true;
+  }
+
+  // Nobody sends to us before we start
+  if (!start_)
+  {
+    auto lock = lock_bottles();
+    apply_changes();
+  }
+  else
+    wake();
+
+  return posted;
+}
+
+// Makes the changes posted to us.  Must be called with the
+// bottles_lock_ held, and inside the epoch once we run.
+void Philosopher::apply_changes()
+{
+  if (!changed_.load(std::memory_order_acquire))
+    return;
+
+  std::vector<change_t> changes;
+
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(changes_lock_);
+    changes.swap(changes_);
+    changes_taken_ = changes_posted_;
+    changed_ = false;
+  }
+
+  // Before we start nothing has to wait
+  std::vector<change_t> now;
+  for (auto& change : changes)
+  {
+    if (start_ && (change.after_drink || change.hold || !deferred_.empty()))
+      deferred_.push_back(change);
+    else
+      now.push_back(change);
+  }
+
+  make_changes(now);
+  make_deferred_changes();
+}
+
+// Must be called with the bottles_lock_ held, and inside the epoch
+// once we run
+void Philosopher::make_changes(const std::vector<change_t>& changes)
+{
+  if (changes.empty())
+    return;
+
+  auto old = slot_map_;
+  slot_map_ = std::make_shared<slot_map_t>(*old);
+
+  // A hold lasts until the next change
+  std::vector<std::size_t> removed;
+  for (auto& change : changes)
+  {
+    holding_ = change.hold;
+    if (change.hold)
+      continue;
+    else if (change.add)
+      add_neighbor(change.id, change.neighbor, change.bottle);
+    else
+    {
+      auto slot = remove_slot(change.id);
+      if (slot != no_slot)
+        removed.push_back(slot);
+    }
+  }
+
+  // Whoever still reads the old map is in an epoch before this one
+  slots_.store(slot_map_.get(), std::memory_order_release);
+  auto epoch = arena_ ? arena_->get_epoch().retire(std::move(old)) : 0;
+  for (auto slot : removed)
+    retired_slots_.push_back({ static_cast<std::uint32_t>(slot), epoch });
+
+  // Everything before the first change still deferred
+  changes_made_.store(deferred_.empty() ? changes_taken_ : deferred_.front().number - 1,
+    std::memory_order_release);
+
+  for (auto& change : changes)
+    if (change.waiter)
+      change.waiter->unpark();
+}
+
+// Makes the deferred changes we are ready for, in order.  Once we hold
+// everything we share dirty, everyone comes before us.  That is always
+// so at the end of a drink, but with a demand model we can have given
+// up a dirty fork since we ate, so it waits for a meal that ends with
+// them all.  Must be called with the bottles_lock_ held, inside the
+// epoch.
+void Philosopher::make_deferred_changes()
+{
+  if (deferred_.empty())
+    return;
+
+  auto& held = demand_ ? fork_ : bot_;
+  auto words = all_.word_count();
+  auto& kernel = GuardKernel::select(words);
+  auto behind = kernel.satisfied(all_.data(), held.data(), words) && kernel.satisfied(all_.data(), dirty_.data(), words);
+  auto resting = state_ == tranquil && !hungry_ && !eating_;
+
+  auto ready = deferred_.begin();
+  while (ready != deferred_.end() && (!ready->after_drink || behind) && (!ready->hold || resting))
+    ++ready;
+  if (ready == deferred_.begin())
+    return;
+
+  std::vector<change_t> changes(deferred_.begin(), ready);
+  deferred_.erase(deferred_.begin(), ready);
+  make_changes(changes);
+}
+
+std::vector<int> Philosopher::get_neighbor_ids() const
+{
+  std::vector<int> ids;
+  ids.reserve(slot_map_->size());
+  for (auto& slot : *slot_map_)
+    ids.push_back(slot.id);
+
+  return ids;
+}
+
+void Philosopher::reserve_neighbors(std::size_t count, std::shared_ptr<Arena> arena)
+{
+  if (arena && neighbor_ids_.empty())
+  {
+    ArenaAllocator<char> allocator(std::move(arena));
+    neighbors_ = handle_vector_t(allocator);
+    *slot_map_ = slot_map_t(allocator);
+    inbox_ = inbox_t(allocator);
+    for (auto bits : { &bot_, &reqb_, &need_, &dirty_, &fork_, &reqf_, &all_, &fire_, &held_ })
+      *bits = Bitset(Bitset::allocator_t(allocator));
+  }
+
+  neighbor_ids_.reserve(count);
+  neighbors_.reserve(count);
+  slot_map_->reserve(count);
+
+  for (auto bits : { &bot_, &reqb_, &need_, &dirty_, &fork_, &reqf_, &all_, &fire_, &held_ })
+    bits->reserve(count);
+}
+
+// The holder of the bottle starts with it and a dirty fork and the
+// other side starts with both request tokens, as in the paper.  Giving
+// them to the lower id of every pair keeps the precedence graph acyclic.
+void Philosopher::add_neighbor(int id, NeighborArena::handle_t neighbor, bool bottle)
+{
+  if (id == id_ || find_slot(*slot_map_, id))
+    return;
+
+  auto slot = add_slot(id, neighbor);
+  if (bottle)
+  {
+    bot_.set(slot);
+    fork_.set(slot);
+    dirty_.set(slot);
+  }
+  else
+  {
+    reqb_.set(slot);
+    reqf_.set(slot);
+  }
+}
+
+void Philosopher::enable_stats()
+{
+  if (!stats_)
+    stats_.reset(new stats_t());
+
+  requested_at_.resize(neighbor_ids_.size(), 0);
+}
+
+std::size_t Philosopher::get_missing_bottles()
+{
+  auto lock = lock_bottles();
+
+  std::size_t missing = 0;
+  for (std::size_t i = 0; i < need_.word_count(); i++)
+    missing += Bitset::count_bits(need_.word(i) & ~bot_.word(i));
+
+  return missing;
 }
 
 bool Philosopher::has_bottle(int id)
 {
-  std::unique_lock<std::mutex> lock(bottles_lock_);
+  auto lock = lock_bottles();
+  receive();
+
   // Look up the bottle record
-  auto entry = bottles_.find(id);
-  return (entry != bottles_.end() && entry->second.bot);
+  auto slot = find_slot(id);
+  return (slot && bot_.test(slot->slot));
 }
 
 bool Philosopher::has_request(int id)
 {
-  std::unique_lock<std::mutex> lock(bottles_lock_);
+  auto lock = lock_bottles();
+  receive();
+
   // Look up the bottle record
-  auto entry = bottles_.find(id);
-  return (entry != bottles_.end() && entry->second.reqb);
+  auto slot = find_slot(id);
+  return (slot && reqb_.test(slot->slot));
+}
+
+// Applies all the tokens our neighbors have sent us.  Must be called
+// with the bottles_lock_ held.  A neighbor can only send a token back
+// after getting it, so a bottle comes before its request and a fork
+// before its request.
+void Philosopher::receive()
+{
+  auto message = mailbox_.drain();
+  while (message)
+  {
+    auto next = message->next;
+    auto slot = message->slot;
+    auto tokens = message->tokens.exchange(0, std::memory_order_acq_rel);
+
+    // A neighbor that has left can still have had tokens on the way
+    if (!all_.test(slot))
+      tokens = 0;
+
+    if (tokens & Mailbox::bottle_token)
+    {
+      // (R4) Receive a Bottle:
+      //    upon receiving bottle b ->
+      //    bot(b) := true
+      // With separate forks the bottle doesn't carry one
+      bool dirty = (tokens & Mailbox::dirty_token) != 0;
+      bot_.set(slot);
+      if (!demand_)
+        dirty_.set(slot, dirty);
+      record(Trace::bottle_received, neighbor_ids_[slot], dirty);
+
+      if (stats_ && requested_at_[slot])
+      {
+        stats_->bottle_time.record(get_ticks() - requested_at_[slot]);
+        requested_at_[slot] = 0;
+      }
+    }
+
+    if (tokens & Mailbox::request_token)
+    {
+      // (R3) Receive Request for a Bottle:
+      //    upon receiving request for bottle b ->
+      //    reqb(b) := true;
+      reqb_.set(slot);
+      record(Trace::request_received, neighbor_ids_[slot]);
+    }
+
+    if (tokens & Mailbox::fork_token)
+    {
+      // (D3) Receive a Fork:
+      //    upon receiving fork f ->
+      //    fork(f) := true; dirty(f) := false
+      fork_.set(slot);
+      dirty_.reset(slot);
+      record(Trace::fork_received, neighbor_ids_[slot]);
+    }
+
+    if (tokens & Mailbox::fork_request_token)
+    {
+      // (D4) Receive Request for a Fork:
+      //    upon receiving request for fork f ->
+      //    reqf(f) := true
+      reqf_.set(slot);
+      record(Trace::fork_request_received, neighbor_ids_[slot]);
+    }
+
+    message = next;
+  }
+}
+
+// We can drink once there is no bottle we need but don't hold.
+// Must be called with the bottles_lock_ held.
+bool Philosopher::can_drink() const
+{
+  auto words = need_.word_count();
+  return GuardKernel::select(words).satisfied(need_.data(), bot_.data(), words);
 }
 
 // State machine functions
+void Philosopher::set_state(bottle_state state)
+{
+  state_ = state;
+  record(Trace::state_change, -1, state);
+
+  auto now = get_ticks();
+  if (state == thirsty)
+    thirsty_since_.store(now, std::memory_order_relaxed);
+  else if (state == drinking)
+  {
+    if (stats_)
+      stats_->thirsty_time.record(now - thirsty_since_.load(std::memory_order_relaxed));
+    thirsty_since_.store(0, std::memory_order_relaxed);
+  }
+
+  if (stats_)
+    stats_->steps.record(steps_);
+  steps_ = 0;
+}
+
 void Philosopher::on_tranquil()
 {
-  // See if it is time to become thirsty again
-  if (std::chrono::system_clock::now() < end_tranquil_)
+  // A hold waits for us to be tranquil
+  if (!deferred_.empty())
+  {
+    auto lock = lock_bottles();
+    make_deferred_changes();
+  }
+
+  // See if it is time to become thirsty again.  A hold keeps us here
+  // until it is over.
+  if (holding_ || get_time() < end_tranquil_)
     return;
 
   // Transition to being thirsty
-  state_ = thirsty;
+  set_state(thirsty);
 
   { // Scope for lock
-    std::unique_lock<std::mutex> lock(bottles_lock_);
+    auto lock = lock_bottles();
 
-    // To fully implement the specification, we would allow
-    // a variable subset of the bottles to be needed at any
-    // time.  For this simple test, just request all the
-    // bottles
+    // Without a demand model every bottle is needed.  Otherwise
+    // the model picks this episode's bottles and we get hungry so
+    // the forks can settle any conflict over them.
+    if (!demand_)
+      need_ = all_;
+    else
+    {
+      need_.reset_all();
+      demand_->get_demand(id_, episode_++, neighbor_ids_, need_);
+      hungry_ = true;
 
-    // Mark all bottles as needed in order to drink
-    for (auto& entry : bottles_)
-      entry.second.need = true;
+      // The model may pick a slot whose neighbor has left
+      for (std::size_t i = 0; i < need_.word_count(); i++)
+        need_.word(i) &= all_.word(i);
+    }
   }
 }
 
 void Philosopher::on_thirsty()
 {
-  std::vector<std::shared_ptr<INeighbor>> requests;
-
   { // Scope for lock
-    std::unique_lock<std::mutex> lock(bottles_lock_);
+    auto lock = lock_bottles();
 
-    // See if we need to send any requests
-    for (auto& bottle_entry : bottles_)
+    // (R1) Request a Bottle:
+    //   thirsty, need(b), reqb(b), ~bot(b) -> Send request for bottle B
+    //   reqb(b) := false
+    auto words = need_.word_count();
+    if (GuardKernel::select(words).request(need_.data(), reqb_.data(), bot_.data(), fire_.data(), words))
     {
-      auto id = bottle_entry.first;
-      auto& bottle = bottle_entry.second;
-
-      // (R1) Request a Bottle:
-      //   thirsty, need(b), reqb(b), ~bot(b) -> Send request for bottle B
-      //   reqb(b) := false
-      if (bottle.need && bottle.reqb && !bottle.bot)
+      // See who we need to send requests to
+      for (std::size_t i = 0; i < words; i++)
       {
-        auto neighbor = bottle.neighbor.lock();
-        if (!neighbor)
+        auto fire = fire_.word(i);
+        while (fire)
         {
-          // Neighbor has disappeared on us.  We should just remove this bottle.
-          // For now, mark it as not needed
-          bottle.need = false;
-          continue;
-        }
+          auto slot = i * Bitset::word_bits + Bitset::lowest_bit(fire);
+          fire &= fire - 1;
+
+          auto neighbor = arena_->get(neighbors_[slot]);
+          if (!neighbor)
+          {
+            // Neighbor has disappeared on us.  We should just remove this bottle.
+            // For now, mark it as not needed and keep the token
+            need_.reset(slot);
+            reqb_.set(slot);
+            continue;
+          }
 
-        requests.push_back(neighbor);
-        bottle.reqb = false;
+          record(Trace::request_sent, neighbor_ids_[slot]);
+          if (stats_)
+            requested_at_[slot] = get_ticks();
+          requests_.push_back(neighbor);
+        }
       }
     }
   }
 
   // Sending requests has to be done outside of the lock
   // to avoid deadlocks
-  for (auto neighbor : requests)
+  for (auto neighbor : requests_)
     neighbor->send_request(id_);
+  requests_.clear();
 
   { // Scope for lock
-    std::unique_lock<std::mutex> lock(bottles_lock_);
+    auto lock = lock_bottles();
 
     // If we find any bottles that we need but do not have, we
     // cannot move into a drinking state
-    for (auto& bottle_entry : bottles_)
-    {
-      auto& bottle = bottle_entry.second;
-      if (bottle.need && !bottle.bot)
-        return;
-    }
+    if (!can_drink())
+      return;
   }
 
   // We have all bottles.  Move to a drinking state
-  state_ = drinking;
+  set_state(drinking);
 
-  // If we wait after drinking, pick the time
-  if (wait_)
-  {
-    // Pick a random time to become tranquil again
-    auto range = std::chrono::duration_cast<std::chrono::milliseconds>(tranquil_range).count();
-    auto wait_millis = std::rand() % range;
-    end_tranquil_ = std::chrono::system_clock::now() + tranquil_min + std::chrono::milliseconds(wait_millis);
-  }
+  // Pick how long we drink for
+  if (drinking_)
+    end_drinking_ = get_time()
+      + std::chrono::duration_cast<std::chrono::steady_clock::duration>(drinking_->get_duration(random_));
 }
 
 void Philosopher::on_drinking()
 {
   // We are in the drinking state.  Lets drink for a set time and change our state
-  log_.log("Philosopher[", id_, "] is drinking.");
+  if (drinking_ && get_time() < end_drinking_)
+    return;
+
+  // A line per drink costs more than a simulated drink, and its wall
+  // clock stamp means nothing in virtual time
+  if (!simulated_)
+    log_.log("Philosopher[", id_, "] is drinking.");
+  record(Trace::drink);
 
   // Let the listener know we are taking a drink
   if (listener_)
     listener_->report_drink(id_);
 
   { // Scope for lock
-    std::unique_lock<std::mutex> lock(bottles_lock_);
+    auto lock = lock_bottles();
 
     // We no longer need any of the bottles as we have finished our drinking
     // Make sure to mark our forks as dirty as we don't get the priority
-    // until we are passed over again.
-    for (auto& entry : bottles_)
-    {
-      auto& bottle = entry.second;
-      bottle.need = false;
-      bottle.dirty = true;
-    }
+    // until we are passed over again.  Separate forks get dirty from
+    // eating instead.
+    need_.reset_all();
+    if (!demand_)
+      dirty_.set_all();
+
+    make_deferred_changes();
   }  // Scope for lock
 
+  // If we wait after drinking, pick the time
+  auto model = tranquil_ ? tranquil_ : (wait_ ? &Duration::get_default_wait() : nullptr);
+  if (model)
+    end_tranquil_ = get_time()
+      + std::chrono::duration_cast<std::chrono::steady_clock::duration>(model->get_duration(random_));
+
   // Done drinking.  Change states
-  state_ = tranquil;
+  set_state(tranquil);
 }
 
-// This function checks to see if we have any bottles to send to requesters
-void Philosopher::check_bottle_requests()
+// A switch instead of a table of std::function so the compiler can
+// see through to the handlers
+void Philosopher::dispatch()
 {
-  std::vector<std::shared_ptr<INeighbor>> requests;
+  switch (state_)
+  {
+  case tranquil:
+    on_tranquil();
+    break;
+  case thirsty:
+    on_thirsty();
+    break;
+  case drinking:
+    on_drinking();
+    break;
+  }
+}
+
+// Runs the diners solution on the forks.  Only used with a demand
+// model, where the bottles no longer double as the forks.  Returns
+// true if we gave up a fork we are hungry for, so we have to go
+// around again to ask for it back.
+bool Philosopher::check_forks()
+{
+  if (!demand_)
+    return false;
+
+  bool again = false;
 
   { // Scope for lock
-    std::unique_lock<std::mutex> lock(bottles_lock_);
+    auto lock = lock_bottles();
 
-    // See if we need to give any bottles
-    for (auto& bottle_entry : bottles_)
+    auto words = all_.word_count();
+    auto& kernel = GuardKernel::select(words);
+
+    if (hungry_)
     {
-      // (R2) Send a bottle:
-      //    reqb(b), bot(b), ~[need(b) and (drinking or fork(f))] ->
-      //    send bottle b;
-      //    bot(b) := false
-      auto id = bottle_entry.first;
-      auto& bottle = bottle_entry.second;
-      if (bottle.reqb && bottle.bot
-        && !(bottle.need && (state_ == drinking || !bottle.dirty)))
+      // (D1) Request a Fork:
+      //    hungry, reqf(f), ~fork(f) -> send request for fork f;
+      //    reqf(f) := false
+      if (kernel.request(all_.data(), reqf_.data(), fork_.data(), fire_.data(), words))
       {
-        // We need to send the bottle
-        auto neighbor = bottle.neighbor.lock();
-        if (!neighbor)
+        for (std::size_t i = 0; i < words; i++)
         {
-          // Neighbor has disappeared on us.  For now, mark it unneeded
-          bottle.need = false;
-          continue;
+          auto fire = fire_.word(i);
+          while (fire)
+          {
+            auto slot = i * Bitset::word_bits + Bitset::lowest_bit(fire);
+            fire &= fire - 1;
+
+            auto neighbor = arena_->get(neighbors_[slot]);
+            if (!neighbor)
+            {
+              // Neighbor has disappeared on us.  Act as if we have the fork.
+              fork_.set(slot);
+              continue;
+            }
+
+            record(Trace::fork_request_sent, neighbor_ids_[slot]);
+            requests_.push_back(neighbor);
+          }
         }
+      }
+
+      // A hungry philosopher holding every fork eats
+      if (kernel.satisfied(all_.data(), fork_.data(), words))
+      {
+        hungry_ = false;
+        eating_ = true;
+        record(Trace::eating, -1, 1);
+      }
+    }
 
-        requests.push_back(neighbor);
-        bottle.bot = false;
+    // Eating only lasts until we drink.  We may have had the bottles
+    // before the forks, in which case we are done already.
+    if (eating_ && state_ != thirsty)
+    {
+      eating_ = false;
+      dirty_.set_all();
+      record(Trace::eating, -1, 0);
+      make_deferred_changes();
+    }
 
-        // Always clean the fork before sending the bottle
-        bottle.dirty = false;
+    // (D2) Send a Fork:
+    //    reqf(f), fork(f), dirty(f), ~eating -> send fork f;
+    //    fork(f) := false; dirty(f) := false
+    // This is R2 with every fork needed and eating in place of drinking
+    for (std::size_t i = 0; i < words; i++)
+      held_.word(i) = dirty_.word(i);
+
+    if (kernel.send(reqf_.data(), fork_.data(), all_.data(), dirty_.data(),
+      eating_, fire_.data(), words))
+    {
+      for (std::size_t i = 0; i < words; i++)
+      {
+        auto fire = fire_.word(i);
+        while (fire)
+        {
+          auto slot = i * Bitset::word_bits + Bitset::lowest_bit(fire);
+          fire &= fire - 1;
+
+          auto neighbor = arena_->get(neighbors_[slot]);
+          if (!neighbor)
+          {
+            fork_.set(slot);
+            dirty_.set(slot, held_.test(slot));
+            continue;
+          }
+
+          record(Trace::fork_sent, neighbor_ids_[slot]);
+          forks_.push_back(neighbor);
+          again = again || hungry_;
+        }
+      }
+    }
+  }
+
+  // Send outside of the lock, same as the bottles
+  for (auto neighbor : requests_)
+    neighbor->send_fork_request(id_);
+  for (auto neighbor : forks_)
+    neighbor->send_fork(id_);
+  requests_.clear();
+  forks_.clear();
+  return again;
+}
+
+// This function checks to see if we have any bottles to send to requesters.
+// Returns true if we gave up a bottle we need, so we have to go around
+// again to ask for it back.
+bool Philosopher::check_bottle_requests()
+{
+  bool again = false;
+
+  { // Scope for lock
+    auto lock = lock_bottles();
+
+    // (R2) Send a bottle:
+    //    reqb(b), bot(b), ~[need(b) and (drinking or fork(f))] ->
+    //    send bottle b;
+    //    bot(b) := false
+    // Without a demand model the fork is the bottle's dirty flag and
+    // it is always cleaned before sending the bottle
+    auto words = reqb_.word_count();
+    auto& kernel = GuardKernel::select(words);
+
+    // The guard drops the fork with the bottle, so keep a copy to put
+    // back if the neighbor turns out to be gone
+    auto& forks = demand_ ? fork_ : dirty_;
+    for (std::size_t i = 0; i < words; i++)
+      held_.word(i) = forks.word(i);
+
+    auto fired = demand_
+      ? kernel.release(reqb_.data(), bot_.data(), need_.data(), fork_.data(),
+        state_ == drinking, fire_.data(), words)
+      : kernel.send(reqb_.data(), bot_.data(), need_.data(), dirty_.data(),
+        state_ == drinking, fire_.data(), words);
+    if (fired)
+    {
+      // See who we need to give bottles to
+      for (std::size_t i = 0; i < words; i++)
+      {
+        auto fire = fire_.word(i);
+        while (fire)
+        {
+          auto slot = i * Bitset::word_bits + Bitset::lowest_bit(fire);
+          fire &= fire - 1;
+
+          auto neighbor = arena_->get(neighbors_[slot]);
+          if (!neighbor)
+          {
+            // Neighbor has disappeared on us.  For now, mark it unneeded
+            // and hang on to the bottle and fork as they were.
+            need_.reset(slot);
+            bot_.set(slot);
+            forks.set(slot, held_.test(slot));
+            continue;
+          }
+
+          record(Trace::bottle_sent, neighbor_ids_[slot]);
+          requests_.push_back(neighbor);
+          again = again || need_.test(slot);
+        }
       }
     }
   }
@@ -312,11 +1008,113 @@ void Philosopher::check_bottle_requests()
   // All sending should be done when not holding the lock
   // to avoid deadlocks
   // Always send clean forks
-  for (auto& neighbor : requests)
+  for (auto neighbor : requests_)
     neighbor->send_bottle(id_, false);
+  requests_.clear();
+  return again;
 }
 
 
+// ITask interface
+void Philosopher::run()
+{
+  task_state_ = task_running;
+
+  auto more = step();
+
+  // If nobody woke us while we were running, we can go idle.  Otherwise
+  // get back in line behind everyone else.
+  auto expected = task_running;
+  if (!more && task_state_.compare_exchange_strong(expected, task_idle))
+    return;
+
+  task_state_ = task_queued;
+  scheduler_->post(this);
+}
+
+void Philosopher::wake()
+{
+  if (!scheduler_)
+  {
+    parker_.unpark();
+    return;
+  }
+
+  auto state = task_state_.load();
+  for (;;)
+  {
+    if (state == task_idle)
+    {
+      // We are the one to put the philosopher in the run queue
+      if (task_state_.compare_exchange_weak(state, task_queued))
+      {
+        scheduler_->post(this);
+        return;
+      }
+    }
+    else if (state == task_running)
+    {
+      // Let the running step know it has to go around again
+      if (task_state_.compare_exchange_weak(state, task_rerun))
+        return;
+    }
+    else
+    {
+      // Already queued or already flagged to run again
+      return;
+    }
+  }
+}
+
+// Runs the state machine until it settles.  Returns true if there
+// is still more work to do.
+bool Philosopher::step()
+{
+  if (!start_ || quit_)
+    return false;
+
+  // Our neighbors can't be freed while we are sending to them.  Under
+  // a simulator nothing else runs while we do, so nobody can free them.
+  Epoch::Guard guard((arena_ && !simulated_) ? &arena_->get_epoch() : nullptr, participant_);
+
+  // A full lap of tranquil -> thirsty -> drinking is the most we do
+  // before giving someone else a turn on the worker
+  for (int i = 0; i < 3; i++)
+  {
+    { // Scope for lock
+      auto lock = lock_bottles();
+      apply_changes();
+      receive();
+    }
+
+    auto old_state = state_;
+    steps_++;
+    dispatch();
+
+    // See if we need to give any forks or bottles to our neighbors.
+    // Giving up one we want means asking for it back on the next pass.
+    auto again = check_forks();
+    again = check_bottle_requests() || again;
+
+    if (state_ == old_state && !again)
+    {
+      // Nothing changed.  If we are tranquil or drinking, make sure we
+      // get woken when that is over.  Otherwise a neighbor will wake us
+      // when a bottle or request comes in.
+      auto end = (state_ == tranquil) ? end_tranquil_ : end_drinking_;
+      if (state_ != thirsty && timer_ != end)
+      {
+        timer_ = end;
+        scheduler_->post_at(this, end);
+      }
+
+      return false;
+    }
+  }
+
+  return true;
+}
+
 void Philosopher::work()
 {
   std::unique_lock<std::mutex> lock(start_lock_);
@@ -324,27 +1122,103 @@ void Philosopher::work()
   while (!start_ && !quit_)
     start_cv_.wait_for(lock, std::chrono::milliseconds(100));
 
-  log_.log("Philosopher[", id_, "] is starting.");
+  // Start out spinning for half the most we ever do
+  max_spin_ = static_cast<std::uint64_t>(static_cast<double>(max_spin.count()) * Tsc::ticks_per_ns());
+  handoff_ = max_spin_ / 4;
+  spin_limit_ = max_spin_ / 2;
 
-  std::map<bottle_state, std::function<void()>> state_map = {
-    { tranquil, std::bind(&Philosopher::on_tranquil, this) },
-    { thirsty, std::bind(&Philosopher::on_thirsty, this) },
-    { drinking, std::bind(&Philosopher::on_drinking, this) }
-  };
+  log_.log("Philosopher[", id_, "] is starting.");
 
   while (!quit_)
   {
     auto old_state = state_;
-    state_map[state_]();
+    auto again = false;
 
-    // See if we need to give any bottles to our neighbors
-    check_bottle_requests();
+    { // Scope for epoch.  We don't sleep in it.
+      Epoch::Guard guard(arena_ ? &arena_->get_epoch() : nullptr, participant_);
 
-    // Give other threads a chance to run
-    if (state_ == old_state)
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      { // Scope for lock
+        auto lock = lock_bottles();
+        apply_changes();
+        receive();
+      }
+
+      old_state = state_;
+      steps_++;
+      dispatch();
+
+      // See if we need to give any forks or bottles to our neighbors.
+      // Giving up one we want means asking for it back on the next pass.
+      again = check_forks();
+      again = check_bottle_requests() || again;
+    }
+
+    if (state_ == old_state && !again)
+      wait_for_work();
   }
 
   log_.log("Philosopher[", id_, "] is exiting.");
 }
 
+// Nothing changed on the last pass, so wait for a token, a change of
+// neighbors or the end of our own tranquil or drinking time.  Spinning
+// catches a bottle that is already on its way and parking keeps an idle
+// guest off the core.
+void Philosopher::wait_for_work()
+{
+  auto start = Tsc::now();
+
+  std::uint64_t waited;
+  while ((waited = Tsc::now() - start) < spin_limit_)
+  {
+    if (has_work())
+    {
+      learn_handoff(waited);
+      return;
+    }
+
+    Parker::pause();
+  }
+
+  for (int i = 0; i < max_yields; i++)
+  {
+    if (has_work())
+    {
+      learn_handoff(Tsc::now() - start);
+      return;
+    }
+
+    std::this_thread::yield();
+  }
+
+  auto deadline = Parker::time_point_t::max();
+  if (state_ == tranquil && !holding_)
+    deadline = end_tranquil_;
+  else if (state_ == drinking && drinking_)
+    deadline = end_drinking_;
+
+  parker_.prepare();
+  if (has_work() || get_time() >= deadline)
+    parker_.cancel();
+  else
+    parker_.park(deadline);
+
+  // Waking up for our own timer says nothing about hand-offs
+  if (has_work())
+    learn_handoff(Tsc::now() - start);
+}
+
+bool Philosopher::has_work() const
+{
+  return !mailbox_.empty() || changed_.load(std::memory_order_relaxed) || quit_;
+}
+
+// Keeps a running average of how long work takes to come and spins
+// for twice that, as long as that is short enough to be worth it.  One
+// long wait only counts for so much.
+void Philosopher::learn_handoff(std::uint64_t ticks)
+{
+  ticks = std::min(ticks, 4 * max_spin_);
+  handoff_ = handoff_ - handoff_ / 8 + ticks / 8;
+  spin_limit_ = (handoff_ <= max_spin_) ? std::min(2 * handoff_, max_spin_) : 0;
+}
@@ -9,76 +9,341 @@
 //  This is the main actor in the Drinking Philosopher
 //  solution.
 //
+//  Without a demand model every drink needs every bottle, which
+//  is the diners problem, and each bottle doubles as the fork
+//  between the pair.  With one, a drink can need any subset of
+//  the bottles and the pair also passes a separate fork.  The
+//  forks run the diners solution underneath to decide who gets
+//  a contested bottle, as in the paper.
+//
 
 #if !defined(__PHILOSOPHER_H__)
 #define __PHILOSOPHER_H__
 
+#include "Arena.h"
+#include "Bitset.h"
+#include "Histogram.h"
+#include "IDemandModel.h"
+#include "IDurationModel.h"
 #include "INeighbor.h"
 #include "IDrinkListener.h"
+#include "IScheduler.h"
 #include "Logger.h"
+#include "Mailbox.h"
+#include "NeighborArena.h"
+#include "Parker.h"
+#include "Trace.h"
 
 #include <atomic>
 #include <condition_variable>
-#include <map>
+#include <cstdint>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 class Philosopher
   : public std::enable_shared_from_this<Philosopher>
   , public INeighbor
+  , public ITask
 {
 public:
   enum bottle_state {tranquil, thirsty, drinking};
 
-  struct bottle_state_t
+  // Only used when we are run by a scheduler instead of our own thread
+  enum task_state {task_idle, task_queued, task_running, task_rerun};
+
+  // Filled in by the philosopher's own thread without locks and safe
+  // to read from anywhere.  Times are in Tsc ticks.
+  struct stats_t
+  {
+    Histogram thirsty_time;   // Thirsty until drinking
+    Histogram bottle_time;    // Sending a request (R1) until the bottle arrives (R4)
+    Histogram steps;          // Passes through the state machine per state change
+  };
+
+  // Where a neighbor sits in our arrays and the message it sends
+  // its tokens through
+  struct slot_t
+  {
+    int id;
+    std::uint32_t slot;
+    Mailbox::message_t * message;
+  };
+
+  // A neighbor joining or leaving, made on our own thread
+  struct change_t
+  {
+    int id;
+    NeighborArena::handle_t neighbor;
+    bool add;
+    bool bottle;
+    bool after_drink;         // Wait until we come after all our neighbors
+    bool hold;                // Wait until we are tranquil and stay that way
+    Parker * waiter;          // Unparked once the change is made
+    std::uint64_t number;     // Where it was posted, counting from one
+  };
+
+  // A slot whose neighbor left, free once the epoch has passed
+  struct retired_slot_t
   {
-    bool bot;   // Do we hold the bottle (and fork)
-    bool reqb;  // Do we hold the request token for the bottle
-    bool need;  // Do we need the bottle
-    bool dirty; // Is the fork clean
-    std::weak_ptr<INeighbor> neighbor;
+    std::uint32_t slot;
+    std::uint64_t epoch;
   };
 
-  typedef std::map<int, bottle_state_t> bottle_state_map_t;
+  static constexpr std::size_t no_slot = ~std::size_t(0);
+
+  // Our own thread spins at most this long for a token before it
+  // yields and then parks
+  static constexpr std::chrono::nanoseconds max_spin = std::chrono::microseconds(50);
+  static constexpr int max_yields = 8;
+
+  typedef std::vector<NeighborArena::handle_t, ArenaAllocator<NeighborArena::handle_t>> handle_vector_t;
+  typedef std::vector<slot_t, ArenaAllocator<slot_t>> slot_map_t;   // Sorted by id
+  typedef std::vector<INeighbor *> send_vector_t;
+
+  // Tokens a neighbor sends us are delivered through their slot's
+  // message.  A deque so the messages don't move while they sit in
+  // our mailbox.
+  typedef std::deque<Mailbox::message_t, ArenaAllocator<Mailbox::message_t>> inbox_t;
 
 public:
-  Philosopher(int id, Logger& log, IDrinkListener * listener = nullptr);
+  // Without a scheduler the philosopher runs on its own thread
+  Philosopher(int id, Logger& log, IDrinkListener * listener = nullptr, IScheduler * scheduler = nullptr);
   virtual ~Philosopher();
 
 public:
   inline void set_listener(IDrinkListener * listener) { listener_ = listener; };
   inline void set_wait(bool wait) { wait_ = wait; };
+
+  // The generator for the durations.  Seeded with zero unless told
+  // otherwise, and each philosopher gets its own stream of it.
+  inline void set_seed(std::uint64_t seed) { random_ = Random(seed, static_cast<std::uint64_t>(id_)); };
+
+  // How long to stay tranquil after a drink and how long a drink
+  // takes.  Without a tranquil model, wait picks 5 to 25 ms and no
+  // wait means none.  Without a drinking model drinks are instant.
+  // The models must outlive the philosopher.
+  inline void set_tranquil(const IDurationModel * tranquil) { tranquil_ = tranquil; };
+  inline void set_drinking(const IDurationModel * drinking) { drinking_ = drinking; };
+  inline void set_trace(Trace * trace) { trace_ = trace; };
+
+  // The Executor worker we are posted to.  Must be set before the
+  // philosopher starts.
+  inline void set_home(int home) { home_ = home; };
+
+  // Where our neighbors are found.  The participant is our slot in
+  // the arena's epoch and must not be shared with another guest.  Must
+  // be set before the philosopher starts and outlive it.
+  void set_arena(NeighborArena * arena, std::size_t participant);
+
+  // Pins our own thread to a cpu.  Returns false when a scheduler runs us.
+  bool pin(int cpu);
+
+  // Must be set before the philosopher starts and outlive it
+  inline void set_demand(IDemandModel * demand) { demand_ = demand; };
+
+  // Stats are off unless turned on before the philosopher starts
+  void enable_stats();
+  const stats_t * get_stats() const { return stats_.get(); };
+
+  // When we became thirsty in Tsc ticks, or zero if we aren't
+  std::uint64_t get_thirsty_since() const { return thirsty_since_; };
+
+  // Bottles we need but don't hold yet
+  std::size_t get_missing_bottles();
   void start();
   void quit();
 
+public:
+  // Bulk setup.  Sets up our end of a bottle without sending the
+  // neighbor anything, so the neighbor has to be given the other end
+  // the same way.  Only for before the table starts.  The handle is
+  // the neighbor's entry in our arena.  With an Arena, the bottle
+  // records are laid out in it, which only works before the first
+  // neighbor.
+  void reserve_neighbors(std::size_t count, std::shared_ptr<Arena> arena = nullptr);
+  void add_neighbor(int id, NeighborArena::handle_t neighbor, bool bottle);
+
+  // Live membership.  Senders look our slots up without a lock, so
+  // the change is queued for our own thread to make on its next step.
+  // Returns the number get_changes_made() reaches once it is made,
+  // and the waiter is unparked then.  Before we start it is made
+  // right away.  A neighbor that leaves has its slot reused once
+  // nobody can still be sending on it.  Needs an arena.
+  std::uint64_t connect(int id, NeighborArena::handle_t neighbor, bool bottle, Parker * waiter = nullptr);
+  std::uint64_t disconnect(int id, Parker * waiter = nullptr);
+
+  // For a neighbor that isn't drinking until it knows us.  Takes the
+  // bottle, dirty, once we hold every bottle, or every fork with a
+  // demand model, and all of them dirty.  Everyone comes before us
+  // then, so one more can't close a cycle in the precedence graph.
+  std::uint64_t connect_after_drink(int id, NeighborArena::handle_t neighbor, Parker * waiter = nullptr);
+
+  // Once we are tranquil and done eating, stays that way until our
+  // next change is made
+  std::uint64_t hold(Parker * waiter = nullptr);
+  std::uint64_t get_changes_made() const { return changes_made_.load(std::memory_order_acquire); };
+
+  // Everyone we sit next to.  Only safe before we start or once we
+  // have quit and gone idle.
+  std::vector<int> get_neighbor_ids() const;
+
+  // Nothing is queued or running for us on the scheduler
+  bool is_idle() const { return task_state_.load() == task_idle; };
+
 public:
   // INeighbor interface
   int get_id() override { return id_; };
+
+  // Introductions don't keep the neighbor alive.  It has to outlive
+  // us or be removed from the arena first.
   void introduce_neighbor(std::shared_ptr<INeighbor> neighbor) override;
   void send_bottle(int sender_id, bool dirty) override;
   void send_request(int sender_id) override;
+  void send_fork(int sender_id) override;
+  void send_fork_request(int sender_id) override;
   bool has_bottle(int id) override;
   bool has_request(int id) override;
 
+public:
+  // ITask interface
+  void run() override;
+  void wake() override;
+  int get_home() override { return home_; };
+
 private:
-  void check_bottle_requests();
+  const slot_t * find_slot(int id) const;
+  static const slot_t * find_slot(const slot_map_t& slots, int id);
+  std::size_t add_slot(int id, NeighborArena::handle_t neighbor);
+  std::size_t remove_slot(int id);
+  void reuse_slots();
+
+  std::uint64_t post_change(change_t change);
+  void apply_changes();
+  void make_changes(const std::vector<change_t>& changes);
+  void make_deferred_changes();
+
+  void receive();
+  bool can_drink() const;
+  bool check_forks();
+  bool check_bottle_requests();
+
+  inline void record(Trace::event_type event, int neighbor = -1, int value = 0)
+  {
+    if (trace_)
+      trace_->record(event, id_, neighbor, value);
+  }
+  void set_state(bottle_state state);
+
+  std::unique_lock<std::mutex> lock_bottles()
+  {
+    return simulated_ ? std::unique_lock<std::mutex>() : std::unique_lock<std::mutex>(bottles_lock_);
+  }
+
+  // The scheduler's clock, which a simulator keeps virtual
+  std::chrono::steady_clock::time_point get_time() const
+  {
+    return scheduler_ ? scheduler_->now() : std::chrono::steady_clock::now();
+  }
+  std::uint64_t get_ticks() const { return scheduler_ ? scheduler_->get_ticks() : Tsc::now(); };
+
+  void deliver(int sender_id, std::uint8_t tokens);
 
   void on_tranquil();
   void on_thirsty();
   void on_drinking();
+  void dispatch();
+  bool step();
   void work();
+  void wait_for_work();
+  bool has_work() const;
+  void learn_handoff(std::uint64_t ticks);
 
 private:
   int id_;
   bottle_state state_;
-  bottle_state_map_t bottles_;
+
+  // Our bottles are kept as a structure of arrays.  Each neighbor gets
+  // a slot when introduced and the same slot is used in every array.
+  // All but the ids can be laid out in the table's Arena.
+  std::vector<int> neighbor_ids_;   // -1 for a free slot
+  handle_vector_t neighbors_;
+  Bitset bot_;         // Do we hold the bottle (and fork without a demand model)
+  Bitset reqb_;        // Do we hold the request token for the bottle
+  Bitset need_;        // Do we need the bottle
+  Bitset dirty_;       // Is the fork dirty
+  Bitset fork_;        // Do we hold the fork (only used with a demand model)
+  Bitset reqf_;        // Do we hold the request token for the fork
+  Bitset all_;         // Every slot.  The diners need every fork.
+  Bitset fire_;        // Scratch for which guards fired
+  Bitset held_;        // Scratch for what a guard is about to clear
+
+  // Neighbor id to slot.  Senders read whichever map was last
+  // published.  Once we run, a change is made to a copy that replaces
+  // it, and the old one is retired through the arena's epoch.
+  std::shared_ptr<slot_map_t> slot_map_;
+  std::atomic<const slot_map_t *> slots_;
+  std::vector<retired_slot_t> retired_slots_;
+  std::vector<std::uint32_t> free_slots_;
+
+  // Changes waiting for our thread.  changed_ saves taking the lock
+  // when there are none.
+  std::mutex changes_lock_;
+  std::vector<change_t> changes_;
+  std::atomic<bool> changed_;
+  std::uint64_t changes_posted_;
+  std::atomic<std::uint64_t> changes_made_;
+
+  // Taken from changes_ by our thread.  Those that wait for us, and
+  // anything posted after them, are deferred.  A hold that is made
+  // keeps us tranquil until the next change.
+  std::uint64_t changes_taken_;
+  std::vector<change_t> deferred_;
+  bool holding_;
+
+  // Neighbors are only looked up inside the arena's epoch.  Without a
+  // table we keep an arena of our own for introductions.
+  NeighborArena * arena_;
+  std::unique_ptr<NeighborArena> own_arena_;
+  std::size_t participant_;
+
+  // Who to send to once the lock is dropped.  Kept so a step doesn't
+  // allocate.
+  send_vector_t requests_;
+  send_vector_t forks_;
+
+  inbox_t inbox_;
+
+  // Neighbors never take this.  It only keeps has_bottle() and
+  // has_request() from racing our own thread, so under a simulator,
+  // where there is only the one thread, it is skipped.
   std::mutex bottles_lock_;
+  Mailbox mailbox_;
 
   bool wait_;
-  std::chrono::system_clock::time_point end_tranquil_;
+  Random random_;
+  const IDurationModel * tranquil_;
+  const IDurationModel * drinking_;
+  std::chrono::steady_clock::time_point end_tranquil_;
+  std::chrono::steady_clock::time_point end_drinking_;
+  std::chrono::steady_clock::time_point timer_;   // When we last asked to be woken
 
   IDrinkListener * listener_;
+  Trace * trace_;
+
+  // The diners state only matters with a demand model.  Hunger
+  // lasts until we eat, even if we got to drink first.
+  IDemandModel * demand_;
+  std::uint64_t episode_;
+  bool hungry_;
+  bool eating_;
+
+  std::unique_ptr<stats_t> stats_;
+  std::atomic<std::uint64_t> thirsty_since_;
+  std::vector<std::uint64_t> requested_at_;   // By slot, only kept with stats
+  std::size_t steps_;
 
   // To ensure a fair start
   std::atomic<bool> start_;
@@ -87,8 +352,22 @@ private:
 
   Logger& log_;
   std::atomic<bool> quit_;
+
+  // Either we have a scheduler or we have a worker thread
+  IScheduler * scheduler_;
+  bool simulated_;
+  std::atomic<task_state> task_state_;
+  int home_;
   std::thread worker_;
 
+  // How our own thread waits.  It spins for about twice the hand-off
+  // it usually sees, or not at all when that is longer than spinning
+  // is worth.  In Tsc ticks.
+  Parker parker_;
+  std::uint64_t handoff_;
+  std::uint64_t spin_limit_;
+  std::uint64_t max_spin_;
+
 private:
   Philosopher(const Philosopher& rhs) = delete;
   Philosopher& operator =(const Philosopher& rhs) = delete;
@@ -0,0 +1,72 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Random.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Random declaration:
+//  This is xoshiro256**, a small and fast generator with 256 bits
+//  of state.  Every philosopher owns one, so nothing is shared
+//  between threads and the same seed gives the same numbers.
+//
+
+#if !defined(__RANDOM_H__)
+#define __RANDOM_H__
+
+#include <cstdint>
+
+class Random
+{
+public:
+  // Different streams with the same seed give unrelated numbers
+  explicit Random(std::uint64_t seed = 0, std::uint64_t stream = 0)
+  {
+    std::uint64_t state = seed ^ split_mix(stream);
+    for (auto& word : state_)
+      word = split_mix(state);
+  }
+
+public:
+  std::uint64_t next()
+  {
+    auto result = rotate(state_[1] * 5, 7) * 9;
+    auto t = state_[1] << 17;
+
+    state_[2] ^= state_[0];
+    state_[3] ^= state_[1];
+    state_[1] ^= state_[2];
+    state_[0] ^= state_[3];
+    state_[2] ^= t;
+    state_[3] = rotate(state_[3], 45);
+
+    return result;
+  }
+
+  // Uniform in [0, 1)
+  double next_double() { return static_cast<double>(next() >> 11) * (1.0 / 9007199254740992.0); };
+
+  // Uniform in (0, 1], for anything that takes a log
+  double next_positive() { return static_cast<double>((next() >> 11) + 1) * (1.0 / 9007199254740992.0); };
+
+  // Uniform in [0, bound).  The modulo bias is far too small to matter here.
+  std::uint64_t next_below(std::uint64_t bound) { return next() % bound; };
+
+  // SplitMix64.  Good for turning a seed into state and cheap enough
+  // to use on its own where a generator would be built for one number.
+  static std::uint64_t split_mix(std::uint64_t& state)
+  {
+    auto z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+private:
+  static std::uint64_t rotate(std::uint64_t x, int k) { return (x << k) | (x >> (64 - k)); };
+
+private:
+  std::uint64_t state_[4];
+};
+
+#endif // #if !defined(__RANDOM_H__)
@@ -0,0 +1,155 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// ShardTransport.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the ShardTransport class
+//
+
+#include "ShardTransport.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+constexpr std::uint8_t ShardTransport::dirty_flag;
+
+// Stands in for a guest in another shard.  Every token a local guest
+// sends it goes to the transport.
+class ShardTransport::RemoteNeighbor
+  : public INeighbor
+{
+public:
+  RemoteNeighbor(ShardTransport& transport, int id, std::size_t cut, bool upward, int shard)
+    : transport_(transport)
+    , id_(id)
+    , cut_(cut)
+    , upward_(upward)
+    , shard_(shard)
+  {
+  }
+
+public:
+  // INeighbor interface
+  int get_id() override { return id_; };
+
+  // Remote guests are seated from the edges, never introduced
+  void introduce_neighbor(std::shared_ptr<INeighbor>) override {};
+
+  // The sender is always the guest at our end of the edge
+  void send_bottle(int, bool dirty) override
+  {
+    transport_.send(cut_, upward_, shard_, static_cast<std::uint8_t>(Mailbox::bottle | (dirty ? dirty_flag : 0)));
+  }
+  void send_request(int) override { transport_.send(cut_, upward_, shard_, Mailbox::request); };
+  void send_fork(int) override { transport_.send(cut_, upward_, shard_, Mailbox::fork); };
+  void send_fork_request(int) override { transport_.send(cut_, upward_, shard_, Mailbox::fork_request); };
+
+  // We can't see into the other process
+  bool has_bottle(int) override { return false; };
+  bool has_request(int) override { return false; };
+
+private:
+  ShardTransport& transport_;
+  int id_;
+  std::size_t cut_;
+  bool upward_;
+  int shard_;
+
+private:
+  RemoteNeighbor(const RemoteNeighbor& rhs) = delete;
+  RemoteNeighbor& operator =(const RemoteNeighbor& rhs) = delete;
+};
+
+ShardTransport::ShardTransport(int guest_count, const edge_vector_t& edges, int shard, int shard_count)
+  : shard_(shard)
+  , shard_count_(shard_count)
+  , guest_count_(guest_count)
+  , first_(0)
+  , end_(0)
+  , cuts_()
+  , neighbors_()
+  , locals_()
+  , received_(0)
+{
+  if (shard < 0 || shard >= shard_count || guest_count <= 0)
+    return;
+
+  first_ = get_first_guest(shard, shard_count, guest_count);
+  end_ = get_first_guest(shard + 1, shard_count, guest_count);
+  locals_.resize(static_cast<std::size_t>(end_ - first_));
+
+  // Every shard numbers the cut edges the same way, in the order of
+  // the edge list with the duplicates left out
+  std::unordered_set<std::uint64_t> seen;
+  for (auto& edge : edges)
+  {
+    auto low = std::min(edge.first, edge.second);
+    auto high = std::max(edge.first, edge.second);
+    if (low < 0 || low == high || high >= guest_count)
+      continue;
+
+    auto low_shard = get_shard(low, shard_count, guest_count);
+    auto high_shard = get_shard(high, shard_count, guest_count);
+    if (low_shard == high_shard || !seen.insert(get_key(low, high)).second)
+      continue;
+
+    auto cut = cuts_.size();
+    cuts_.push_back({ low, high });
+
+    // We only need to find our own edges again
+    if (low_shard == shard)
+      neighbors_[get_key(low, high)] = std::make_shared<RemoteNeighbor>(*this, high, cut, true, high_shard);
+    else if (high_shard == shard)
+      neighbors_[get_key(high, low)] = std::make_shared<RemoteNeighbor>(*this, low, cut, false, low_shard);
+  }
+}
+
+int ShardTransport::get_first_guest(int shard, int shard_count, int guest_count)
+{
+  return static_cast<int>(static_cast<long long>(guest_count) * shard / shard_count);
+}
+
+int ShardTransport::get_shard(int id, int shard_count, int guest_count)
+{
+  // The last shard whose first guest is at or below id
+  return static_cast<int>((static_cast<long long>(id + 1) * shard_count - 1) / guest_count);
+}
+
+// ITransport interface
+std::shared_ptr<INeighbor> ShardTransport::get_neighbor(int local_id, int remote_id)
+{
+  auto entry = neighbors_.find(get_key(local_id, remote_id));
+  if (entry == neighbors_.end())
+    return nullptr;
+
+  return entry->second;
+}
+
+void ShardTransport::attach(int id, std::weak_ptr<INeighbor> guest)
+{
+  if (is_local(id))
+    locals_[static_cast<std::size_t>(id - first_)] = std::move(guest);
+}
+
+void ShardTransport::deliver(INeighbor& guest, int remote_id, std::uint8_t token)
+{
+  switch (token & ~dirty_flag)
+  {
+  case Mailbox::bottle:
+    guest.send_bottle(remote_id, (token & dirty_flag) != 0);
+    break;
+  case Mailbox::request:
+    guest.send_request(remote_id);
+    break;
+  case Mailbox::fork:
+    guest.send_fork(remote_id);
+    break;
+  case Mailbox::fork_request:
+    guest.send_fork_request(remote_id);
+    break;
+  }
+
+  received_.store(received_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
@@ -0,0 +1,114 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// ShardTransport.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// ShardTransport declaration:
+//  This is the part of a transport that doesn't care how the
+//  tokens travel.  The guests are split into shards of consecutive
+//  ids, one per process.  Every edge between two shards (a cut
+//  edge) is numbered the same way in every process, so a token
+//  only has to say which edge it came along and what it is.
+//
+//  Every local guest with a neighbor in another shard gets a
+//  stand-in for it that hands whatever the guest sends it to
+//  send().  What arrives goes to deliver().
+//
+//  Every process must build the transport from the same edges.
+//
+
+#if !defined(__SHARDTRANSPORT_H__)
+#define __SHARDTRANSPORT_H__
+
+#include "Edge.h"
+#include "ITransport.h"
+#include "Mailbox.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class ShardTransport
+  : public ITransport
+{
+public:
+  typedef ::edge_t edge_t;
+  typedef ::edge_vector_t edge_vector_t;
+
+  // A token is the Mailbox type with the dirty flag on top
+  static constexpr std::uint8_t dirty_flag = 0x80;
+
+  struct cut_t
+  {
+    int low;
+    int high;
+  };
+
+public:
+  ShardTransport(int guest_count, const edge_vector_t& edges, int shard, int shard_count);
+  virtual ~ShardTransport() = default;
+
+public:
+  virtual bool is_open() const = 0;
+
+  std::size_t get_cut_count() const { return cuts_.size(); };
+  std::uint64_t get_received_count() const { return received_.load(std::memory_order_relaxed); };
+
+  // Shard s seats the guests from get_first_guest(s) up to get_first_guest(s + 1)
+  static int get_first_guest(int shard, int shard_count, int guest_count);
+  static int get_shard(int id, int shard_count, int guest_count);
+
+public:
+  // ITransport interface
+  int get_first_guest() override { return first_; };
+  int get_guest_count() override { return end_ - first_; };
+  std::shared_ptr<INeighbor> get_neighbor(int local_id, int remote_id) override;
+  void attach(int id, std::weak_ptr<INeighbor> guest) override;
+
+protected:
+  // Runs on the thread of the guest at our end of the cut edge.
+  // upward is whether the token goes from the low id to the high one.
+  virtual void send(std::size_t cut, bool upward, int receiver_shard, std::uint8_t token) = 0;
+
+  bool is_local(int id) const { return id >= first_ && id < end_; };
+  const cut_t& get_cut(std::size_t cut) const { return cuts_[cut]; };
+  std::shared_ptr<INeighbor> get_local(int id) const { return locals_[static_cast<std::size_t>(id - first_)].lock(); };
+
+  // Hands a token from remote_id to our guest.  Only one thread may
+  // deliver at a time.
+  void deliver(INeighbor& guest, int remote_id, std::uint8_t token);
+
+protected:
+  int shard_;
+  int shard_count_;
+  int guest_count_;
+
+private:
+  class RemoteNeighbor;
+
+  static std::uint64_t get_key(int first, int second)
+  {
+    return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(first)) << 32) | static_cast<std::uint32_t>(second);
+  };
+
+private:
+  int first_;
+  int end_;
+
+  std::vector<cut_t> cuts_;
+  std::unordered_map<std::uint64_t, std::shared_ptr<RemoteNeighbor>> neighbors_;   // get_key(local, remote)
+  std::vector<std::weak_ptr<INeighbor>> locals_;   // By id - first_
+
+  std::atomic<std::uint64_t> received_;
+
+private:
+  ShardTransport(const ShardTransport& rhs) = delete;
+  ShardTransport& operator =(const ShardTransport& rhs) = delete;
+};
+
+#endif // #if !defined(__SHARDTRANSPORT_H__)
@@ -0,0 +1,339 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// ShmTransport.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the ShmTransport class
+//  Everything in the segment starts out as zero, which is an empty
+//  ring, nothing pending and nobody asleep, so only the header has
+//  to be filled in by whoever creates it.
+//
+
+#include "ShmTransport.h"
+#include "Bitset.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <new>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
+constexpr std::uint32_t ShmTransport::ring_capacity;
+constexpr char ShmTransport::segment_magic[8];
+constexpr std::uint32_t ShmTransport::segment_version;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+  "Atomics in shared memory must be lock free");
+
+// The futex words are shared between processes, so these are not
+// the private futex calls.  Anywhere else waiting falls back to a
+// short sleep.
+static void wait_on(std::atomic<std::uint32_t>& word, std::uint32_t value, std::chrono::milliseconds timeout)
+{
+#if defined(__linux__)
+  timespec time;
+  time.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+  time.tv_nsec = static_cast<long>(timeout.count() % 1000) * 1000000;
+  ::syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&word), FUTEX_WAIT, value, &time, nullptr, 0);
+#else
+  if (word.load() == value)
+    std::this_thread::sleep_for(std::min(timeout, std::chrono::milliseconds(1)));
+#endif
+}
+
+static void wake_all(std::atomic<std::uint32_t>& word)
+{
+#if defined(__linux__)
+  ::syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+  (void)word;
+#endif
+}
+
+static std::size_t round_up(std::size_t size, std::size_t alignment)
+{
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+ShmTransport::ShmTransport(const std::string& name, int guest_count, const edge_vector_t& edges, int shard, int shard_count,
+  std::chrono::milliseconds timeout)
+  : ShardTransport(guest_count, edges, shard, shard_count)
+  , name_(name)
+  , mapping_(nullptr)
+  , mapping_size_(0)
+  , file_(-1)
+  , header_(nullptr)
+  , doorbells_(nullptr)
+  , pending_(nullptr)
+  , pending_words_(0)
+  , rings_(nullptr)
+  , barriers_(0)
+  , quit_(false)
+  , worker_()
+{
+  if (shard < 0 || shard >= shard_count || guest_count <= 0)
+    return;
+
+  pending_words_ = (get_cut_count() + 63) / 64;
+
+  auto doorbells_offset = round_up(sizeof(header_t), 64);
+  auto pending_offset = doorbells_offset + static_cast<std::size_t>(shard_count) * sizeof(doorbell_t);
+  auto rings_offset = round_up(pending_offset + static_cast<std::size_t>(shard_count) * pending_words_ * sizeof(std::uint64_t), 64);
+  mapping_size_ = rings_offset + 2 * get_cut_count() * sizeof(ring_t);
+
+#if !defined(_WIN32)
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+
+  // Whoever gets to create it fills in the header
+  bool creator = true;
+  file_ = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (file_ < 0)
+  {
+    creator = false;
+    while ((file_ = ::shm_open(name.c_str(), O_RDWR, 0600)) < 0 && std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    if (file_ < 0)
+      return;
+  }
+
+  if (creator)
+  {
+    if (::ftruncate(file_, static_cast<off_t>(mapping_size_)) != 0)
+      return;
+  }
+  else
+  {
+    // Touching the mapping past the end of the file is a bus error
+    struct stat status = {};
+    while ((::fstat(file_, &status) != 0 || static_cast<std::size_t>(status.st_size) < mapping_size_)
+      && std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    if (static_cast<std::size_t>(status.st_size) != mapping_size_)
+      return;
+  }
+
+  auto mapping = ::mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED, file_, 0);
+  if (mapping == MAP_FAILED)
+    return;
+
+  mapping_ = mapping;
+  auto base = static_cast<char *>(mapping_);
+
+  header_t * header;
+  if (creator)
+  {
+    header = new (mapping_) header_t;
+    std::memcpy(header->magic, segment_magic, sizeof(segment_magic));
+    header->version = segment_version;
+    header->shard_count = static_cast<std::uint32_t>(shard_count);
+    header->guest_count = static_cast<std::uint64_t>(guest_count);
+    header->cut_count = get_cut_count();
+    header->size = mapping_size_;
+    header->arrived = 0;
+    header->ready.store(1, std::memory_order_release);
+  }
+  else
+  {
+    header = reinterpret_cast<header_t *>(mapping_);
+    while (!header->ready.load(std::memory_order_acquire) && std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    // Somebody built it from a different table
+    if (!header->ready.load(std::memory_order_acquire)
+      || std::memcmp(header->magic, segment_magic, sizeof(segment_magic)) != 0
+      || header->version != segment_version
+      || header->shard_count != static_cast<std::uint32_t>(shard_count)
+      || header->guest_count != static_cast<std::uint64_t>(guest_count)
+      || header->cut_count != get_cut_count()
+      || header->size != mapping_size_)
+      return;
+  }
+
+  doorbells_ = reinterpret_cast<doorbell_t *>(base + doorbells_offset);
+  pending_ = reinterpret_cast<std::atomic<std::uint64_t> *>(base + pending_offset);
+  rings_ = reinterpret_cast<ring_t *>(base + rings_offset);
+  header_ = header;
+#else
+  (void)timeout;
+#endif
+}
+
+ShmTransport::~ShmTransport()
+{
+  stop();
+
+#if !defined(_WIN32)
+  if (mapping_)
+    ::munmap(mapping_, mapping_size_);
+  if (file_ >= 0)
+    ::close(file_);
+
+  // Everyone has it mapped by now, so the name can go
+  if (header_ && shard_ == 0)
+    remove(name_);
+#endif
+}
+
+void ShmTransport::remove(const std::string& name)
+{
+#if !defined(_WIN32)
+  ::shm_unlink(name.c_str());
+#else
+  (void)name;
+#endif
+}
+
+// ITransport interface
+void ShmTransport::start()
+{
+  if (!header_ || worker_.joinable())
+    return;
+
+  quit_ = false;
+  worker_ = std::thread(&ShmTransport::work, this);
+}
+
+void ShmTransport::stop()
+{
+  if (!worker_.joinable())
+    return;
+
+  quit_ = true;
+  doorbells_[shard_].sleeping.store(0);
+  wake_all(doorbells_[shard_].sleeping);
+  worker_.join();
+}
+
+bool ShmTransport::barrier(std::chrono::milliseconds timeout)
+{
+  if (!header_)
+    return false;
+
+  auto target = ++barriers_ * static_cast<std::uint32_t>(shard_count_);
+  header_->arrived.fetch_add(1);
+  wake_all(header_->arrived);
+
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  for (;;)
+  {
+    auto arrived = header_->arrived.load();
+    if (arrived >= target)
+      return true;
+
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline)
+      return false;
+
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now) + std::chrono::milliseconds(1);
+    wait_on(header_->arrived, arrived, std::min(left, std::chrono::milliseconds(100)));
+  }
+}
+
+// Runs on the thread of the guest at our end of the edge, which is
+// the only one that ever sends on this ring
+void ShmTransport::send(std::size_t cut, bool upward, int receiver_shard, std::uint8_t token)
+{
+  auto& ring = rings_[2 * cut + (upward ? 0 : 1)];
+  auto head = ring.head.load(std::memory_order_relaxed);
+
+  // Can't happen while every token is only in one place
+  while (head - ring.tail.load(std::memory_order_acquire) >= ring_capacity)
+    std::this_thread::yield();
+
+  ring.slots[head % ring_capacity] = token;
+  ring.head.store(head + 1, std::memory_order_release);
+
+  // If the bit was already set the receiver hasn't looked yet and
+  // whoever set it made sure it will
+  auto& word = pending_[static_cast<std::size_t>(receiver_shard) * pending_words_ + cut / 64];
+  auto bit = std::uint64_t(1) << (cut % 64);
+  if (word.fetch_or(bit) & bit)
+    return;
+
+  auto& doorbell = doorbells_[receiver_shard];
+  if (doorbell.sleeping.exchange(0))
+    wake_all(doorbell.sleeping);
+}
+
+// Hands everything in our flagged rings to our guests.  Returns
+// whether there was anything.
+bool ShmTransport::drain()
+{
+  bool any = false;
+  auto pending = pending_ + static_cast<std::size_t>(shard_) * pending_words_;
+
+  for (std::size_t w = 0; w < pending_words_; w++)
+  {
+    if (!pending[w].load(std::memory_order_relaxed))
+      continue;
+
+    auto bits = pending[w].exchange(0);
+    while (bits)
+    {
+      auto b = static_cast<std::size_t>(Bitset::lowest_bit(bits));
+      bits &= bits - 1;
+
+      // Tokens toward the high end wait in the first ring
+      auto cut = w * 64 + b;
+      auto& edge = get_cut(cut);
+      bool upward = is_local(edge.high);
+      auto& ring = rings_[2 * cut + (upward ? 0 : 1)];
+
+      auto guest = get_local(upward ? edge.high : edge.low);
+      auto head = ring.head.load(std::memory_order_acquire);
+      auto tail = ring.tail.load(std::memory_order_relaxed);
+      for (; tail != head; tail++)
+        if (guest)
+          deliver(*guest, upward ? edge.low : edge.high, ring.slots[tail % ring_capacity]);
+
+      ring.tail.store(tail, std::memory_order_release);
+      any = true;
+    }
+  }
+
+  return any;
+}
+
+bool ShmTransport::has_pending() const
+{
+  auto pending = pending_ + static_cast<std::size_t>(shard_) * pending_words_;
+  for (std::size_t w = 0; w < pending_words_; w++)
+    if (pending[w].load())
+      return true;
+
+  return false;
+}
+
+void ShmTransport::work()
+{
+  auto& doorbell = doorbells_[shard_];
+
+  while (!quit_)
+  {
+    if (drain())
+      continue;
+
+    // Say we are going to sleep before the last look, so a sender
+    // either sees us asleep or we see its bit
+    doorbell.sleeping.store(1);
+    if (!has_pending() && !quit_)
+      wait_on(doorbell.sleeping, 1, std::chrono::milliseconds(100));
+    doorbell.sleeping.store(0, std::memory_order_relaxed);
+  }
+}
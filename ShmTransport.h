@@ -0,0 +1,129 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// ShmTransport.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// ShmTransport declaration:
+//  This carries tokens between processes on the same host through
+//  a named shared memory segment.  Every edge between two shards
+//  gets a ring in each direction with a single sender
+//  (the guest at that end) and a single receiver (the transport
+//  thread of the other shard), so a send is a store and a release.
+//
+//  A token only ever sits in one place, so a ring never holds more
+//  than one of each kind and four slots are always enough.
+//
+//  The sender also sets the edge's bit in the receiving shard's
+//  pending bitmap, so the receiver only looks at rings that have
+//  something in them.  A receiver with nothing to do sleeps on a
+//  futex in the segment and the sender that finds it asleep wakes
+//  it.  Only the first sender to set a bit has to look.
+//
+//  The first process to open the segment creates it and the rest
+//  wait for it to be ready.  Only for Linux and other POSIX systems.
+//
+
+#if !defined(__SHMTRANSPORT_H__)
+#define __SHMTRANSPORT_H__
+
+#include "ShardTransport.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+class ShmTransport
+  : public ShardTransport
+{
+public:
+  // One byte per token
+  static constexpr std::uint32_t ring_capacity = 4;
+
+  struct ring_t
+  {
+    std::atomic<std::uint32_t> head;   // Only the sender writes this
+    std::atomic<std::uint32_t> tail;   // Only the receiver writes this
+    std::uint8_t slots[ring_capacity];
+    std::uint8_t padding[4];
+  };
+
+  // The segment starts with this, then a doorbell per shard, then a
+  // pending bitmap per shard and then two rings per cut edge, the
+  // low to high one first
+  struct header_t
+  {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t shard_count;
+    std::uint64_t guest_count;
+    std::uint64_t cut_count;
+    std::uint64_t size;
+    std::atomic<std::uint32_t> ready;     // Set once the rest is filled in
+    std::atomic<std::uint32_t> arrived;   // Barrier calls so far from all shards
+  };
+
+  struct doorbell_t
+  {
+    std::atomic<std::uint32_t> sleeping;   // The futex word
+    char padding[64 - sizeof(std::atomic<std::uint32_t>)];
+  };
+
+  static constexpr char segment_magic[8] = { 'P', 'H', 'I', 'L', 'S', 'H', 'M', '1' };
+  static constexpr std::uint32_t segment_version = 1;
+
+public:
+  // Opens or creates the segment called name, which needs a leading
+  // slash.  Gives up if another process created it and it isn't
+  // ready within the timeout.
+  ShmTransport(const std::string& name, int guest_count, const edge_vector_t& edges, int shard, int shard_count,
+    std::chrono::milliseconds timeout = std::chrono::milliseconds(10000));
+  virtual ~ShmTransport();
+
+public:
+  bool is_open() const override { return header_ != nullptr; };
+
+  // Only the shard that created the segment needs this, but a
+  // launcher can call it to clean up after a crash
+  static void remove(const std::string& name);
+
+public:
+  // ITransport interface
+  void start() override;
+  void stop() override;
+  bool barrier(std::chrono::milliseconds timeout) override;
+
+protected:
+  // ShardTransport
+  void send(std::size_t cut, bool upward, int receiver_shard, std::uint8_t token) override;
+
+private:
+  bool drain();
+  bool has_pending() const;
+  void work();
+
+private:
+  std::string name_;
+
+  void * mapping_;
+  std::size_t mapping_size_;
+  int file_;
+
+  header_t * header_;
+  doorbell_t * doorbells_;   // By shard
+  std::atomic<std::uint64_t> * pending_;   // pending_words_ words per shard
+  std::size_t pending_words_;
+  ring_t * rings_;
+
+  std::uint32_t barriers_;
+  std::atomic<bool> quit_;
+  std::thread worker_;
+
+private:
+  ShmTransport(const ShmTransport& rhs) = delete;
+  ShmTransport& operator =(const ShmTransport& rhs) = delete;
+};
+
+#endif // #if !defined(__SHMTRANSPORT_H__)
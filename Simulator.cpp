@@ -0,0 +1,184 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Simulator.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the Simulator class
+//  Virtual time starts at the clock's epoch so every run sees
+//  the same times no matter when it was started.
+//
+
+#include "Simulator.h"
+#include "Tsc.h"
+
+#include <algorithm>
+
+Simulator::Simulator(std::uint64_t seed, std::chrono::nanoseconds run_time)
+  : time_(0)
+  , sequence_(0)
+  , events_()
+  , slots_()
+  , free_slots_()
+  , ready_()
+  , delay_(nullptr)
+  , random_(seed)
+  , run_time_(static_cast<std::uint64_t>(run_time.count()))
+  , ticks_per_ns_(Tsc::ticks_per_ns())
+  , event_count_(0)
+  , message_count_(0)
+{
+}
+
+bool Simulator::run(const std::function<bool()>& done, std::chrono::nanoseconds limit)
+{
+  auto end = static_cast<std::uint64_t>(limit.count());
+
+  while (!done())
+  {
+    // Take whichever of the two queues has the earliest event.  Copy
+    // it out before running it, the task can post more.
+    event_t event;
+    if (!ready_.empty() && (events_.empty() || ready_.front().when < events_.front().when
+      || (ready_.front().when == events_.front().when && ready_.front().sequence < slots_[events_.front().slot].sequence)))
+    {
+      event = ready_.front();
+      ready_.pop_front();
+    }
+    else if (!events_.empty())
+      pop(event);
+    else
+      return false;
+
+    if (event.when > end)
+      return false;
+
+    // Events come out in time order, so this never moves the clock
+    // back past anything a task has seen
+    time_.store(event.when + run_time_, std::memory_order_relaxed);
+    event_count_++;
+
+    if (event.message)
+    {
+      event.mailbox->post(event.message, event.tokens);
+      event.task->wake();
+    }
+    else
+      event.task->run();
+  }
+
+  return true;
+}
+
+void Simulator::push(std::uint64_t when, ITask * task, Mailbox * mailbox, Mailbox::message_t * message, std::uint8_t tokens)
+{
+  std::uint32_t slot;
+  if (free_slots_.empty())
+  {
+    slot = static_cast<std::uint32_t>(slots_.size());
+    slots_.push_back({ when, sequence_++, task, mailbox, message, tokens });
+  }
+  else
+  {
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+    slots_[slot] = { when, sequence_++, task, mailbox, message, tokens };
+  }
+
+  // Sift the new entry up past every later parent
+  entry_t entry = { when, slot };
+  auto index = events_.size();
+  events_.push_back(entry);
+  while (index > 0)
+  {
+    auto parent = (index - 1) / 4;
+    if (!is_before(entry, events_[parent]))
+      break;
+
+    events_[index] = events_[parent];
+    index = parent;
+  }
+
+  events_[index] = entry;
+}
+
+void Simulator::pop(event_t& event)
+{
+  auto slot = events_.front().slot;
+  event = slots_[slot];
+  free_slots_.push_back(slot);
+
+  // Sift the last entry down from the top past every earlier child
+  entry_t entry = events_.back();
+  events_.pop_back();
+  auto size = events_.size();
+  if (!size)
+    return;
+
+  std::size_t index = 0;
+  for (;;)
+  {
+    auto first = index * 4 + 1;
+    if (first >= size)
+      break;
+
+    auto last = std::min(first + 4, size);
+    auto best = first;
+    for (auto child = first + 1; child < last; child++)
+      if (is_before(events_[child], events_[best]))
+        best = child;
+
+    if (!is_before(events_[best], entry))
+      break;
+
+    events_[index] = events_[best];
+    index = best;
+  }
+
+  events_[index] = entry;
+}
+
+// IScheduler interface
+void Simulator::post(ITask * task)
+{
+  ready_.push_back({ time_.load(std::memory_order_relaxed), sequence_++, task, nullptr, nullptr, 0 });
+}
+
+void Simulator::post_at(ITask * task, time_point_t when)
+{
+  // A time in the past means right away
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+  auto now = time_.load(std::memory_order_relaxed);
+  push((ns > 0 && static_cast<std::uint64_t>(ns) > now) ? static_cast<std::uint64_t>(ns) : now, task, nullptr, nullptr, 0);
+}
+
+void Simulator::deliver(ITask * task, Mailbox * mailbox, Mailbox::message_t * message, std::uint8_t tokens)
+{
+  message_count_++;
+
+  std::uint64_t delay = 0;
+  if (delay_)
+    delay = static_cast<std::uint64_t>(delay_->get_duration(random_).count());
+
+  // Skip the queue when there is nothing to wait for
+  if (!delay)
+  {
+    mailbox->post(message, tokens);
+    task->wake();
+    return;
+  }
+
+  push(time_.load(std::memory_order_relaxed) + delay, task, mailbox, message, tokens);
+}
+
+IScheduler::time_point_t Simulator::now()
+{
+  return time_point_t(std::chrono::duration_cast<time_point_t::duration>(
+    std::chrono::nanoseconds(time_.load(std::memory_order_relaxed))));
+}
+
+std::uint64_t Simulator::get_ticks()
+{
+  return static_cast<std::uint64_t>(static_cast<double>(time_.load(std::memory_order_relaxed)) * ticks_per_ns_);
+}
@@ -0,0 +1,129 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Simulator.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Simulator declaration:
+//  This is a discrete event scheduler.  Tasks and messages wait
+//  in one priority queue ordered by virtual time and are run on
+//  the calling thread, so the clock jumps straight to the next
+//  thing that happens instead of sleeping.  Ties go to whatever
+//  was posted first, which makes a run with the same seed play
+//  out exactly the same way every time.
+//
+//  Every event takes a little virtual time and whatever it posts
+//  or sends happens at the end of it.  Otherwise a guest with
+//  instant drinks could keep drinking without the clock ever
+//  moving far enough for a request to reach it.  It also means
+//  anything posted to run right away comes after everything
+//  posted before it, so those skip the heap and wait in a FIFO.
+//
+//  An event costs a microsecond or more of wall time with 100k
+//  or more guests, mostly in cache misses on the guest it runs,
+//  so the clock only gets ahead of real time when the guests
+//  make fewer than about a million events per virtual second.
+//
+
+#if !defined(__SIMULATOR_H__)
+#define __SIMULATOR_H__
+
+#include "IDurationModel.h"
+#include "IScheduler.h"
+#include "Random.h"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <vector>
+
+class Simulator
+  : public IScheduler
+{
+public:
+  struct event_t
+  {
+    std::uint64_t when;       // Virtual nanoseconds since the start
+    std::uint64_t sequence;   // Order of posting, to break ties
+    ITask * task;
+
+    // Only set when the event delivers a message
+    Mailbox * mailbox;
+    Mailbox::message_t * message;
+    std::uint8_t tokens;
+  };
+
+  // What the heap actually sorts
+  struct entry_t
+  {
+    std::uint64_t when;
+    std::uint32_t slot;       // Where the rest of the event is
+  };
+
+  typedef std::vector<entry_t> heap_t;
+  typedef std::vector<event_t> slot_vector_t;
+  typedef std::deque<event_t> ready_queue_t;
+
+public:
+  // The seed is only used for the message delays
+  Simulator(std::uint64_t seed = 0, std::chrono::nanoseconds run_time = std::chrono::nanoseconds(100));
+  virtual ~Simulator() = default;
+
+public:
+  // How long a message takes to arrive.  Without a model messages
+  // arrive right away.  The model must outlive the simulator.
+  void set_delay(const IDurationModel * delay) { delay_ = delay; };
+
+  // Runs events until done returns true, nothing is left to run or
+  // the virtual clock passes limit.  Returns whether done was reached.
+  bool run(const std::function<bool()>& done, std::chrono::nanoseconds limit);
+
+  std::chrono::nanoseconds get_elapsed() const { return std::chrono::nanoseconds(time_.load(std::memory_order_relaxed)); };
+  std::uint64_t get_event_count() const { return event_count_; };
+  std::uint64_t get_message_count() const { return message_count_; };
+
+public:
+  // IScheduler interface
+  void post(ITask * task) override;
+  void post_at(ITask * task, time_point_t when) override;
+  void deliver(ITask * task, Mailbox * mailbox, Mailbox::message_t * message, std::uint8_t tokens) override;
+  time_point_t now() override;
+  std::uint64_t get_ticks() override;
+  bool is_virtual() override { return true; };
+
+private:
+  void push(std::uint64_t when, ITask * task, Mailbox * mailbox, Mailbox::message_t * message, std::uint8_t tokens);
+  void pop(event_t& event);
+
+  // Earlier first, then whatever was posted first
+  bool is_before(const entry_t& lhs, const entry_t& rhs) const
+  {
+    return (lhs.when != rhs.when) ? lhs.when < rhs.when
+      : slots_[lhs.slot].sequence < slots_[rhs.slot].sequence;
+  };
+
+private:
+  // Only our thread moves the clock but stats dumps read it
+  std::atomic<std::uint64_t> time_;
+  std::uint64_t sequence_;
+  heap_t events_;          // Timers and messages still on the way
+  slot_vector_t slots_;
+  std::vector<std::uint32_t> free_slots_;
+  ready_queue_t ready_;    // Posted to run right away, already in order
+
+  const IDurationModel * delay_;
+  Random random_;
+  std::uint64_t run_time_;
+
+  double ticks_per_ns_;
+  std::uint64_t event_count_;
+  std::uint64_t message_count_;
+
+private:
+  Simulator(const Simulator& rhs) = delete;
+  Simulator& operator =(const Simulator& rhs) = delete;
+};
+
+#endif // #if !defined(__SIMULATOR_H__)
@@ -0,0 +1,650 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// SocketTransport.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the SocketTransport class
+//  Elsewhere than Linux the transport never opens.
+//
+
+#include "SocketTransport.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+constexpr std::uint32_t SocketTransport::hello_magic;
+constexpr std::uint32_t SocketTransport::barrier_word;
+constexpr std::size_t SocketTransport::max_cut_count;
+
+// What epoll tells us apart by.  Peers come after these.
+enum { wake_tag, timer_tag, listener_tag, peer_tag };
+
+#if defined(__linux__)
+// Bumps an eventfd, or reads it back to zero along with a timerfd
+static void signal_fd(int fd)
+{
+  std::uint64_t one = 1;
+  auto written = ::write(fd, &one, sizeof(one));
+  (void)written;
+}
+
+static void clear_fd(int fd)
+{
+  std::uint64_t value;
+  auto got = ::read(fd, &value, sizeof(value));
+  (void)got;
+}
+#endif
+
+static void put_word(char * out, std::uint32_t word)
+{
+  out[0] = static_cast<char>(word);
+  out[1] = static_cast<char>(word >> 8);
+  out[2] = static_cast<char>(word >> 16);
+  out[3] = static_cast<char>(word >> 24);
+}
+
+static std::uint32_t get_word(const char * in)
+{
+  auto bytes = reinterpret_cast<const unsigned char *>(in);
+  return static_cast<std::uint32_t>(bytes[0]) | (static_cast<std::uint32_t>(bytes[1]) << 8)
+    | (static_cast<std::uint32_t>(bytes[2]) << 16) | (static_cast<std::uint32_t>(bytes[3]) << 24);
+}
+
+SocketTransport::SocketTransport(const std::string& address, int guest_count, const edge_vector_t& edges, int shard, int shard_count,
+  std::chrono::microseconds flush_interval, std::chrono::milliseconds timeout)
+  : ShardTransport(guest_count, edges, shard, shard_count)
+  , address_(address)
+  , unix_(false)
+  , host_()
+  , port_(0)
+  , flush_interval_(flush_interval)
+  , timeout_(timeout)
+  , peers_()
+  , listener_(-1)
+  , epoll_(-1)
+  , wake_(-1)
+  , timer_(-1)
+  , barriers_(0)
+  , barrier_lock_()
+  , barrier_cv_()
+  , sent_(0)
+  , frames_(0)
+  , quit_(false)
+  , worker_()
+{
+  if (shard < 0 || shard >= shard_count || guest_count <= 0 || get_cut_count() > max_cut_count)
+    return;
+
+  // tcp:host:port, unix:path or just host:port
+  auto spec = address;
+  if (spec.compare(0, 5, "unix:") == 0)
+  {
+    unix_ = true;
+    host_ = spec.substr(5);
+  }
+  else
+  {
+    if (spec.compare(0, 4, "tcp:") == 0)
+      spec = spec.substr(4);
+
+    auto colon = spec.rfind(':');
+    if (colon == std::string::npos)
+      return;
+
+    host_ = spec.substr(0, colon);
+    port_ = ::atoi(spec.c_str() + colon + 1);
+    if (port_ <= 0)
+      return;
+  }
+
+  peers_.reset(new peer_t[shard_count]);
+
+#if defined(__linux__)
+  epoll_ = ::epoll_create1(EPOLL_CLOEXEC);
+  wake_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  timer_ = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (epoll_ < 0 || wake_ < 0 || timer_ < 0)
+    return;
+
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u64 = wake_tag;
+  ::epoll_ctl(epoll_, EPOLL_CTL_ADD, wake_, &event);
+  event.data.u64 = timer_tag;
+  ::epoll_ctl(epoll_, EPOLL_CTL_ADD, timer_, &event);
+
+  // Listen now so the shards above us can connect as soon as they like
+  auto listener = open_socket(shard, true);
+  if (listener < 0)
+    return;
+
+  event.data.u64 = listener_tag;
+  ::epoll_ctl(epoll_, EPOLL_CTL_ADD, listener, &event);
+  listener_ = listener;
+#endif
+}
+
+SocketTransport::~SocketTransport()
+{
+  stop();
+
+#if defined(__linux__)
+  if (peers_)
+    for (int i = 0; i < shard_count_; i++)
+      if (peers_[i].fd >= 0)
+        ::close(peers_[i].fd);
+
+  for (auto fd : { listener_, epoll_, wake_, timer_ })
+    if (fd >= 0)
+      ::close(fd);
+
+  if (unix_ && listener_ >= 0)
+    ::unlink((host_ + "." + std::to_string(shard_)).c_str());
+#endif
+}
+
+// Either listens as the given shard or connects to it.  Returns the
+// socket or -1.
+int SocketTransport::open_socket(int shard, bool listen)
+{
+#if defined(__linux__)
+  if (unix_)
+  {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    auto path = host_ + "." + std::to_string(shard);
+    if (path.size() >= sizeof(address.sun_path))
+      return -1;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    auto fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      return -1;
+
+    if (listen)
+    {
+      // Left over from a run that didn't clean up
+      ::unlink(path.c_str());
+      if (::bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0 && ::listen(fd, shard_count_) == 0)
+        return fd;
+    }
+    else if (::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0)
+      return fd;
+
+    ::close(fd);
+    return -1;
+  }
+
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = listen ? AI_PASSIVE : 0;
+
+  addrinfo * results = nullptr;
+  auto port = std::to_string(port_ + shard);
+  if (::getaddrinfo(host_.empty() ? nullptr : host_.c_str(), port.c_str(), &hints, &results) != 0)
+    return -1;
+
+  int fd = -1;
+  for (auto result = results; result && fd < 0; result = result->ai_next)
+  {
+    fd = ::socket(result->ai_family, result->ai_socktype | SOCK_CLOEXEC, result->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    int on = 1;
+    if (listen)
+    {
+      ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      if (::bind(fd, result->ai_addr, result->ai_addrlen) == 0 && ::listen(fd, shard_count_) == 0)
+        continue;
+    }
+    else if (::connect(fd, result->ai_addr, result->ai_addrlen) == 0)
+    {
+      // Frames are already batched, don't let Nagle hold them back
+      ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      continue;
+    }
+
+    ::close(fd);
+    fd = -1;
+  }
+
+  ::freeaddrinfo(results);
+  return fd;
+#else
+  (void)shard;
+  (void)listen;
+  return -1;
+#endif
+}
+
+// The shard below us may not be listening yet, so keep trying
+bool SocketTransport::connect_to(int shard, std::chrono::steady_clock::time_point deadline)
+{
+#if defined(__linux__)
+  int fd;
+  while ((fd = open_socket(shard, false)) < 0)
+  {
+    if (std::chrono::steady_clock::now() >= deadline)
+      return false;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  char hello[8];
+  put_word(hello, hello_magic);
+  put_word(hello + 4, static_cast<std::uint32_t>(shard_));
+  if (::send(fd, hello, sizeof(hello), MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(hello)))
+  {
+    ::close(fd);
+    return false;
+  }
+
+  add_peer(shard, fd);
+  return true;
+#else
+  (void)shard;
+  (void)deadline;
+  return false;
+#endif
+}
+
+void SocketTransport::add_peer(int shard, int fd)
+{
+#if defined(__linux__)
+  ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.u64 = peer_tag + static_cast<std::uint64_t>(shard);
+  ::epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event);
+
+  peers_[shard].fd = fd;
+#else
+  (void)shard;
+  (void)fd;
+#endif
+}
+
+void SocketTransport::close_peer(int shard)
+{
+#if defined(__linux__)
+  auto& peer = peers_[shard];
+  if (peer.fd < 0)
+    return;
+
+  ::epoll_ctl(epoll_, EPOLL_CTL_DEL, peer.fd, nullptr);
+  ::close(peer.fd);
+  peer.fd = -1;
+#else
+  (void)shard;
+#endif
+}
+
+// The shards above us say who they are as soon as they connect
+void SocketTransport::accept_peer()
+{
+#if defined(__linux__)
+  auto fd = ::accept4(listener_, nullptr, nullptr, SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  timeval wait = {};
+  wait.tv_sec = static_cast<time_t>(timeout_.count() / 1000);
+  wait.tv_usec = static_cast<suseconds_t>(timeout_.count() % 1000) * 1000;
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+
+  char hello[8];
+  if (::recv(fd, hello, sizeof(hello), MSG_WAITALL) != static_cast<ssize_t>(sizeof(hello))
+    || get_word(hello) != hello_magic)
+  {
+    ::close(fd);
+    return;
+  }
+
+  auto shard = static_cast<int>(get_word(hello + 4));
+  if (shard <= shard_ || shard >= shard_count_ || peers_[shard].fd >= 0)
+  {
+    ::close(fd);
+    return;
+  }
+
+  if (!unix_)
+  {
+    int on = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+
+  add_peer(shard, fd);
+#endif
+}
+
+// ITransport interface
+void SocketTransport::start()
+{
+  if (!is_open() || worker_.joinable())
+    return;
+
+  auto deadline = std::chrono::steady_clock::now() + timeout_;
+  for (int i = 0; i < shard_; i++)
+    connect_to(i, deadline);
+
+  quit_ = false;
+  worker_ = std::thread(&SocketTransport::work, this);
+}
+
+void SocketTransport::stop()
+{
+  if (!worker_.joinable())
+    return;
+
+  quit_ = true;
+
+#if defined(__linux__)
+  signal_fd(wake_);
+#endif
+
+  worker_.join();
+}
+
+bool SocketTransport::barrier(std::chrono::milliseconds timeout)
+{
+  if (!is_open())
+    return false;
+
+  auto target = ++barriers_;
+  for (int i = 0; i < shard_count_; i++)
+    if (i != shard_)
+      queue(i, barrier_word);
+
+  std::unique_lock<std::mutex> lock(barrier_lock_);
+  return barrier_cv_.wait_for(lock, timeout, [this, target]
+  {
+    for (int i = 0; i < shard_count_; i++)
+      if (i != shard_ && peers_[i].barriers.load() < target)
+        return false;
+
+    return true;
+  });
+}
+
+// ShardTransport
+void SocketTransport::send(std::size_t cut, bool, int receiver_shard, std::uint8_t token)
+{
+  queue(receiver_shard, (static_cast<std::uint32_t>(cut) << 8) | token);
+}
+
+// Only the first word after a flush has to wake the epoll thread
+void SocketTransport::queue(int receiver_shard, std::uint32_t word)
+{
+  auto& peer = peers_[receiver_shard];
+  bool first;
+
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(peer.lock);
+    first = peer.queued.empty();
+    if (first)
+      peer.since = std::chrono::steady_clock::now();
+    peer.queued.push_back(word);
+  }
+
+#if defined(__linux__)
+  if (first)
+    signal_fd(wake_);
+#else
+  (void)first;
+#endif
+}
+
+// Turns everything queued for the shard into one frame.  The queue
+// and the frame trade buffers so neither allocates once warmed up.
+void SocketTransport::flush(int shard)
+{
+  auto& peer = peers_[shard];
+
+  peer.sending.clear();
+  { // Scope for lock
+    std::unique_lock<std::mutex> lock(peer.lock);
+    peer.sending.swap(peer.queued);
+  }
+
+  if (peer.sending.empty())
+    return;
+
+  peer.out.resize(4 * (peer.sending.size() + 1));
+  put_word(peer.out.data(), static_cast<std::uint32_t>(peer.sending.size()));
+  std::uint64_t tokens = 0;
+  for (std::size_t i = 0; i < peer.sending.size(); i++)
+  {
+    put_word(peer.out.data() + 4 * (i + 1), peer.sending[i]);
+    tokens += (peer.sending[i] != barrier_word);
+  }
+
+  peer.out_offset = 0;
+  sent_.store(sent_.load(std::memory_order_relaxed) + tokens, std::memory_order_relaxed);
+  frames_.store(frames_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+  write_out(shard);
+}
+
+void SocketTransport::write_out(int shard)
+{
+#if defined(__linux__)
+  auto& peer = peers_[shard];
+  while (peer.out_offset < peer.out.size())
+  {
+    auto written = ::send(peer.fd, peer.out.data() + peer.out_offset, peer.out.size() - peer.out_offset, MSG_NOSIGNAL);
+    if (written > 0)
+    {
+      peer.out_offset += static_cast<std::size_t>(written);
+      continue;
+    }
+
+    if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      // Pick up where we left off once there is room
+      if (!peer.writing)
+      {
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLOUT;
+        event.data.u64 = peer_tag + static_cast<std::uint64_t>(shard);
+        ::epoll_ctl(epoll_, EPOLL_CTL_MOD, peer.fd, &event);
+        peer.writing = true;
+      }
+      return;
+    }
+
+    if (written < 0 && errno == EINTR)
+      continue;
+
+    close_peer(shard);
+    return;
+  }
+
+  peer.out.clear();
+  peer.out_offset = 0;
+  if (peer.writing)
+  {
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = peer_tag + static_cast<std::uint64_t>(shard);
+    ::epoll_ctl(epoll_, EPOLL_CTL_MOD, peer.fd, &event);
+    peer.writing = false;
+  }
+#else
+  (void)shard;
+#endif
+}
+
+void SocketTransport::read_in(int shard)
+{
+#if defined(__linux__)
+  auto& peer = peers_[shard];
+  const std::size_t chunk = 64 * 1024;
+
+  for (;;)
+  {
+    auto size = peer.in.size();
+    peer.in.resize(size + chunk);
+    auto got = ::recv(peer.fd, peer.in.data() + size, chunk, 0);
+    peer.in.resize(size + static_cast<std::size_t>(got > 0 ? got : 0));
+
+    if (got > 0)
+      continue;
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+
+    // The other side is gone
+    close_peer(shard);
+    break;
+  }
+
+  // Hand out every whole frame
+  std::size_t offset = 0;
+  bool barrier = false;
+  while (peer.in.size() - offset >= 4)
+  {
+    auto count = static_cast<std::size_t>(get_word(peer.in.data() + offset));
+    if (peer.in.size() - offset - 4 < 4 * count)
+      break;
+
+    auto words = peer.in.data() + offset + 4;
+    for (std::size_t i = 0; i < count; i++)
+    {
+      auto word = get_word(words + 4 * i);
+      if (word == barrier_word)
+      {
+        peer.barriers++;
+        barrier = true;
+        continue;
+      }
+
+      auto cut = static_cast<std::size_t>(word >> 8);
+      if (cut >= get_cut_count())
+        continue;
+
+      auto& edge = get_cut(cut);
+      bool high_is_local = is_local(edge.high);
+      auto guest = get_local(high_is_local ? edge.high : edge.low);
+      if (guest)
+        deliver(*guest, high_is_local ? edge.low : edge.high, static_cast<std::uint8_t>(word & 0xff));
+    }
+
+    offset += 4 * (count + 1);
+  }
+
+  peer.in.erase(peer.in.begin(), peer.in.begin() + static_cast<std::ptrdiff_t>(offset));
+
+  if (barrier)
+  {
+    std::unique_lock<std::mutex> lock(barrier_lock_);
+    barrier_cv_.notify_all();
+  }
+#else
+  (void)shard;
+#endif
+}
+
+void SocketTransport::work()
+{
+#if defined(__linux__)
+  epoll_event events[16];
+
+  while (!quit_)
+  {
+    // Send whatever has waited out the interval and find the next
+    // queue that will have.  A peer still busy with the last frame
+    // keeps piling up tokens for the next one.
+    auto now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::time_point::max();
+    for (int i = 0; i < shard_count_; i++)
+    {
+      auto& peer = peers_[i];
+      if (i == shard_ || peer.fd < 0 || peer.writing)
+        continue;
+
+      std::chrono::steady_clock::time_point due;
+      { // Scope for lock
+        std::unique_lock<std::mutex> lock(peer.lock);
+        if (peer.queued.empty())
+          continue;
+        due = peer.since + flush_interval_;
+      }
+
+      if (due <= now)
+        flush(i);
+      else
+        next = std::min(next, due);
+    }
+
+    itimerspec timer = {};
+    if (next != std::chrono::steady_clock::time_point::max())
+    {
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(next.time_since_epoch()).count();
+      timer.it_value.tv_sec = static_cast<time_t>(ns / 1000000000);
+      timer.it_value.tv_nsec = static_cast<long>(ns % 1000000000);
+    }
+    ::timerfd_settime(timer_, TFD_TIMER_ABSTIME, &timer, nullptr);
+
+    auto count = ::epoll_wait(epoll_, events, 16, 100);
+    for (int e = 0; e < count; e++)
+    {
+      auto tag = events[e].data.u64;
+      if (tag == wake_tag)
+        clear_fd(wake_);
+      else if (tag == timer_tag)
+        clear_fd(timer_);
+      else if (tag == listener_tag)
+        accept_peer();
+      else
+      {
+        auto shard = static_cast<int>(tag - peer_tag);
+        if ((events[e].events & EPOLLOUT) && peers_[shard].fd >= 0)
+          write_out(shard);
+        if ((events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && peers_[shard].fd >= 0)
+          read_in(shard);
+      }
+    }
+  }
+
+  // Whatever is still queued goes out before we go, most of all the
+  // last barrier, which the other shards are waiting on
+  timeval wait = {};
+  wait.tv_sec = static_cast<time_t>(timeout_.count() / 1000);
+  wait.tv_usec = static_cast<suseconds_t>(timeout_.count() % 1000) * 1000;
+  for (int i = 0; i < shard_count_; i++)
+  {
+    auto& peer = peers_[i];
+    if (i == shard_ || peer.fd < 0)
+      continue;
+
+    ::fcntl(peer.fd, F_SETFL, ::fcntl(peer.fd, F_GETFL) & ~O_NONBLOCK);
+    ::setsockopt(peer.fd, SOL_SOCKET, SO_SNDTIMEO, &wait, sizeof(wait));
+    if (peer.writing)
+      write_out(i);
+    if (peer.fd >= 0 && !peer.writing)
+      flush(i);
+  }
+#endif
+}
@@ -0,0 +1,141 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// SocketTransport.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// SocketTransport declaration:
+//  This carries tokens between processes over TCP or Unix domain
+//  sockets, so the shards can be spread across hosts.  Every pair
+//  of shards shares one connection.  Each shard listens on its own
+//  port (or path) and connects to every shard below it.
+//
+//  A token is one little endian 32 bit word, the cut edge number
+//  above the token byte.  Tokens for the same shard are queued and
+//  go out together as one frame: a word with the count and then
+//  the tokens.  The first token queued starts the flush interval
+//  and whatever has piled up by the end of it is sent.  A longer
+//  interval means fewer, bigger frames and slower bottles.
+//
+//  One thread per shard does all the socket work with epoll.  It
+//  is woken through an eventfd when a queue stops being empty and
+//  through a timerfd when an interval runs out.  Linux only.
+//
+
+#if !defined(__SOCKETTRANSPORT_H__)
+#define __SOCKETTRANSPORT_H__
+
+#include "ShardTransport.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class SocketTransport
+  : public ShardTransport
+{
+public:
+  // The connecting side sends these two words before any frame
+  static constexpr std::uint32_t hello_magic = 0x314e4850;   // "PHN1"
+
+  // Stands in for a token to say the sender reached a barrier
+  static constexpr std::uint32_t barrier_word = 0xffffffff;
+
+  // Cut edges are numbered in 24 bits
+  static constexpr std::size_t max_cut_count = (std::size_t(1) << 24) - 1;
+
+  // Everything the epoll thread knows about one of the other shards
+  struct peer_t
+  {
+    // Senders queue tokens under the lock.  since is when the queue
+    // stopped being empty.
+    std::mutex lock;
+    std::vector<std::uint32_t> queued;
+    std::chrono::steady_clock::time_point since;
+
+    // Only touched by the epoll thread once we are started
+    int fd = -1;
+    bool writing = false;   // Waiting on EPOLLOUT
+    std::vector<std::uint32_t> sending;
+    std::vector<char> out;
+    std::size_t out_offset = 0;
+    std::vector<char> in;
+
+    std::atomic<std::uint32_t> barriers{0};   // Barriers the peer has reached
+  };
+
+public:
+  // Address is tcp:host:port or unix:path.  Shard s listens on port + s
+  // or on path.s.  Connections to the other shards are made in start
+  // and given up on after the timeout.
+  SocketTransport(const std::string& address, int guest_count, const edge_vector_t& edges, int shard, int shard_count,
+    std::chrono::microseconds flush_interval = std::chrono::microseconds(100),
+    std::chrono::milliseconds timeout = std::chrono::milliseconds(10000));
+  virtual ~SocketTransport();
+
+public:
+  bool is_open() const override { return listener_ >= 0; };
+
+  // Only counted by the epoll thread
+  std::uint64_t get_sent_count() const { return sent_.load(std::memory_order_relaxed); };
+  std::uint64_t get_frame_count() const { return frames_.load(std::memory_order_relaxed); };
+
+public:
+  // ITransport interface
+  void start() override;
+  void stop() override;
+  bool barrier(std::chrono::milliseconds timeout) override;
+
+protected:
+  // ShardTransport
+  void send(std::size_t cut, bool upward, int receiver_shard, std::uint8_t token) override;
+
+private:
+  void queue(int receiver_shard, std::uint32_t word);
+  int open_socket(int shard, bool listen);
+  bool connect_to(int shard, std::chrono::steady_clock::time_point deadline);
+  void add_peer(int shard, int fd);
+  void close_peer(int shard);
+  void accept_peer();
+  void flush(int shard);
+  void write_out(int shard);
+  void read_in(int shard);
+  void work();
+
+private:
+  std::string address_;
+  bool unix_;
+  std::string host_;
+  int port_;
+
+  std::chrono::microseconds flush_interval_;
+  std::chrono::milliseconds timeout_;
+
+  std::unique_ptr<peer_t[]> peers_;   // By shard, ours is left empty
+  int listener_;
+  int epoll_;
+  int wake_;    // eventfd
+  int timer_;   // timerfd
+
+  std::uint32_t barriers_;
+  std::mutex barrier_lock_;
+  std::condition_variable barrier_cv_;
+
+  std::atomic<std::uint64_t> sent_;
+  std::atomic<std::uint64_t> frames_;
+  std::atomic<bool> quit_;
+  std::thread worker_;
+
+private:
+  SocketTransport(const SocketTransport& rhs) = delete;
+  SocketTransport& operator =(const SocketTransport& rhs) = delete;
+};
+
+#endif // #if !defined(__SOCKETTRANSPORT_H__)
@@ -11,77 +11,607 @@
 //
 
 #include "Table.h"
+#include "Affinity.h"
+#include "Partition.h"
 
-Table::Table(int philosophers, Logger& log)
-  : philosophers_()
-  , drink_counts_(philosophers, 0)
+#include <algorithm>
+#include <thread>
+
+Table::Table(int philosophers, Logger& log, bool pool, std::size_t workers, int first_id, std::size_t seats)
+  : Table(philosophers, log, pool ? new Executor(workers) : nullptr, nullptr, first_id, seats)
+{
+}
+
+Table::Table(int philosophers, Logger& log, Simulator& simulator)
+  : Table(philosophers, log, nullptr, &simulator, 0, 0)
+{
+}
+
+Table::Table(int philosophers, Logger& log, Executor * executor, Simulator * simulator, int first_id, std::size_t seats)
+  : memory_(std::make_shared<Arena>())
+  , bottle_memory_()
+  , guest_nodes_()
+  , huge_pages_(false)
+  , executor_(executor)
+  , simulator_(simulator)
+  , scheduler_(executor ? static_cast<IScheduler *>(executor) : simulator)
+  , arena_(std::max(seats, static_cast<std::size_t>(philosophers > 0 ? philosophers : 0)))
+  , changes_parker_()
+  , philosophers_()
+  , first_id_(first_id)
+  , members_lock_()
+  , seats_(std::max(seats, static_cast<std::size_t>(philosophers > 0 ? philosophers : 0)))
+  , free_seats_()
+  , started_(false)
+  , transport_(false)
+  , drinks_(std::max(seats, static_cast<std::size_t>(philosophers > 0 ? philosophers : 0)), first_id)
+  , stats_(false)
+  , dump_quit_(false)
+  , dump_thread_()
   , log_(log)
 {
   for (int i = 0; i < philosophers; i++)
-    philosophers_.emplace_back(std::make_shared<Philosopher>(i, log_, this));
+  {
+    philosophers_.emplace_back(std::allocate_shared<Philosopher>(ArenaAllocator<Philosopher>(memory_),
+      first_id_ + i, log_, this, scheduler_));
+    philosophers_.back()->set_arena(&arena_, static_cast<std::size_t>(i));
+    arena_.add(philosophers_.back());
+  }
+
+  // The empty seats keep their handles for whoever joins
+  philosophers_.reserve(seats_);
+  for (auto seat = philosophers_.size(); seat < seats_; seat++)
+  {
+    arena_.add(nullptr);
+    drinks_.leave(seat);
+  }
+
+  if (executor_)
+    log_.log("Running on a pool of ", executor_->get_worker_count(), " workers.");
 }
 
 Table::~Table()
 {
+  if (dump_thread_.joinable())
+  {
+    { // Scope for lock
+      std::unique_lock<std::mutex> lock(dump_lock_);
+      dump_quit_ = true;
+      dump_cv_.notify_all();
+    }
+
+    dump_thread_.join();
+  }
+
+  // Stop the workers first so nobody is in the middle of a step
+  // when the philosophers go away
+  if (executor_)
+    executor_->stop();
+
   // Must make sure to disconnect the philosophers so they don't try
-  // to call us before they are destroyed
+  // to call us before they are destroyed.  Their threads have to be
+  // gone before the arena is.
   for (auto& philosopher : philosophers_)
+  {
+    if (!philosopher)
+      continue;
+
     philosopher->set_listener(nullptr);
+    philosopher->quit();
+  }
+}
+
+void Table::wire(const edge_vector_t& edges, bool parallel, ITransport * transport)
+{
+  auto count = philosophers_.size();
+  auto first = first_id_;
+  auto local = [count, first](int id)
+  {
+    return id >= first && static_cast<std::size_t>(id - first) < count;
+  };
+
+  // Without a transport both ends have to be ours
+  auto valid = [&local, transport](const edge_t& edge)
+  {
+    return edge.first >= 0 && edge.second >= 0 && edge.first != edge.second
+      && (local(edge.first) || local(edge.second))
+      && ((local(edge.first) && local(edge.second)) || transport);
+  };
+
+  transport_ = (transport != nullptr);
+  if (transport)
+    for (auto& philosopher : philosophers_)
+      transport->attach(philosopher->get_id(), philosopher);
+
+  // Lay the edges out by guest so each guest's neighbors sit together
+  std::vector<std::size_t> offsets(count + 1, 0);
+  for (auto& edge : edges)
+  {
+    if (!valid(edge))
+      continue;
+
+    if (local(edge.first))
+      offsets[edge.first - first + 1]++;
+    if (local(edge.second))
+      offsets[edge.second - first + 1]++;
+  }
+
+  for (std::size_t i = 0; i < count; i++)
+    offsets[i + 1] += offsets[i];
+
+  // Whoever was placed on a node gets their bottles from it
+  if (bottle_memory_.empty())
+  {
+    auto nodes = guest_nodes_.empty() ? 1 : *std::max_element(guest_nodes_.begin(), guest_nodes_.end()) + 1;
+    for (int node = 0; node < nodes; node++)
+      bottle_memory_.push_back(std::make_shared<Arena>(huge_pages_, guest_nodes_.empty() ? -1 : node));
+  }
+
+  std::vector<int> neighbors(offsets[count]);
+  std::vector<std::size_t> next(offsets.begin(), offsets.end() - 1);
+  for (auto& edge : edges)
+  {
+    if (!valid(edge))
+      continue;
+
+    if (local(edge.first))
+      neighbors[next[edge.first - first]++] = edge.second;
+    if (local(edge.second))
+      neighbors[next[edge.second - first]++] = edge.first;
+  }
+
+  // Every guest only touches itself, so the guests can be split up
+  // any way we like.  The transport only looks things up here and the
+  // arena takes its own lock.
+  auto seat = [this, &offsets, &neighbors, &local, transport](std::size_t begin, std::size_t end)
+  {
+    for (std::size_t i = begin; i < end; i++)
+    {
+      auto& philosopher = philosophers_[i];
+      auto own_id = philosopher->get_id();
+      auto node = guest_nodes_.empty() ? 0 : guest_nodes_[i];
+      philosopher->reserve_neighbors(offsets[i + 1] - offsets[i], bottle_memory_[static_cast<std::size_t>(node)]);
+
+      for (auto k = offsets[i]; k < offsets[i + 1]; k++)
+      {
+        auto id = neighbors[k];
+        auto handle = NeighborArena::no_handle;
+        if (local(id))
+          handle = static_cast<NeighborArena::handle_t>(id - first_id_);
+        else if (auto neighbor = transport->get_neighbor(own_id, id))
+          handle = arena_.add(std::move(neighbor));
+
+        if (handle != NeighborArena::no_handle)
+          philosopher->add_neighbor(id, handle, id > own_id);
+      }
+    }
+  };
+
+  std::size_t threads = parallel ? std::thread::hardware_concurrency() : 1;
+  threads = std::max<std::size_t>(1, std::min(threads, count / 1024 + 1));
+  if (threads == 1)
+  {
+    seat(0, count);
+    log_memory();
+    return;
+  }
+
+  // Split by neighbor count rather than by guest so the work is even
+  std::vector<std::thread> workers;
+  std::size_t begin = 0;
+  for (std::size_t t = 1; t <= threads && begin < count; t++)
+  {
+    auto target = offsets[count] * t / threads;
+    auto end = (t == threads) ? count : static_cast<std::size_t>(
+      std::lower_bound(offsets.begin() + begin + 1, offsets.end() - 1, target) - offsets.begin());
+
+    workers.emplace_back(seat, begin, end);
+    begin = end;
+  }
+
+  for (auto& worker : workers)
+    worker.join();
+
+  log_memory();
+}
+
+void Table::log_memory()
+{
+  std::size_t used = memory_->get_used();
+  std::size_t reserved = memory_->get_reserved();
+  for (auto& arena : bottle_memory_)
+  {
+    used += arena->get_used();
+    reserved += arena->get_reserved();
+  }
+
+  log_.log("Seated ", philosophers_.size(), " guests in ", used / 1024, " KB (", reserved / 1024, " KB mapped",
+    huge_pages_ ? " on huge pages" : "", bottle_memory_.size() > 1 ? ", one arena per node)." : ").");
+}
+
+void Table::place(const edge_vector_t& edges, bool pin, unsigned long long seed)
+{
+  if (simulator_ || philosophers_.empty())
+    return;
+
+  auto cpus = Affinity::get_cpus();
+  auto parts = static_cast<int>(executor_ ? executor_->get_worker_count() : cpus.size());
+  auto count = static_cast<int>(philosophers_.size());
+
+  // Only the bottles between two of our own guests, numbered from zero
+  edge_vector_t local;
+  for (auto& edge : edges)
+  {
+    auto first = edge.first - first_id_;
+    auto second = edge.second - first_id_;
+    if (first >= 0 && second >= 0 && first < count && second < count)
+      local.push_back({ first, second });
+  }
+
+  auto assignment = Partition::split(count, local, parts, seed);
+
+  auto nodes = Affinity::get_node_count(cpus);
+  if (pin && nodes > 1 && bottle_memory_.empty())
+    guest_nodes_.assign(philosophers_.size(), 0);
+
+  for (int i = 0; i < count; i++)
+  {
+    auto part = assignment[static_cast<std::size_t>(i)];
+    auto& cpu = cpus[static_cast<std::size_t>(part) % cpus.size()];
+    if (executor_)
+      philosophers_[i]->set_home(part);
+    else if (pin)
+      philosophers_[i]->pin(cpu.cpu);
+
+    if (!guest_nodes_.empty())
+      guest_nodes_[static_cast<std::size_t>(i)] = cpu.node;
+  }
+
+  std::size_t pinned = 0;
+  if (executor_ && pin)
+    pinned = executor_->pin(cpus);
+
+  auto cut = Partition::count_cut(local, assignment);
+  auto unplaced = Partition::count_cut(local, Partition::blocks(count, parts));
+  auto ratio = [&local](std::size_t bottles) { return local.empty() ? 0.0 : 100.0 * bottles / local.size(); };
+
+  log_.log("Placed ", count, " guests on ", parts, executor_ ? " workers" : " cores",
+    " over ", nodes, " NUMA nodes, ", cut, " of ", local.size(), " bottles cross (",
+    ratio(cut), "%, ", ratio(unplaced), "% in id order)");
+
+  if (executor_ && pin)
+    log_.log("Pinned ", pinned, " of ", executor_->get_worker_count(), " workers.");
 }
 
 void Table::start()
 {
+  std::unique_lock<std::mutex> lock(members_lock_);
+  started_ = true;
+
   // Walk through the philosophers_ and tell them all to start
   for (auto& philosopher : philosophers_)
-    philosopher->start();
+    if (philosopher)
+      philosopher->start();
+}
+
+int Table::join(const std::vector<int>& neighbors, const std::function<void(Philosopher&)>& setup)
+{
+  std::unique_lock<std::mutex> lock(members_lock_);
+  if (simulator_ || transport_)
+    return -1;
+
+  std::size_t seat;
+  if (!free_seats_.empty())
+  {
+    seat = free_seats_.back();
+    free_seats_.pop_back();
+  }
+  else if (philosophers_.size() < seats_)
+  {
+    seat = philosophers_.size();
+    philosophers_.emplace_back();
+  }
+  else
+  {
+    log_.log("No seat left for a guest to join.");
+    return -1;
+  }
+
+  auto id = first_id_ + static_cast<int>(seat);
+  auto guest = std::allocate_shared<Philosopher>(ArenaAllocator<Philosopher>(memory_), id, log_, this, scheduler_);
+  guest->set_arena(&arena_, seat);
+  if (setup)
+    setup(*guest);
+  if (stats_)
+    guest->enable_stats();
+
+  std::vector<Philosopher *> next_to;
+  for (auto neighbor_id : neighbors)
+  {
+    auto neighbor = get_seated(neighbor_id);
+    if (neighbor && neighbor_id != id && std::find(next_to.begin(), next_to.end(), neighbor) == next_to.end())
+      next_to.push_back(neighbor);
+  }
+
+  // Sit down with only the request tokens
+  guest->reserve_neighbors(next_to.size(), bottle_memory_.empty() ? nullptr : bottle_memory_.front());
+  for (auto neighbor : next_to)
+    guest->add_neighbor(neighbor->get_id(), static_cast<NeighborArena::handle_t>(neighbor->get_id() - first_id_), false);
+
+  // Share a worker with a neighbor if they have one
+  if (!next_to.empty())
+    guest->set_home(next_to.front()->get_home());
+
+  arena_.put(static_cast<NeighborArena::handle_t>(seat), guest);
+  philosophers_[seat] = guest;
+  drinks_.join(seat);
+
+  // Each neighbor takes its bottle once it comes after everyone, so we
+  // come first and can't close a cycle in the precedence graph.  We
+  // don't start until they all have, or a request could reach one that
+  // doesn't know us yet and get lost.
+  std::vector<std::pair<Philosopher *, std::uint64_t>> changes;
+  for (auto neighbor : next_to)
+    changes.emplace_back(neighbor, neighbor->connect_after_drink(id, static_cast<NeighborArena::handle_t>(seat), &changes_parker_));
+  wait_for_changes(changes);
+  if (started_)
+    guest->start();
+
+  log_.log("Philosopher[", id, "] joined next to ", next_to.size(), " guests.");
+  return id;
+}
+
+bool Table::leave(int id, std::vector<int> * neighbors)
+{
+  std::unique_lock<std::mutex> lock(members_lock_);
+  if (simulator_ || transport_ || !get_seated(id))
+    return false;
+
+  auto seat = static_cast<std::size_t>(id - first_id_);
+  auto guest = philosophers_[seat];
+
+  // Stop the guest and take it out of sight.  Once the epoch has
+  // passed nobody can wake it, and once it is idle nothing queued can
+  // run it either.
+  guest->quit();
+  auto& epoch = arena_.get_epoch();
+  auto removed = arena_.remove(static_cast<NeighborArena::handle_t>(seat));
+  while (!epoch.passed(removed))
+    std::this_thread::yield();
+
+  if (executor_)
+    executor_->cancel(guest.get());
+  while (!guest->is_idle())
+    std::this_thread::yield();
+
+  // The neighbors drop its bottles and reuse the slots for whoever
+  // they meet next
+  auto next_to = guest->get_neighbor_ids();
+  std::vector<std::pair<Philosopher *, std::uint64_t>> changes;
+  for (auto neighbor_id : next_to)
+    if (auto neighbor = get_seated(neighbor_id))
+      changes.emplace_back(neighbor, neighbor->disconnect(id, &changes_parker_));
+  wait_for_changes(changes);
+
+  // The guest's memory goes back to the arenas for the next one
+  drinks_.leave(seat);
+  guest->set_listener(nullptr);
+  philosophers_[seat].reset();
+  guest.reset();
+  free_seats_.push_back(seat);
+  epoch.collect();
+
+  if (neighbors)
+    *neighbors = std::move(next_to);
+
+  log_.log("Philosopher[", id, "] left.");
+  return true;
+}
+
+bool Table::connect(int first, int second)
+{
+  std::unique_lock<std::mutex> lock(members_lock_);
+  if (simulator_ || transport_ || !started_ || first == second)
+    return false;
+
+  auto first_guest = get_seated(first);
+  auto second_guest = get_seated(second);
+  if (!first_guest || !second_guest)
+    return false;
+
+  // Like a join, with the first guest held tranquil in place of the
+  // newcomer that hasn't started.  Connecting it lets it go.
+  wait_for_changes({ { first_guest, first_guest->hold(&changes_parker_) } });
+  wait_for_changes({ { second_guest, second_guest->connect_after_drink(first,
+    static_cast<NeighborArena::handle_t>(first - first_id_), &changes_parker_) } });
+  wait_for_changes({ { first_guest, first_guest->connect(second,
+    static_cast<NeighborArena::handle_t>(second - first_id_), false, &changes_parker_) } });
+  return true;
+}
+
+bool Table::disconnect(int first, int second)
+{
+  std::unique_lock<std::mutex> lock(members_lock_);
+  if (simulator_ || transport_)
+    return false;
+
+  auto first_guest = get_seated(first);
+  auto second_guest = get_seated(second);
+  if (!first_guest || !second_guest)
+    return false;
+
+  wait_for_changes({ { first_guest, first_guest->disconnect(second, &changes_parker_) },
+    { second_guest, second_guest->disconnect(first, &changes_parker_) } });
+  arena_.get_epoch().collect();
+  return true;
+}
+
+Philosopher * Table::get_seated(int id) const
+{
+  auto seat = static_cast<std::size_t>(id - first_id_);
+  return (id >= first_id_ && seat < philosophers_.size()) ? philosophers_[seat].get() : nullptr;
+}
+
+// Every guest makes its own changes on its next step and unparks us
+// once they are made
+void Table::wait_for_changes(const std::vector<std::pair<Philosopher *, std::uint64_t>>& changes)
+{
+  for (auto& change : changes)
+  {
+    for (;;)
+    {
+      changes_parker_.prepare();
+      if (change.first->get_changes_made() >= change.second)
+      {
+        changes_parker_.cancel();
+        break;
+      }
+
+      changes_parker_.park();
+    }
+  }
 }
 
 // IDrinkListener interface
 void Table::report_drink(int id)
 {
-  if (id < 0 || id > drink_counts_.size())
-    return;
-
-  drink_counts_[id]++;
+  drinks_.report_drink(id);
 }
 
 bool Table::wait_for_minimum_drink_count(int drink_minimum, long long max_wait_ms)
 {
-  if (drink_counts_.empty())
+  if (!drinks_.size())
   {
     log_.log("Trying to wait with no registered drinkers.");
     return false;
   }
 
-  auto start_time = std::chrono::system_clock::now();
-  auto end_time = start_time + std::chrono::milliseconds(max_wait_ms);
+  auto target = static_cast<std::size_t>(drink_minimum > 0 ? drink_minimum : 0);
+
+  // The simulation only moves while we run it
+  if (simulator_)
+    return simulator_->run([this, target] { return drinks_.get_minimum() >= target; },
+      std::chrono::milliseconds(max_wait_ms));
+
+  return drinks_.wait_for_minimum(target, std::chrono::milliseconds(max_wait_ms));
+}
+
+std::size_t Table::get_minimum_drink_count() const
+{
+  return drinks_.get_minimum();
+}
+
+std::size_t Table::get_total_drink_count() const
+{
+  return drinks_.get_total();
+}
+
+std::vector<std::size_t> Table::get_drink_counts() const
+{
+  return drinks_.get_counts();
+}
 
-  while (std::chrono::system_clock::now() < end_time)
+void Table::enable_stats()
+{
+  std::unique_lock<std::mutex> lock(members_lock_);
+  stats_ = true;
+  for (auto& philosopher : philosophers_)
+    if (philosopher)
+      philosopher->enable_stats();
+}
+
+void Table::get_stats(Philosopher::stats_t& total) const
+{
+  std::unique_lock<std::mutex> lock(members_lock_);
+  for (auto& philosopher : philosophers_)
   {
-    if (get_minimum_drink_count() >= drink_minimum)
-      return true;
+    auto stats = philosopher ? philosopher->get_stats() : nullptr;
+    if (!stats)
+      continue;
 
-    // OK... Sleep for a bit at try again
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    total.thirsty_time.merge(stats->thirsty_time);
+    total.bottle_time.merge(stats->bottle_time);
+    total.steps.merge(stats->steps);
   }
-
-  // Didn't crest the drink minimum
-  return false;
 }
 
-std::size_t Table::get_minimum_drink_count() const
+void Table::dump_stats(std::size_t worst)
 {
-  if (drink_counts_.empty())
-    return 0;
+  if (!stats_)
+  {
+    log_.log("Stats are not enabled.");
+    return;
+  }
+
+  auto ticks_per_us = Tsc::ticks_per_ns() * 1000.0;
+  auto us = [ticks_per_us](std::uint64_t ticks) { return static_cast<double>(ticks) / ticks_per_us; };
 
-  // Start with the first guy
-  std::size_t min_drinks = drink_counts_[0];
+  Philosopher::stats_t total;
+  get_stats(total);
 
-  // Look to see if anyone is lower
-  for (std::size_t i = 1; i < drink_counts_.size(); i++)
-    if (drink_counts_[i] < min_drinks)
-      min_drinks = drink_counts_[i];
+  log_.log("Stats: minimum drinks ", get_minimum_drink_count(), ", total drinks ", get_total_drink_count());
+  log_.log("Stats: thirsty us p50 ", us(total.thirsty_time.get_percentile(0.5)),
+    " p99 ", us(total.thirsty_time.get_percentile(0.99)),
+    " max ", us(total.thirsty_time.get_max()));
+  log_.log("Stats: bottle round trip us p50 ", us(total.bottle_time.get_percentile(0.5)),
+    " p99 ", us(total.bottle_time.get_percentile(0.99)),
+    " max ", us(total.bottle_time.get_max()));
+  log_.log("Stats: steps per state change p50 ", total.steps.get_percentile(0.5),
+    " p99 ", total.steps.get_percentile(0.99),
+    " max ", total.steps.get_max());
 
-  return min_drinks;
+  // Whoever has been thirsty the longest right now is who is starving.
+  // Among the rest, the worst wait so far.
+  auto now = scheduler_ ? scheduler_->get_ticks() : Tsc::now();
+  std::unique_lock<std::mutex> lock(members_lock_);
+  std::vector<std::pair<std::uint64_t, std::size_t>> waits;
+  waits.reserve(philosophers_.size());
+  for (std::size_t i = 0; i < philosophers_.size(); i++)
+  {
+    if (!philosophers_[i])
+      continue;
+
+    auto since = philosophers_[i]->get_thirsty_since();
+    auto waiting = (since && now > since) ? now - since : 0;
+    auto stats = philosophers_[i]->get_stats();
+    waits.emplace_back(std::max<std::uint64_t>(waiting, stats ? stats->thirsty_time.get_max() : 0), i);
+  }
+
+  worst = std::min(worst, waits.size());
+  std::partial_sort(waits.begin(), waits.begin() + worst, waits.end(),
+    [](const std::pair<std::uint64_t, std::size_t>& lhs, const std::pair<std::uint64_t, std::size_t>& rhs)
+    { return lhs.first > rhs.first; });
+
+  for (std::size_t i = 0; i < worst; i++)
+  {
+    auto& philosopher = philosophers_[waits[i].second];
+    auto since = philosopher->get_thirsty_since();
+    auto stats = philosopher->get_stats();
+    auto drinks = drinks_.get_count(waits[i].second);
+
+    if (since && now > since)
+      log_.log("Stats: Philosopher[", philosopher->get_id(), "] has been thirsty for ", us(now - since),
+        " us waiting on ", philosopher->get_missing_bottles(), " bottles, ", drinks, " drinks");
+    else
+      log_.log("Stats: Philosopher[", philosopher->get_id(), "] waited at most ",
+        us(stats->thirsty_time.get_max()), " us, ", drinks, " drinks");
+
+    log_.log("Stats:   bottle round trip us p99 ", us(stats->bottle_time.get_percentile(0.99)),
+      " max ", us(stats->bottle_time.get_max()), ", steps p99 ", stats->steps.get_percentile(0.99));
+  }
+}
+
+void Table::dump_stats_every(std::chrono::milliseconds interval)
+{
+  if (simulator_ || dump_thread_.joinable())
+    return;
+
+  dump_thread_ = std::thread(&Table::dump_stats_work, this, interval);
 }
 
+void Table::dump_stats_work(std::chrono::milliseconds interval)
+{
+  std::unique_lock<std::mutex> lock(dump_lock_);
+  while (!dump_cv_.wait_for(lock, interval, [this] { return dump_quit_; }))
+    dump_stats();
+}
@@ -15,8 +15,21 @@
 #if !defined(__TABLE_H__)
 #define __TABLE_H__
 
+#include "Arena.h"
+#include "DrinkCounter.h"
+#include "Edge.h"
+#include "Executor.h"
+#include "ITransport.h"
+#include "NeighborArena.h"
+#include "Parker.h"
 #include "Philosopher.h"
+#include "Simulator.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <utility>
 #include <vector>
 
 class Table
@@ -24,26 +37,154 @@ class Table
 {
 public:
   typedef std::vector<std::shared_ptr<Philosopher>> philosopher_vector_t;
+  typedef ::edge_t edge_t;
+  typedef ::edge_vector_t edge_vector_t;
 
 public:
-  Table(int philosophers, Logger& log);
+  // With pool set, the philosophers share an Executor instead of each
+  // running their own thread.  A worker count of zero uses the core count.
+  // The guests are numbered from first_id, which is for a table that
+  // only seats part of the guests and reaches the rest through a
+  // transport.  Seats is how many guests can be at the table at once
+  // counting any that join later, and never less than philosophers.
+  Table(int philosophers, Logger& log, bool pool = false, std::size_t workers = 0, int first_id = 0, std::size_t seats = 0);
+
+  // Runs the philosophers on a simulator instead.  Nothing happens
+  // until wait_for_minimum_drink_count() runs the simulation, and the
+  // simulator must outlive the table.
+  Table(int philosophers, Logger& log, Simulator& simulator);
   virtual ~Table();
 
+  // Seats everyone along the edges in one pass.  The lower id of each
+  // pair starts with the bottle.  With parallel set, the guests are
+  // split across one thread per core.  With a transport, edges to guests
+  // we don't seat go through it and our guests are attached to it.
+  // Must be called before start.
+  void wire(const edge_vector_t& edges, bool parallel = false, ITransport * transport = nullptr);
+
+  // Splits our guests over the pool's workers, or over the cores when
+  // each has its own thread, so that neighbors share one.  With pin set
+  // the threads are pinned to cores in NUMA node order, and when that
+  // spans nodes each guest's bottles are laid out on its own node if
+  // this comes before wire.  Logs how many bottles cross between
+  // workers.  Must be called before start.
+  void place(const edge_vector_t& edges, bool pin = false, unsigned long long seed = 0);
+
+  // Lays the bottle records out on huge pages.  Must be called before
+  // wire.
+  void set_huge_pages(bool huge_pages) { huge_pages_ = huge_pages; };
+
   void start();
 
+  // Live membership, which only works without a simulator or a
+  // transport.  Everyone else keeps drinking while it happens.
+  //
+  // join seats a new guest next to the given ones in the first empty
+  // seat, and returns its id or -1 if there is none.  Each neighbor
+  // takes its bottle and fork, dirty, at the end of a drink that
+  // leaves it after all of its own neighbors, so the newcomer comes
+  // first and can't close a cycle in the precedence graph.  It starts
+  // once they all have.  Setup is called on it before it starts, to
+  // set it up like everyone else.  Must come after wire.
+  //
+  // leave takes a guest and its bottles away and frees the seat.  The
+  // neighbors it had are put in neighbors if given.
+  //
+  // connect puts a bottle between two seated guests.  The first is
+  // held tranquil in place of a newcomer, the second takes the bottle
+  // the way a newcomer's neighbor does, and then the first learns of
+  // it and goes on.  Must come after start.
+  //
+  // disconnect takes away the bottle between two guests.
+  int join(const std::vector<int>& neighbors, const std::function<void(Philosopher&)>& setup = nullptr);
+  bool leave(int id, std::vector<int> * neighbors = nullptr);
+  bool connect(int first, int second);
+  bool disconnect(int first, int second);
+
+  // Departed guests leave an empty seat behind
   philosopher_vector_t& get_philosophers() { return philosophers_; };
   std::size_t get_minimum_drink_count() const;
+  std::size_t get_total_drink_count() const;
+  std::vector<std::size_t> get_drink_counts() const;
 
+  // Under a simulator max_wait_ms is virtual time
   bool wait_for_minimum_drink_count(int drink_minimum, long long max_wait_ms);
 
+  // Turns on stats for every philosopher.  Must be called before start.
+  void enable_stats();
+
+  // Adds up the stats of every philosopher
+  void get_stats(Philosopher::stats_t& total) const;
+
+  // Logs the totals and the guests that have gone longest without a drink
+  void dump_stats(std::size_t worst = 5);
+
+  // Dumps the stats from a background thread until the table goes away.
+  // Not under a simulator, whose guests run without locks.
+  void dump_stats_every(std::chrono::milliseconds interval);
+
 public:
   // IDrinkListener interface
   void report_drink(int id) override;
 
 private:
-  // This vector contains our philosophers.  Each behaves on its own
+  Table(int philosophers, Logger& log, Executor * executor, Simulator * simulator, int first_id, std::size_t seats);
+
+  void dump_stats_work(std::chrono::milliseconds interval);
+  void log_memory();
+
+  // With members_lock_ held
+  Philosopher * get_seated(int id) const;
+  void wait_for_changes(const std::vector<std::pair<Philosopher *, std::uint64_t>>& changes);
+
+private:
+  // The philosophers live here, each next to the last.  Their bottle
+  // records go in one arena per node the guests were placed on, or
+  // one for everybody.  Whatever was allocated keeps its arena alive.
+  std::shared_ptr<Arena> memory_;
+  std::vector<std::shared_ptr<Arena>> bottle_memory_;
+  std::vector<int> guest_nodes_;   // Only when placed over several nodes
+  bool huge_pages_;
+
+  // Only set when running in pool mode
+  std::unique_ptr<Executor> executor_;
+
+  // Only set when simulating
+  Simulator * simulator_;
+
+  // Whichever of the two we have, if any
+  IScheduler * scheduler_;
+
+  // Everyone our guests send to.  Our own guests come first so a
+  // guest's handle is its index.  Goes away after the philosophers.
+  NeighborArena arena_;
+
+  // The guests making our membership changes unpark this.  Goes away
+  // after them too, as one can still be unparking it after we have
+  // seen the change made.
+  Parker changes_parker_;
+
+  // This vector contains our philosophers.  Each behaves on its own.
+  // A guest's seat is its index, and its id less first_id_.
   philosopher_vector_t philosophers_;
-  std::vector<std::size_t> drink_counts_;
+  int first_id_;
+
+  // Joining and leaving take turns, and stats aren't read while
+  // either is going on
+  mutable std::mutex members_lock_;
+  std::size_t seats_;
+  std::vector<std::size_t> free_seats_;
+  bool started_;
+  bool transport_;
+
+  // Kept up to date as drinks come in so waiting is cheap
+  DrinkCounter drinks_;
+
+  bool stats_;
+  std::mutex dump_lock_;
+  std::condition_variable dump_cv_;
+  bool dump_quit_;
+  std::thread dump_thread_;
 
   Logger& log_;
 };
@@ -0,0 +1,518 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Topology.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the topology generators
+//  The files are mapped and parsed in place so a million edge
+//  graph loads in well under a second.
+//
+
+#include "Topology.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <unordered_set>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static Topology::edge_t make_edge(int a, int b)
+{
+  return (a < b) ? Topology::edge_t(a, b) : Topology::edge_t(b, a);
+}
+
+Topology::edge_vector_t Topology::ring(int guests)
+{
+  edge_vector_t edges;
+  if (guests < 2)
+    return edges;
+
+  // Two guests only have the one bottle between them
+  if (guests == 2)
+  {
+    edges.push_back(make_edge(0, 1));
+    return edges;
+  }
+
+  edges.reserve(static_cast<std::size_t>(guests));
+  for (int i = 0; i < guests; i++)
+    edges.push_back(make_edge(i, (i + 1) % guests));
+
+  return edges;
+}
+
+Topology::edge_vector_t Topology::all(int guests)
+{
+  edge_vector_t edges;
+  if (guests < 2)
+    return edges;
+
+  edges.reserve(static_cast<std::size_t>(guests) * (guests - 1) / 2);
+  for (int i = 0; i < guests; i++)
+    for (int j = i + 1; j < guests; j++)
+      edges.push_back(make_edge(i, j));
+
+  return edges;
+}
+
+Topology::edge_vector_t Topology::random(int guests, int degree, unsigned long long seed)
+{
+  edge_vector_t edges;
+  if (guests < 2 || degree < 1)
+    return edges;
+
+  auto possible = static_cast<unsigned long long>(guests) * (guests - 1) / 2;
+  auto wanted = std::min(possible, static_cast<unsigned long long>(guests) * degree / 2);
+
+  std::mt19937_64 rng(seed);
+  std::uniform_int_distribution<int> pick(0, guests - 1);
+  std::unordered_set<unsigned long long> seen;
+
+  edges.reserve(static_cast<std::size_t>(wanted));
+  while (edges.size() < wanted)
+  {
+    auto a = pick(rng);
+    auto b = pick(rng);
+    if (a == b)
+      continue;
+
+    auto edge = make_edge(a, b);
+    auto key = (static_cast<unsigned long long>(edge.first) << 32) | static_cast<unsigned int>(edge.second);
+    if (seen.insert(key).second)
+      edges.push_back(edge);
+  }
+
+  return edges;
+}
+
+// Columns for a grid as close to square as we can get
+static int get_columns(int guests)
+{
+  auto columns = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(guests))));
+  return columns > 0 ? columns : 1;
+}
+
+Topology::edge_vector_t Topology::grid(int guests)
+{
+  edge_vector_t edges;
+  if (guests < 2)
+    return edges;
+
+  auto columns = get_columns(guests);
+  edges.reserve(static_cast<std::size_t>(guests) * 2);
+  for (int i = 0; i < guests; i++)
+  {
+    if ((i + 1) % columns != 0 && i + 1 < guests)
+      edges.push_back(make_edge(i, i + 1));
+    if (i + columns < guests)
+      edges.push_back(make_edge(i, i + columns));
+  }
+
+  return edges;
+}
+
+Topology::edge_vector_t Topology::torus(int guests)
+{
+  edge_vector_t edges;
+  if (guests < 2)
+    return edges;
+
+  auto columns = get_columns(guests);
+  edges.reserve(static_cast<std::size_t>(guests) * 2);
+  for (int i = 0; i < guests; i++)
+  {
+    // The last row may be short, so wrap within whatever it has
+    auto row_start = i - i % columns;
+    auto row_length = std::min(columns, guests - row_start);
+    edges.push_back(make_edge(i, row_start + (i - row_start + 1) % row_length));
+    edges.push_back(make_edge(i, (i + columns) % guests));
+  }
+
+  // Small tables wrap onto themselves
+  normalize(edges);
+  return edges;
+}
+
+Topology::edge_vector_t Topology::regular(int guests, int degree, unsigned long long seed)
+{
+  edge_vector_t edges;
+  if (guests < 2 || degree < 1)
+    return edges;
+
+  degree = std::min(degree, guests - 1);
+
+  // Pairing model: everyone puts in degree stubs and they are matched
+  // at random.  Pairs that would loop or repeat go back in the pot for
+  // the next round.
+  std::mt19937_64 rng(seed);
+  std::vector<int> stubs;
+  stubs.reserve(static_cast<std::size_t>(guests) * degree);
+  for (int i = 0; i < guests; i++)
+    for (int j = 0; j < degree; j++)
+      stubs.push_back(i);
+
+  std::unordered_set<unsigned long long> seen;
+  edges.reserve(stubs.size() / 2);
+
+  for (int round = 0; round < 100 && stubs.size() > 1; round++)
+  {
+    std::shuffle(stubs.begin(), stubs.end(), rng);
+
+    std::vector<int> left;
+    for (std::size_t i = 0; i + 1 < stubs.size(); i += 2)
+    {
+      auto edge = make_edge(stubs[i], stubs[i + 1]);
+      auto key = (static_cast<unsigned long long>(edge.first) << 32) | static_cast<unsigned int>(edge.second);
+      if (edge.first != edge.second && seen.insert(key).second)
+        edges.push_back(edge);
+      else
+      {
+        left.push_back(stubs[i]);
+        left.push_back(stubs[i + 1]);
+      }
+    }
+
+    stubs.swap(left);
+  }
+
+  return edges;
+}
+
+Topology::edge_vector_t Topology::erdos_renyi(int guests, int degree, unsigned long long seed)
+{
+  edge_vector_t edges;
+  if (guests < 2 || degree < 1)
+    return edges;
+
+  auto p = static_cast<double>(degree) / (guests - 1);
+  if (p >= 1.0)
+    return all(guests);
+
+  std::mt19937_64 rng(seed);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+  edges.reserve(static_cast<std::size_t>(static_cast<double>(guests) * degree / 2 * 1.1));
+
+  // Batagelj-Brandes: jump straight to the next pair that gets an edge
+  // instead of rolling for every pair
+  auto log_q = std::log(1.0 - p);
+  long long v = 1;
+  long long w = -1;
+  while (v < guests)
+  {
+    auto r = uniform(rng);
+    w += 1 + static_cast<long long>(std::floor(std::log(1.0 - r) / log_q));
+    while (w >= v && v < guests)
+    {
+      w -= v;
+      v++;
+    }
+
+    if (v < guests)
+      edges.push_back(make_edge(static_cast<int>(w), static_cast<int>(v)));
+  }
+
+  return edges;
+}
+
+Topology::edge_vector_t Topology::power_law(int guests, int degree, unsigned long long seed)
+{
+  edge_vector_t edges;
+  if (guests < 2)
+    return edges;
+
+  auto links = std::max(1, std::min(degree / 2, guests - 1));
+  std::mt19937_64 rng(seed);
+
+  // Everyone shows up here once per neighbor, so picking uniformly from
+  // it favors the guests with the most neighbors
+  std::vector<int> ends;
+  ends.reserve(static_cast<std::size_t>(guests) * links * 2);
+
+  // Start with a small clique so there is something to attach to
+  for (int i = 0; i <= links; i++)
+    for (int j = i + 1; j <= links && j < guests; j++)
+    {
+      edges.push_back(make_edge(i, j));
+      ends.push_back(i);
+      ends.push_back(j);
+    }
+
+  std::vector<int> targets;
+  for (int i = links + 1; i < guests; i++)
+  {
+    targets.clear();
+    while (static_cast<int>(targets.size()) < links)
+    {
+      auto target = ends[std::uniform_int_distribution<std::size_t>(0, ends.size() - 1)(rng)];
+      if (std::find(targets.begin(), targets.end(), target) == targets.end())
+        targets.push_back(target);
+    }
+
+    for (auto target : targets)
+    {
+      edges.push_back(make_edge(i, target));
+      ends.push_back(i);
+      ends.push_back(target);
+    }
+  }
+
+  return edges;
+}
+
+bool Topology::make(const std::string& name, int guests, edge_vector_t& edges,
+  int degree, unsigned long long seed)
+{
+  if (name == "ring")
+    edges = ring(guests);
+  else if (name == "all")
+    edges = all(guests);
+  else if (name == "random")
+    edges = random(guests, degree, seed);
+  else if (name == "grid")
+    edges = grid(guests);
+  else if (name == "torus")
+    edges = torus(guests);
+  else if (name == "regular")
+    edges = regular(guests, degree, seed);
+  else if (name == "er")
+    edges = erdos_renyi(guests, degree, seed);
+  else if (name == "powerlaw")
+    edges = power_law(guests, degree, seed);
+  else
+    return false;
+
+  return true;
+}
+
+// Read only view of a whole file
+class mapped_file_t
+{
+public:
+  mapped_file_t(const std::string& path)
+    : data_(nullptr)
+    , size_(0)
+#if defined(_WIN32)
+    , file_(INVALID_HANDLE_VALUE)
+    , map_handle_(nullptr)
+#else
+    , file_(-1)
+#endif
+  {
+#if defined(_WIN32)
+    file_ = ::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+      OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+      return;
+
+    LARGE_INTEGER size;
+    if (!::GetFileSizeEx(file_, &size) || size.QuadPart == 0)
+      return;
+
+    map_handle_ = ::CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!map_handle_)
+      return;
+
+    data_ = static_cast<const char *>(::MapViewOfFile(map_handle_, FILE_MAP_READ, 0, 0, 0));
+    if (data_)
+      size_ = static_cast<std::size_t>(size.QuadPart);
+#else
+    file_ = ::open(path.c_str(), O_RDONLY);
+    if (file_ < 0)
+      return;
+
+    struct stat info;
+    if (::fstat(file_, &info) != 0 || info.st_size == 0)
+      return;
+
+    auto mapping = ::mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, file_, 0);
+    if (mapping == MAP_FAILED)
+      return;
+
+    // We read it front to back exactly once
+    ::madvise(mapping, static_cast<std::size_t>(info.st_size), MADV_SEQUENTIAL);
+
+    data_ = static_cast<const char *>(mapping);
+    size_ = static_cast<std::size_t>(info.st_size);
+#endif
+  }
+
+  ~mapped_file_t()
+  {
+#if defined(_WIN32)
+    if (data_)
+      ::UnmapViewOfFile(data_);
+    if (map_handle_)
+      ::CloseHandle(map_handle_);
+    if (file_ != INVALID_HANDLE_VALUE)
+      ::CloseHandle(file_);
+#else
+    if (data_)
+      ::munmap(const_cast<char *>(data_), size_);
+    if (file_ >= 0)
+      ::close(file_);
+#endif
+  }
+
+  // An empty file opens fine but has no data
+  bool is_open() const
+  {
+#if defined(_WIN32)
+    return file_ != INVALID_HANDLE_VALUE;
+#else
+    return file_ >= 0;
+#endif
+  }
+
+  const char * data() const { return data_; };
+  std::size_t size() const { return size_; };
+
+private:
+  const char * data_;
+  std::size_t size_;
+
+#if defined(_WIN32)
+  HANDLE file_;
+  HANDLE map_handle_;
+#else
+  int file_;
+#endif
+
+private:
+  mapped_file_t(const mapped_file_t& rhs) = delete;
+  mapped_file_t& operator =(const mapped_file_t& rhs) = delete;
+};
+
+static bool is_separator(char c)
+{
+  return c == ' ' || c == '\t' || c == ',' || c == ':' || c == '\r';
+}
+
+// Reads the next number on the line.  Stops at the end of the line
+// and at comments.  Anything that isn't a whole id followed by a
+// separator, a comment or the end of the line comes back as -1, and
+// so does an id too big for one past it to fit in an int.
+static bool parse_id(const char *& at, const char * end, int& id)
+{
+  while (at < end && is_separator(*at))
+    at++;
+
+  if (at == end || *at == '#')
+    return false;
+
+  long long value = 0;
+  auto digits = at;
+  for (; at < end && *at >= '0' && *at <= '9'; at++)
+  {
+    if (value <= std::numeric_limits<int>::max())
+      value = value * 10 + (*at - '0');
+  }
+
+  auto whole = (at > digits) && (at == end || is_separator(*at) || *at == '#');
+  while (at < end && !is_separator(*at) && *at != '#')
+    at++;
+
+  id = (whole && value < std::numeric_limits<int>::max()) ? static_cast<int>(value) : -1;
+  return true;
+}
+
+bool Topology::load(const std::string& path, edge_vector_t& edges, int& guests, Logger& log)
+{
+  edges.clear();
+  guests = 0;
+
+  mapped_file_t file(path);
+  if (!file.is_open())
+    return false;
+
+  auto at = file.data();
+  auto end = at + file.size();
+  std::size_t line = 0;
+  while (at < end)
+  {
+    auto line_end = static_cast<const char *>(std::memchr(at, '\n', static_cast<std::size_t>(end - at)));
+    if (!line_end)
+      line_end = end;
+    auto line_start = at;
+    line++;
+
+    // The first number is the guest, everyone after it is a neighbor.
+    // With two numbers this is just an edge.
+    int first;
+    if (parse_id(at, line_end, first))
+    {
+      auto bad = (first < 0);
+      guests = std::max(guests, first + 1);
+
+      int neighbor;
+      while (!bad && parse_id(at, line_end, neighbor))
+      {
+        bad = (neighbor < 0);
+        guests = std::max(guests, neighbor + 1);
+        if (neighbor != first)
+          edges.push_back(make_edge(first, neighbor));
+      }
+
+      // Rather than wire an edge that isn't in the file
+      if (bad)
+      {
+        auto text_end = line_end;
+        while (text_end > line_start && text_end[-1] == '\r')
+          text_end--;
+
+        log.log("Topology file ", path, " line ", line, " has a bad id: ",
+          std::string(line_start, text_end));
+        edges.clear();
+        guests = 0;
+        return false;
+      }
+    }
+
+    at = line_end + 1;
+  }
+
+  // Adjacency lists name every edge from both ends
+  normalize(edges);
+  return true;
+}
+
+void Topology::normalize(edge_vector_t& edges)
+{
+  for (auto& edge : edges)
+    edge = make_edge(edge.first, edge.second);
+
+  edges.erase(std::remove_if(edges.begin(), edges.end(),
+    [](const edge_t& edge) { return edge.first == edge.second; }), edges.end());
+
+  std::sort(edges.begin(), edges.end());
+  edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+}
+
+std::size_t Topology::get_degree(int guests, const edge_vector_t& edges)
+{
+  std::vector<std::size_t> degrees(static_cast<std::size_t>(std::max(guests, 0)), 0);
+  for (auto& edge : edges)
+  {
+    if (edge.first < 0 || edge.second < 0 || edge.first >= guests || edge.second >= guests
+      || edge.first == edge.second)
+      continue;
+
+    degrees[static_cast<std::size_t>(edge.first)]++;
+    degrees[static_cast<std::size_t>(edge.second)]++;
+  }
+
+  return degrees.empty() ? 0 : *std::max_element(degrees.begin(), degrees.end());
+}
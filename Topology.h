@@ -0,0 +1,84 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Topology.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Topology declaration:
+//  These build the graph of who shares a bottle with whom as a
+//  list of edges for Table::wire.  Each edge is listed once with
+//  the lower id first.
+//
+//  Graphs come from the generators below or from a file with
+//  one edge per line ("a b") or one guest per line followed by
+//  its neighbors ("a: b c d").  Blank lines and anything after
+//  a '#' are ignored.
+//
+
+#if !defined(__TOPOLOGY_H__)
+#define __TOPOLOGY_H__
+
+#include "Edge.h"
+#include "Logger.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+class Topology
+{
+public:
+  typedef ::edge_t edge_t;
+  typedef ::edge_vector_t edge_vector_t;
+
+public:
+  // Everyone shares a bottle with the guests on either side
+  static edge_vector_t ring(int guests);
+
+  // Everyone shares a bottle with everyone else
+  static edge_vector_t all(int guests);
+
+  // Random pairs until the average degree is reached
+  static edge_vector_t random(int guests, int degree, unsigned long long seed);
+
+  // Rows of guests as close to square as we can, each sharing with
+  // the guests beside, above and below
+  static edge_vector_t grid(int guests);
+
+  // A grid that wraps around at the edges
+  static edge_vector_t torus(int guests);
+
+  // Everyone has exactly degree neighbors, picked at random.  If
+  // guests * degree is odd one guest ends up a neighbor short.
+  static edge_vector_t regular(int guests, int degree, unsigned long long seed);
+
+  // Erdos-Renyi: every pair shares a bottle with the same probability,
+  // picked so the average is degree
+  static edge_vector_t erdos_renyi(int guests, int degree, unsigned long long seed);
+
+  // Barabasi-Albert: each new guest joins degree / 2 others, favoring
+  // the ones that already have many neighbors
+  static edge_vector_t power_law(int guests, int degree, unsigned long long seed);
+
+  // Builds one of the above by name.  Returns false for a name we don't know.
+  static bool make(const std::string& name, int guests, edge_vector_t& edges,
+    int degree = 4, unsigned long long seed = 0);
+
+  // Reads an edge or adjacency list.  Guests is set to one past the
+  // highest id in the file.  Returns false if the file can't be read,
+  // or logs the line and returns false if an id isn't a whole number
+  // that fits in an int.
+  static bool load(const std::string& path, edge_vector_t& edges, int& guests, Logger& log);
+
+  // Sorts the edges and drops duplicates and self loops
+  static void normalize(edge_vector_t& edges);
+
+  // The most neighbors any guest has
+  static std::size_t get_degree(int guests, const edge_vector_t& edges);
+
+private:
+  Topology() = delete;
+};
+
+#endif // #if !defined(__TOPOLOGY_H__)
@@ -0,0 +1,166 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Trace.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Implementation of the trace class
+//  The file is sized and mapped once up front.  After that the
+//  OS pages the records out on its own schedule, so recording
+//  never makes a system call.
+//
+
+#include "Trace.h"
+
+#include <chrono>
+#include <cstring>
+#include <new>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+constexpr char Trace::file_magic[8];
+constexpr std::uint32_t Trace::file_version;
+constexpr std::uint64_t Trace::chunk_size;
+
+static std::atomic<std::size_t> next_trace_id(1);
+
+static std::uint64_t round_up_power_of_two(std::uint64_t value)
+{
+  std::uint64_t result = Trace::chunk_size;
+  while (result < value)
+    result <<= 1;
+  return result;
+}
+
+Trace::Trace(const std::string& path, std::uint64_t capacity)
+  : id_(next_trace_id++)
+  , header_(nullptr)
+  , records_(nullptr)
+  , mask_(0)
+  , mapping_(nullptr)
+  , mapping_size_(0)
+#if defined(_WIN32)
+  , file_(INVALID_HANDLE_VALUE)
+  , map_handle_(nullptr)
+#else
+  , file_(-1)
+#endif
+{
+  capacity = round_up_power_of_two(capacity);
+  mapping_size_ = sizeof(header_t) + capacity * sizeof(record_t);
+
+#if defined(_WIN32)
+  file_ = ::CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+    nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file_ == INVALID_HANDLE_VALUE)
+    return;
+
+  auto size = static_cast<unsigned long long>(mapping_size_);
+  map_handle_ = ::CreateFileMappingA(file_, nullptr, PAGE_READWRITE,
+    static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+  if (!map_handle_)
+    return;
+
+  mapping_ = ::MapViewOfFile(map_handle_, FILE_MAP_ALL_ACCESS, 0, 0, mapping_size_);
+  if (!mapping_)
+    return;
+#else
+  file_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (file_ < 0)
+    return;
+
+  // The file is sparse until records land in it, which also means
+  // slots that were never written read back as zero
+  if (::ftruncate(file_, static_cast<off_t>(mapping_size_)) != 0)
+    return;
+
+  auto mapping = ::mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED, file_, 0);
+  if (mapping == MAP_FAILED)
+    return;
+
+  mapping_ = mapping;
+#endif
+
+  header_ = new (mapping_) header_t;
+  std::memcpy(header_->magic, file_magic, sizeof(file_magic));
+  header_->version = file_version;
+  header_->record_size = sizeof(record_t);
+  header_->capacity = capacity;
+  header_->ticks_per_ns = Tsc::ticks_per_ns();
+  header_->start_ticks = Tsc::now();
+  header_->start_time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+  header_->cursor = 0;
+
+  mask_ = capacity - 1;
+  records_ = reinterpret_cast<record_t *>(static_cast<char *>(mapping_) + sizeof(header_t));
+}
+
+Trace::~Trace()
+{
+#if defined(_WIN32)
+  if (mapping_)
+  {
+    ::FlushViewOfFile(mapping_, 0);
+    ::UnmapViewOfFile(mapping_);
+  }
+  if (map_handle_)
+    ::CloseHandle(map_handle_);
+  if (file_ != INVALID_HANDLE_VALUE)
+    ::CloseHandle(file_);
+#else
+  if (mapping_)
+    ::munmap(mapping_, mapping_size_);
+  if (file_ >= 0)
+    ::close(file_);
+#endif
+}
+
+const char * Trace::get_event_name(std::uint8_t event)
+{
+  switch (event)
+  {
+  case state_change:
+    return "state";
+  case request_sent:
+    return "request_sent";
+  case request_received:
+    return "request_received";
+  case bottle_sent:
+    return "bottle_sent";
+  case bottle_received:
+    return "bottle_received";
+  case drink:
+    return "drink";
+  case fork_request_sent:
+    return "fork_request_sent";
+  case fork_request_received:
+    return "fork_request_received";
+  case fork_sent:
+    return "fork_sent";
+  case fork_received:
+    return "fork_received";
+  case eating:
+    return "eating";
+  }
+
+  return "unknown";
+}
+
+// Reserves the next chunk of the ring for this thread.  Records
+// from different threads interleave by chunk, so readers sort by
+// timestamp.
+void Trace::refill(chunk_t& chunk)
+{
+  chunk.trace_id = id_;
+  chunk.next = header_->cursor.fetch_add(chunk_size, std::memory_order_relaxed);
+  chunk.end = chunk.next + chunk_size;
+}
@@ -0,0 +1,141 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Trace.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Trace declaration:
+//  This records protocol events as fixed size binary records
+//  into a ring in a memory mapped file.  Threads reserve a
+//  chunk of the ring at a time so recording an event is just
+//  a few stores.  The trace_dump tool turns the file into
+//  text or CSV.
+//
+
+#if !defined(__TRACE_H__)
+#define __TRACE_H__
+
+#include "Tsc.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+class Trace
+{
+public:
+  enum event_type : std::uint8_t
+  {
+    state_change,       // value is the new state
+    request_sent,
+    request_received,
+    bottle_sent,
+    bottle_received,    // value is the dirty flag
+    drink,
+    fork_request_sent,  // The fork events only show up with a demand model
+    fork_request_received,
+    fork_sent,
+    fork_received,
+    eating              // value is 1 when we start eating and 0 when we stop
+  };
+
+  struct record_t
+  {
+    std::uint64_t ticks;       // Zero means the slot was never written
+    std::int32_t philosopher;
+    std::int32_t neighbor;     // -1 when there is no neighbor
+    std::uint8_t event;
+    std::uint8_t value;
+    std::uint8_t reserved[6];
+  };
+
+  // The file starts with this header followed by the ring of records
+  struct header_t
+  {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t record_size;
+    std::uint64_t capacity;           // Records in the ring, a power of two
+    double ticks_per_ns;
+    std::uint64_t start_ticks;
+    std::int64_t start_time_ns;       // System clock at start_ticks
+    std::atomic<std::uint64_t> cursor;  // Records reserved so far
+  };
+
+  static constexpr char file_magic[8] = { 'P', 'H', 'I', 'L', 'T', 'R', 'C', '1' };
+  static constexpr std::uint32_t file_version = 1;
+  static constexpr std::uint64_t chunk_size = 64;
+
+public:
+  // Capacity is rounded up to a power of two
+  Trace(const std::string& path, std::uint64_t capacity = 1 << 20);
+  virtual ~Trace();
+
+public:
+  bool is_open() const { return records_ != nullptr; };
+
+  // Slots handed out so far, a chunk at a time.  Once this passes the
+  // capacity the oldest records have been overwritten.
+  std::uint64_t get_count() const { return header_ ? header_->cursor.load() : 0; };
+
+  void record(event_type event, int philosopher, int neighbor = -1, int value = 0)
+  {
+    if (!records_)
+      return;
+
+    auto& chunk = get_chunk();
+    if (chunk.trace_id != id_ || chunk.next == chunk.end)
+      refill(chunk);
+
+    auto& slot = records_[chunk.next++ & mask_];
+    slot.ticks = Tsc::now();
+    slot.philosopher = philosopher;
+    slot.neighbor = neighbor;
+    slot.event = event;
+    slot.value = static_cast<std::uint8_t>(value);
+  }
+
+  static const char * get_event_name(std::uint8_t event);
+
+private:
+  // Where this thread is writing in the ring
+  struct chunk_t
+  {
+    std::size_t trace_id;
+    std::uint64_t next;
+    std::uint64_t end;
+  };
+
+  static chunk_t& get_chunk()
+  {
+    static thread_local chunk_t chunk = { 0, 0, 0 };
+    return chunk;
+  }
+
+  void refill(chunk_t& chunk);
+
+private:
+  // Tells apart traces that happen to reuse the same address
+  const std::size_t id_;
+
+  header_t * header_;
+  record_t * records_;
+  std::uint64_t mask_;
+
+  void * mapping_;
+  std::size_t mapping_size_;
+
+#if defined(_WIN32)
+  void * file_;
+  void * map_handle_;
+#else
+  int file_;
+#endif
+
+private:
+  Trace(const Trace& rhs) = delete;
+  Trace& operator =(const Trace& rhs) = delete;
+};
+
+#endif // #if !defined(__TRACE_H__)
@@ -0,0 +1,71 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Tsc.h
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Tsc declaration:
+//  This is a cheap timestamp for hot paths.  On x86 it reads
+//  the time stamp counter, anywhere else it falls back to the
+//  steady clock in nanoseconds.  Converting ticks to real time
+//  is left to whoever reads the timestamps later.
+//
+
+#if !defined(__TSC_H__)
+#define __TSC_H__
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+class Tsc
+{
+public:
+  static std::uint64_t now()
+  {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+  }
+
+  // Measured once against the steady clock.  The first call takes
+  // about 10ms so it should be made off the hot path.
+  static double ticks_per_ns()
+  {
+    static const double rate = calibrate();
+    return rate;
+  }
+
+private:
+  static double calibrate()
+  {
+    auto start_time = std::chrono::steady_clock::now();
+    auto start_ticks = now();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    auto end_ticks = now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start_time).count();
+
+    if (elapsed <= 0 || end_ticks <= start_ticks)
+      return 1.0;
+
+    return static_cast<double>(end_ticks - start_ticks) / static_cast<double>(elapsed);
+  }
+
+private:
+  Tsc() = delete;
+};
+
+#endif // #if !defined(__TSC_H__)
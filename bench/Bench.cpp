@@ -0,0 +1,421 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// Bench.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Benchmark suite for whole tables:
+//  Sweeps guest counts, topologies and the wait option, runs each
+//  combination a few times and reports throughput, thirsty to
+//  drinking latency, fairness and what the run cost the OS as JSON.
+//  Giving more than one demand model compares them on the same
+//  tables.
+//
+
+#include "../Demand.h"
+#include "../Duration.h"
+#include "../FixedTable.h"
+#include "../GuardKernel.h"
+#include "../Table.h"
+#include "../Topology.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+struct options_t
+{
+  std::vector<int> guest_counts;
+  std::vector<std::string> topologies;
+  std::vector<std::string> demands;
+  int runs;
+  int drinks;
+  int degree;
+  bool threads;
+  bool fixed;
+  long long timeout_ms;
+  std::string tranquil;
+  std::string drinking;
+  std::string out_path;
+  std::string log_path;
+};
+
+struct usage_t
+{
+  double user_ms;
+  double system_ms;
+  long voluntary;
+  long involuntary;
+};
+
+static usage_t get_usage()
+{
+  rusage usage;
+  ::getrusage(RUSAGE_SELF, &usage);
+
+  usage_t result;
+  result.user_ms = usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3;
+  result.system_ms = usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+  result.voluntary = usage.ru_nvcsw;
+  result.involuntary = usage.ru_nivcsw;
+  return result;
+}
+
+// Runs one table of FixedPhilosophers, for with_degree()
+struct fixed_run_t
+{
+  const options_t& options;
+  int guests;
+  const Topology::edge_vector_t& edges;
+  bool wait;
+  const IDurationModel * tranquil;
+  const IDurationModel * drinking;
+  std::uint64_t seed;
+  Logger& log;
+
+  bool reached;
+  std::chrono::steady_clock::duration elapsed;
+  std::vector<std::size_t> counts;
+
+  template <std::size_t Degree>
+  void run()
+  {
+    FixedTable<Degree> table(guests, log);
+    for (std::size_t i = 0; i < table.size(); i++)
+    {
+      table[i].set_wait(wait);
+      table[i].set_seed(seed);
+      table[i].set_tranquil(wait ? tranquil : nullptr);
+      table[i].set_drinking(drinking);
+    }
+
+    table.wire(edges);
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    table.start();
+    reached = table.wait_for_minimum_drink_count(options.drinks, options.timeout_ms);
+
+    elapsed = std::chrono::steady_clock::now() - start_time;
+    counts = table.get_drink_counts();
+  }
+};
+
+// Every topology gets every guest count except all, which has a
+// bottle for every pair and gets out of hand quickly
+static bool should_run(const std::string& topology, int guests)
+{
+  return topology != "all" || guests <= 100;
+}
+
+static void run_one(const options_t& options, int guests, const std::string& topology,
+  const std::string& demand_spec, bool wait, int run, int log_fd, std::ostream& out)
+{
+  Logger log(4096, Logger::drop, log_fd);
+
+  Topology::edge_vector_t edges;
+  Topology::make(topology, guests, edges, options.degree, static_cast<unsigned long long>(run + 1));
+
+  // The models have to outlive the table
+  std::unique_ptr<IDemandModel> demand;
+  Demand::make(demand_spec, demand, static_cast<unsigned long long>(run + 1));
+
+  std::unique_ptr<IDurationModel> tranquil;
+  std::unique_ptr<IDurationModel> drinking;
+  if (!options.tranquil.empty())
+    Duration::make(options.tranquil, tranquil);
+  if (!options.drinking.empty())
+    Duration::make(options.drinking, drinking);
+
+  bool reached;
+  std::chrono::steady_clock::duration elapsed;
+  std::vector<std::size_t> counts;
+  Philosopher::stats_t stats;
+  auto& latency = stats.thirsty_time;
+
+  // The fixed guests keep no stats, so their latencies come out as zero
+  fixed_run_t fixed{ options, guests, edges, wait, tranquil.get(), drinking.get(),
+    static_cast<std::uint64_t>(run + 1), log, false, {}, {} };
+  bool is_fixed = options.fixed && !demand && Topology::get_degree(guests, edges) <= 16;
+
+  auto usage_start = get_usage();
+
+  if (is_fixed)
+  {
+    with_degree(Topology::get_degree(guests, edges), fixed);
+    reached = fixed.reached;
+    elapsed = fixed.elapsed;
+    counts = fixed.counts;
+  }
+  else
+  {
+    Table table(guests, log, !options.threads);
+    table.enable_stats();
+
+    auto& philosophers = table.get_philosophers();
+    for (auto& philosopher : philosophers)
+    {
+      philosopher->set_wait(wait);
+      philosopher->set_demand(demand.get());
+      philosopher->set_seed(static_cast<std::uint64_t>(run + 1));
+      philosopher->set_tranquil(wait ? tranquil.get() : nullptr);
+      philosopher->set_drinking(drinking.get());
+    }
+
+    table.wire(edges, true);
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    table.start();
+    reached = table.wait_for_minimum_drink_count(options.drinks, options.timeout_ms);
+
+    elapsed = std::chrono::steady_clock::now() - start_time;
+    counts = table.get_drink_counts();
+    table.get_stats(stats);
+  }
+
+  auto usage_end = get_usage();
+
+  // Fairness: how far apart the guests ended up
+  double total = 0;
+  double squares = 0;
+  std::size_t min_count = counts.empty() ? 0 : counts[0];
+  std::size_t max_count = min_count;
+  for (auto count : counts)
+  {
+    total += static_cast<double>(count);
+    squares += static_cast<double>(count) * static_cast<double>(count);
+    min_count = std::min(min_count, count);
+    max_count = std::max(max_count, count);
+  }
+
+  auto n = static_cast<double>(counts.size());
+  auto mean = n ? total / n : 0.0;
+  auto variance = n ? squares / n - mean * mean : 0.0;
+  auto cv = mean > 0 ? std::sqrt(std::max(variance, 0.0)) / mean : 0.0;
+  auto jain = squares > 0 ? (total * total) / (n * squares) : 1.0;
+
+  auto seconds = std::chrono::duration<double>(elapsed).count();
+  auto rate = Tsc::ticks_per_ns();
+  auto to_ns = [rate](std::uint64_t ticks) { return static_cast<double>(ticks) / rate; };
+
+  out << std::fixed << std::setprecision(3)
+    << "    {\"guests\": " << guests
+    << ", \"topology\": \"" << topology << "\""
+    << ", \"edges\": " << edges.size()
+    << ", \"demand\": \"" << demand_spec << "\""
+    << ", \"wait\": " << (wait ? "true" : "false")
+    << ", \"scheduling\": \"" << (is_fixed ? "fixed" : (options.threads ? "threads" : "pool")) << "\""
+    << ", \"run\": " << run
+    << ", \"reached\": " << (reached ? "true" : "false")
+    << ",\n     \"elapsed_ms\": " << seconds * 1e3
+    << ", \"drinks\": " << static_cast<std::size_t>(total)
+    << ", \"drinks_per_sec\": " << (seconds > 0 ? total / seconds : 0.0)
+    << ",\n     \"latency_ns\": {\"p50\": " << to_ns(latency.get_percentile(0.5))
+    << ", \"p99\": " << to_ns(latency.get_percentile(0.99))
+    << ", \"p999\": " << to_ns(latency.get_percentile(0.999))
+    << ", \"max\": " << to_ns(latency.get_max()) << "}"
+    << ", \"bottle_rtt_ns\": {\"p50\": " << to_ns(stats.bottle_time.get_percentile(0.5))
+    << ", \"p99\": " << to_ns(stats.bottle_time.get_percentile(0.99)) << "}"
+    << ",\n     \"fairness\": {\"min\": " << min_count
+    << ", \"max\": " << max_count
+    << ", \"mean\": " << mean
+    << ", \"cv\": " << cv
+    << ", \"jain\": " << jain << "}"
+    << ",\n     \"cpu_ms\": {\"user\": " << usage_end.user_ms - usage_start.user_ms
+    << ", \"system\": " << usage_end.system_ms - usage_start.system_ms << "}"
+    << ", \"context_switches\": {\"voluntary\": " << usage_end.voluntary - usage_start.voluntary
+    << ", \"involuntary\": " << usage_end.involuntary - usage_start.involuntary << "}}";
+}
+
+int main(int argc, const char * argv[])
+{
+  options_t options;
+  options.guest_counts = { 2, 10, 100, 1000 };
+  options.topologies = { "ring", "all", "random" };
+  options.demands = { "all" };
+  options.runs = 3;
+  options.drinks = 20;
+  options.degree = 4;
+  options.threads = false;
+  options.fixed = false;
+  options.timeout_ms = 60000;
+  options.log_path = "/dev/null";
+
+  bool saw_demand = false;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+
+    if (arg == "quick")
+      options.guest_counts = { 2, 10, 100, 1000 };
+    else if (arg == "full")
+      options.guest_counts = { 2, 10, 100, 1000, 10000, 100000 };
+    else if (arg == "threads")
+      options.threads = true;
+    else if (arg == "fixed")
+      options.fixed = true;
+    else if (arg.compare(0, 5, "runs=") == 0)
+      options.runs = ::atoi(arg.c_str() + 5);
+    else if (arg.compare(0, 7, "drinks=") == 0)
+      options.drinks = ::atoi(arg.c_str() + 7);
+    else if (arg.compare(0, 7, "degree=") == 0)
+      options.degree = ::atoi(arg.c_str() + 7);
+    else if (arg.compare(0, 8, "timeout=") == 0)
+      options.timeout_ms = ::atoll(arg.c_str() + 8) * 1000;
+    else if (arg.compare(0, 7, "guests=") == 0)
+      options.guest_counts = { ::atoi(arg.c_str() + 7) };
+    else if (arg.compare(0, 9, "topology=") == 0)
+      options.topologies = { arg.substr(9) };
+    else if (arg.compare(0, 7, "demand=") == 0)
+    {
+      // Can be given more than once
+      if (!saw_demand)
+        options.demands.clear();
+      saw_demand = true;
+      options.demands.push_back(arg.substr(7));
+    }
+    else if (arg.compare(0, 9, "tranquil=") == 0)
+      options.tranquil = arg.substr(9);
+    else if (arg.compare(0, 9, "drinking=") == 0)
+      options.drinking = arg.substr(9);
+    else if (arg.compare(0, 4, "out=") == 0)
+      options.out_path = arg.substr(4);
+    else if (arg.compare(0, 4, "log=") == 0)
+      options.log_path = arg.substr(4);
+    else
+    {
+      std::cout << "Usage: philo_bench [quick | full] [threads | fixed] [runs=N] [drinks=N] [degree=N] [timeout=seconds]" << std::endl
+        << "                   [guests=N] [topology=ring|all|random|grid|torus|regular|er|powerlaw]" << std::endl
+        << "                   [demand=all|random=P|fixed=K|schedule=path ...] [tranquil=time] [drinking=time]" << std::endl
+        << "                   [out=file] [log=file]" << std::endl
+        << "  quick - 2 to 1000 guests (the default)" << std::endl
+        << "  full  - 2 to 100000 guests" << std::endl
+        << "  threads - one thread per guest instead of a pool" << std::endl
+        << "  fixed - guests compiled for the graph's degree, up to 16, when every drink needs every bottle" << std::endl
+        << "  demand - which bottles each drink needs, all by default.  Repeat to compare." << std::endl
+        << "  tranquil - replaces the 5 to 25 ms of the wait runs" << std::endl
+        << "  drinking - how long each drink takes, instant by default" << std::endl
+        << "    time is constant=MS, uniform=MIN:MAX, exp=MEAN or pareto=MIN:ALPHA in milliseconds" << std::endl
+        << "  out - where the JSON goes, stdout by default" << std::endl
+        << "  log - where the philosophers log, /dev/null by default" << std::endl;
+
+      return 0;
+    }
+  }
+
+  Topology::edge_vector_t edges;
+  for (auto& topology : options.topologies)
+  {
+    if (!Topology::make(topology, 0, edges))
+    {
+      std::cerr << "Unknown topology " << topology << std::endl;
+      return 1;
+    }
+  }
+
+  std::unique_ptr<IDemandModel> unused;
+  for (auto& demand : options.demands)
+  {
+    if (!Demand::make(demand, unused))
+    {
+      std::cerr << "Unknown or unreadable demand model " << demand << std::endl;
+      return 1;
+    }
+  }
+
+  std::unique_ptr<IDurationModel> unused_duration;
+  for (auto spec : { &options.tranquil, &options.drinking })
+  {
+    if (!spec->empty() && !Duration::make(*spec, unused_duration))
+    {
+      std::cerr << "Unknown duration model " << *spec << std::endl;
+      return 1;
+    }
+  }
+
+  // Threads don't scale to the big tables
+  if (options.threads)
+  {
+    std::vector<int> counts;
+    for (auto guests : options.guest_counts)
+      if (guests <= 1000)
+        counts.push_back(guests);
+    options.guest_counts = counts;
+  }
+
+  int log_fd = ::open(options.log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (log_fd < 0)
+  {
+    std::cerr << "Could not open " << options.log_path << std::endl;
+    return 1;
+  }
+
+  std::ofstream out_file;
+  if (!options.out_path.empty())
+  {
+    out_file.open(options.out_path);
+    if (!out_file)
+    {
+      std::cerr << "Could not open " << options.out_path << std::endl;
+      return 1;
+    }
+  }
+
+  std::ostream& out = out_file.is_open() ? out_file : std::cout;
+
+  out << "{\n  \"config\": {\"cores\": " << std::thread::hardware_concurrency()
+    << ", \"kernel\": \"" << GuardKernel::get_name(GuardKernel::get_best_isa()) << "\""
+    << ", \"drinks\": " << options.drinks
+    << ", \"runs\": " << options.runs
+    << ", \"degree\": " << options.degree
+    << ", \"tranquil\": \"" << options.tranquil << "\""
+    << ", \"drinking\": \"" << options.drinking << "\"},\n"
+    << "  \"results\": [\n";
+
+  bool first = true;
+  for (auto& topology : options.topologies)
+  {
+    for (auto guests : options.guest_counts)
+    {
+      if (!should_run(topology, guests))
+        continue;
+
+      for (auto& demand : options.demands)
+      {
+        for (auto wait : { false, true })
+        {
+          for (int run = 0; run < options.runs; run++)
+          {
+            std::cerr << topology << " guests=" << guests << " demand=" << demand
+              << " wait=" << wait << " run=" << run << std::endl;
+
+            if (!first)
+              out << ",\n";
+            first = false;
+
+            run_one(options, guests, topology, demand, wait, run, log_fd, out);
+            out.flush();
+          }
+        }
+      }
+    }
+  }
+
+  out << "\n  ]\n}\n";
+
+  ::close(log_fd);
+  return 0;
+}
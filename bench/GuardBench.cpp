@@ -0,0 +1,127 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// GuardBench.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Microbenchmark for the guard kernels:
+//  Times the R1, both R2 and the drink test kernels for each instruction
+//  set the CPU supports across a range of neighbor counts and
+//  reports the speedup over the scalar version.
+//
+
+#include "../GuardKernel.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+typedef GuardKernel::word_t word_t;
+
+struct bottles_t
+{
+  std::vector<word_t> need;
+  std::vector<word_t> reqb;
+  std::vector<word_t> bot;
+  std::vector<word_t> dirty;
+  std::vector<word_t> fire;
+};
+
+static bottles_t make_bottles(std::size_t words, std::mt19937_64& rng)
+{
+  bottles_t bottles;
+  for (auto bits : { &bottles.need, &bottles.reqb, &bottles.bot, &bottles.dirty, &bottles.fire })
+    bits->resize(words);
+
+  for (std::size_t i = 0; i < words; i++)
+  {
+    bottles.need[i] = ~word_t(0);
+    bottles.reqb[i] = rng();
+    bottles.bot[i] = rng();
+    bottles.dirty[i] = rng();
+  }
+
+  return bottles;
+}
+
+// Runs one pass of everything a thirsty step does.  The kernels are
+// branch free so the cost doesn't depend on how many guards fire.
+static double time_kernel(const GuardKernel::table_t& kernel, bottles_t bottles, std::size_t iterations)
+{
+  auto words = bottles.need.size();
+  std::size_t sink = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < iterations; i++)
+  {
+    sink += kernel.request(bottles.need.data(), bottles.reqb.data(), bottles.bot.data(),
+      bottles.fire.data(), words);
+    sink += kernel.send(bottles.reqb.data(), bottles.bot.data(), bottles.need.data(),
+      bottles.dirty.data(), (i & 1) != 0, bottles.fire.data(), words);
+    sink += kernel.release(bottles.reqb.data(), bottles.bot.data(), bottles.need.data(),
+      bottles.dirty.data(), (i & 1) != 0, bottles.fire.data(), words);
+    sink += kernel.satisfied(bottles.need.data(), bottles.bot.data(), words);
+
+    // Hand the tokens back so every iteration has work to do
+    bottles.reqb[i % words] = ~word_t(0);
+    bottles.bot[i % words] = ~word_t(0);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  // Keep the optimizer from throwing the work away
+  if (sink == static_cast<std::size_t>(-1))
+    std::cout << sink;
+
+  return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+static void print_row(std::size_t neighbors, const char * name, double ns, double scalar_ns)
+{
+  std::cout << std::setw(10) << neighbors
+    << std::setw(10) << name
+    << std::setw(14) << std::fixed << std::setprecision(1) << ns
+    << std::setw(9) << std::setprecision(2) << (scalar_ns / ns) << "x" << std::endl;
+}
+
+int main(int argc, const char * argv[])
+{
+  // Total bitset words to run through per measurement
+  std::size_t budget = (argc > 1) ? static_cast<std::size_t>(::atoll(argv[1])) : (std::size_t(1) << 26);
+
+  std::mt19937_64 rng(42);
+
+  std::cout << "Best kernel: " << GuardKernel::get_name(GuardKernel::get_best_isa()) << std::endl;
+  std::cout << std::setw(10) << "neighbors"
+    << std::setw(10) << "isa"
+    << std::setw(14) << "ns/step"
+    << std::setw(10) << "speedup" << std::endl;
+
+  for (std::size_t neighbors : { 64, 256, 512, 1024, 4096, 16384, 65536 })
+  {
+    auto words = neighbors / Bitset::word_bits;
+    auto bottles = make_bottles(words, rng);
+    auto iterations = budget / words;
+
+    double scalar_ns = 0;
+    for (auto which : { GuardKernel::scalar, GuardKernel::avx2, GuardKernel::avx512 })
+    {
+      if (!GuardKernel::is_supported(which))
+        continue;
+
+      auto ns = time_kernel(GuardKernel::get(which), bottles, iterations);
+      if (which == GuardKernel::scalar)
+        scalar_ns = ns;
+
+      print_row(neighbors, GuardKernel::get_name(which), ns, scalar_ns);
+    }
+
+    // What the philosophers actually use for this many neighbors
+    print_row(neighbors, "selected", time_kernel(GuardKernel::select(words), bottles, iterations), scalar_ns);
+  }
+
+  return 0;
+}
@@ -11,10 +11,26 @@
 //  * Runs the test
 //
 
+#include "Demand.h"
+#include "Duration.h"
+#include "FixedTable.h"
+#include "Partition.h"
 #include "Philosopher.h"
+#include "ShmTransport.h"
+#include "SocketTransport.h"
 #include "Table.h"
+#include "Topology.h"
+#include "Trace.h"
 
+#include <algorithm>
 #include <iostream>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 void test_two_philosophers(Logger& log)
 {
@@ -41,94 +57,415 @@ void test_two_philosophers(Logger& log)
   log.log("Philosophers split the bottle and the request successfully.");
 }
 
+// Everything the command line asks for.  main fills it in as it
+// reads the arguments and then makes the models, the simulator, the
+// transport and the trace from the specs.
+struct test_options_t
+{
+  int philosophers = 0;
+  int drink_count = 0;
+  std::string topology = "all";
+  std::string topology_path;
+  int degree = 4;
+  unsigned long long seed = 1;
+  bool wait = false;
+  bool pool = false;
+  std::size_t workers = 0;
+  std::string trace_path;
+  std::string demand_spec = "all";
+  std::string tranquil_spec;
+  std::string drinking_spec;
+  bool simulate = false;
+  std::string delay_spec;
+  int shards = 0;
+  int shard = -1;
+  std::string shm_name = "/philo";
+  std::string net_address;
+  long long flush_us = 100;
+  bool partition = false;
+  bool pin = false;
+  bool huge = false;
+  bool fixed = false;
+  long long stats_ms = -1;   // Negative means no stats, zero means only at the end
+  long long churn_ms = 0;
+
+  // Made from the above, and owned by main
+  Simulator * simulator = nullptr;
+  ITransport * transport = nullptr;
+  Trace * trace = nullptr;
+  IDemandModel * demand = nullptr;
+  const IDurationModel * tranquil = nullptr;
+  const IDurationModel * drinking = nullptr;
+};
+
 template<typename Rep, typename Period>
-void run_test(int guest_count, int drink_count, bool ring, bool wait, std::chrono::duration<Rep, Period> max_wait, Logger& log)
+void run_test(const test_options_t& options, const Topology::edge_vector_t& edges, std::chrono::duration<Rep, Period> max_wait, Logger& log)
 {
+  auto guest_count = options.philosophers;
+  auto drink_count = options.drink_count;
+  auto simulator = options.simulator;
+  auto transport = options.transport;
+  auto churn_ms = options.churn_ms;
+
+  // With a transport we only seat our share of the guests
+  int first_id = transport ? transport->get_first_guest() : 0;
+  int seated_count = transport ? transport->get_guest_count() : guest_count;
+  auto max_wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(max_wait);
+
   log.log("Starting test.");
   log.log("Philosophers: ", guest_count);
+  if (transport)
+    log.log("seated here: ", first_id, " to ", first_id + seated_count - 1);
   log.log("drink_count: ", drink_count);
-  log.log("configuration: ", (ring ? "ring" : "all"));
+  log.log("configuration: ", options.topology, " (", edges.size(), " bottles)");
+  log.log("scheduling: ", (simulator ? "simulated" : (options.pool ? "pool" : "threads")));
+  log.log("demand: ", (options.demand ? "subsets" : "all"));
 
   // Set the guests at the table
-  Table table(guest_count, log);
+  std::unique_ptr<Table> seated(simulator
+    ? new Table(guest_count, log, *simulator)
+    : new Table(seated_count, log, options.pool, options.workers, first_id));
+  auto& table = *seated;
 
-  // Now introduce all philosophers to their neighbors
   auto& guests = table.get_philosophers();
 
-  // Do we tell the quests to wait?
-  if (wait)
-    for (auto& guest : guests)
-      guest->set_wait(true);
+  // Everyone gets the same setup, including anyone who joins later
+  auto setup = [&options](Philosopher& guest)
+  {
+    // Do we tell the quests to wait?
+    if (options.wait)
+      guest.set_wait(true);
+    if (options.trace)
+      guest.set_trace(options.trace);
+    if (options.demand)
+      guest.set_demand(options.demand);
+
+    guest.set_seed(options.seed);
+    guest.set_tranquil(options.tranquil);
+    guest.set_drinking(options.drinking);
+  };
+
+  for (auto& guest : guests)
+    setup(*guest);
+
+  if (options.stats_ms >= 0)
+    table.enable_stats();
+  if (options.stats_ms > 0)
+    table.dump_stats_every(std::chrono::milliseconds(options.stats_ms));
+
+  // Keep neighbors on the same worker or core.  Placing first lets the
+  // bottles be laid out on each guest's node.
+  if (options.partition || options.pin)
+    table.place(edges, options.pin, options.seed);
+
+  // Now introduce all philosophers to their neighbors
+  table.set_huge_pages(options.huge);
+  table.wire(edges, true, transport);
 
-  if (ring)
+  if (transport)
   {
-    for (std::size_t i = 1; i < guests.size(); i++)
+    // Nobody starts until every shard is seated
+    transport->start();
+    if (!transport->barrier(max_wait_ms))
     {
-      guests[i]->introduce_neighbor(guests[i - 1]);
-      guests[i]->introduce_neighbor(guests[(i + 1) % guests.size()]);
+      log.log("Gave up waiting for the other shards to be seated.");
+      return;
     }
   }
-  else // all configuration
+
+  auto start_time = std::chrono::steady_clock::now();
+
+  if (churn_ms > 0 && (simulator || transport))
   {
-    for (std::size_t i = 1; i < guests.size(); i++)
-      for (std::size_t j = 0; j < guests.size(); j++)
-        if (i != j)
-          guests[i]->introduce_neighbor(guests[j]);
+    log.log("Can only churn guests on threads or a pool.");
+    churn_ms = 0;
   }
 
-  auto start_time = std::chrono::system_clock::now();
-
   table.start();
-  bool success = table.wait_for_minimum_drink_count(drink_count,
-    std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::minutes(5)).count());
+  bool success = table.wait_for_minimum_drink_count(drink_count, churn_ms > 0 ? churn_ms : max_wait_ms.count());
 
-  if (!success)
+  // Swap a random guest for a newcomer next to the same neighbors and
+  // move a random bottle between two other guests every churn interval
+  // until everyone has had their drinks.  The newcomer takes the seat
+  // that was just freed, so the ids and the edges stay the same.
+  if (churn_ms > 0)
   {
+    Random random(options.seed, ~std::uint64_t(0));
+    auto pick = [&random, first_id, seated_count]()
+    {
+      return first_id + static_cast<int>(random.next() % static_cast<std::uint64_t>(seated_count));
+    };
+
+    Topology::edge_vector_t bottles(edges);
+    std::size_t replaced = 0;
+    std::size_t moved = 0;
+    while (!success && std::chrono::steady_clock::now() - start_time < max_wait)
+    {
+      std::vector<int> neighbors;
+      if (table.leave(pick(), &neighbors) && table.join(neighbors, setup) >= 0)
+        replaced++;
+
+      auto first = pick();
+      auto second = pick();
+      auto bottle = Topology::edge_t(std::min(first, second), std::max(first, second));
+      auto at = std::lower_bound(bottles.begin(), bottles.end(), bottle);
+      if (!bottles.empty() && first != second && (at == bottles.end() || *at != bottle))
+      {
+        auto old = bottles.begin() + static_cast<std::ptrdiff_t>(random.next() % bottles.size());
+        if (table.disconnect(old->first, old->second))
+          bottles.erase(old);
+        if (table.connect(first, second))
+        {
+          bottles.insert(std::lower_bound(bottles.begin(), bottles.end(), bottle), bottle);
+          moved++;
+        }
+      }
+
+      success = table.wait_for_minimum_drink_count(drink_count, churn_ms);
+    }
+
+    log.log("Replaced ", replaced, " guests and moved ", moved, " bottles while running.");
+  }
+
+  if (!success)
     log.log("Failed to reach the drink count requirement.");
-    return;
+  else
+  {
+    auto elapsed = std::chrono::steady_clock::now() - start_time;
+    log.log("Reached the drink count in ",
+      std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(), "ms.");
+  }
+
+  // Our guests have to keep passing bottles until the other shards are done too
+  if (transport)
+  {
+    log.log("Waiting for the other shards to finish.");
+    if (!transport->barrier(max_wait_ms))
+      log.log("Gave up waiting for the other shards to finish.");
+  }
+
+  if (simulator)
+    log.log("Simulated ", std::chrono::duration<double, std::milli>(simulator->get_elapsed()).count(),
+      "ms in ", simulator->get_event_count(), " events and ", simulator->get_message_count(), " messages.");
+
+  if (options.stats_ms >= 0)
+    table.dump_stats();
+}
+
+// Runs the same test on FixedPhilosophers, for with_degree()
+struct fixed_test_t
+{
+  const test_options_t& options;
+  const Topology::edge_vector_t& edges;
+  Logger& log;
+
+  template <std::size_t Degree>
+  void run()
+  {
+    log.log("Starting test.");
+    log.log("Philosophers: ", options.philosophers);
+    log.log("drink_count: ", options.drink_count);
+    log.log("scheduling: fixed degree ", Degree);
+
+    FixedTable<Degree> table(options.philosophers, log, options.workers);
+    for (std::size_t i = 0; i < table.size(); i++)
+    {
+      table[i].set_wait(options.wait);
+      table[i].set_seed(options.seed);
+      table[i].set_tranquil(options.tranquil);
+      table[i].set_drinking(options.drinking);
+    }
+
+    table.wire(edges);
+    if (options.partition || options.pin)
+      table.place(edges, options.seed);
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    table.start();
+    bool success = table.wait_for_minimum_drink_count(options.drink_count, std::chrono::milliseconds(std::chrono::minutes(5)).count());
+
+    if (!success)
+      log.log("Failed to reach the drink count requirement.");
+    else
+    {
+      auto elapsed = std::chrono::steady_clock::now() - start_time;
+      log.log("Reached the drink count in ",
+        std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(), "ms.");
+    }
+  }
+};
+
+#if !defined(_WIN32)
+// Runs a copy of ourselves for every shard with the same arguments
+// and waits for them all
+int run_shards(int argc, const char * argv[], int shards)
+{
+  auto name = "/philo-" + std::to_string(::getpid());
+  ShmTransport::remove(name);
+
+  std::vector<pid_t> children;
+  for (int i = 0; i < shards; i++)
+  {
+    auto shard_arg = "shard=" + std::to_string(i) + "/" + std::to_string(shards);
+    auto shm_arg = "shm=" + name;
+
+    std::vector<char *> args;
+    for (int a = 0; a < argc; a++)
+      args.push_back(const_cast<char *>(argv[a]));
+    args.push_back(&shard_arg[0]);
+    args.push_back(&shm_arg[0]);
+    args.push_back(nullptr);
+
+    auto pid = ::fork();
+    if (pid == 0)
+    {
+      ::execv("/proc/self/exe", args.data());
+      ::execv(argv[0], args.data());
+      ::_exit(127);
+    }
+
+    if (pid > 0)
+      children.push_back(pid);
   }
 
-  auto elapsed = std::chrono::system_clock::now() - start_time;
-  log.log("Reached the drink count in ",
-    std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(), "ms.");
+  int result = (children.size() == static_cast<std::size_t>(shards)) ? 0 : 1;
+  for (auto pid : children)
+  {
+    int status = 0;
+    if (::waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      result = 1;
+  }
+
+  // In case a shard died before it could clean up
+  ShmTransport::remove(name);
+  return result;
 }
+#endif
 
 int main(int argc, const char * argv[])
 {
   if (argc < 3)
   {
-    std::cout << "Usage: philo <philosophers> <drink_count> [all | ring] [wait]" << std::endl
+    std::cout << "Usage: philo <philosophers> <drink_count> [all | ring | <generator> | file=path] [degree=N] [seed=N]" << std::endl
+      << "             [wait] [pool[=workers]] [demand=model] [tranquil=time] [drinking=time]" << std::endl
+      << "             [sim] [delay=time] [shards=N] [shard=I/N shm=name]" << std::endl
+      << "             [net=address] [flush=us] [partition] [pin] [huge] [fixed] [trace=file] [stats[=ms]]" << std::endl
+      << "             [churn=ms]" << std::endl
       << "  philosophers - must specify at least 2 philosophers" << std::endl
       << "  drink_count - minimum number of drinks before exiting (5 minute limit)" << std::endl
       << std::endl
       << "  all  - philosophers coordinate with all neighbors" << std::endl
       << "  ring - philosophers only coordinate with adjacent neighbors" << std::endl
-      << "  wait - philosopher will be tranquil between 5 and 25 ms after eating" << std::endl;
+      << "  generator - grid, torus, random, regular, er or powerlaw with about degree neighbors each" << std::endl
+      << "  file=path - edge list (a b) or adjacency list (a: b c) to read the neighbors from" << std::endl
+      << "  wait - philosopher will be tranquil between 5 and 25 ms after eating" << std::endl
+      << "  pool - philosophers share a pool of one thread per core instead of one thread each" << std::endl
+      << "  pool=workers - same as pool but with the given number of threads" << std::endl
+      << "  demand=all - every drink needs every bottle (the default)" << std::endl
+      << "  demand=random=P - every drink needs each bottle with probability P" << std::endl
+      << "  demand=fixed=K - every drink needs K bottles picked at random" << std::endl
+      << "  demand=schedule=path - replay the bottles from a file of \"guest: neighbors\" lines" << std::endl
+      << "  tranquil=time - how long to stay tranquil after drinking, overrides wait" << std::endl
+      << "  drinking=time - how long a drink takes, instant by default" << std::endl
+      << "    time is constant=MS, uniform=MIN:MAX, exp=MEAN or pareto=MIN:ALPHA in milliseconds" << std::endl
+      << "  sim - run on a discrete event simulator in virtual time on this thread" << std::endl
+      << "  delay=time - how long a message takes to arrive under sim, instant by default" << std::endl
+      << "  shards=N - split the guests across N processes that pass bottles through shared memory" << std::endl
+      << "  shard=I/N shm=name - run only shard I of N, for starting the processes yourself" << std::endl
+      << "  net=address - shards talk over tcp:host:port or unix:path instead, shard I using port + I or path.I" << std::endl
+      << "  flush=us - how long tokens for another shard wait to be sent together over net (100 by default)" << std::endl
+      << "  partition - renumber the guests so each shard gets neighbors, and give each worker or core neighbors" << std::endl
+      << "  pin - same as partition but also pin the threads to cores, filling one NUMA node at a time" << std::endl
+      << "  huge - lay the bottles out on huge pages" << std::endl
+      << "  fixed - run pool guests compiled for a fixed degree of at most 16, without demand, sim, shards, trace or stats" << std::endl
+      << "  seed=N - also seeds the demand model and every guest's durations" << std::endl
+      << "  trace=file - record protocol events to a binary trace (read it with trace_dump)" << std::endl
+      << "  stats - log latency stats and the thirstiest guests at the end" << std::endl
+      << "  stats=ms - same as stats but also every ms milliseconds during the run" << std::endl
+      << "  churn=ms - every ms milliseconds a random guest leaves and a new one joins next to the same neighbors, and a random bottle moves" << std::endl;
 
     return 0;
   }
 
-  int philosophers = ::atoi(argv[1]);
-  int drink_count = ::atoi(argv[2]);
-
-  bool ring = false;
-  bool wait = false;
+  test_options_t options;
+  options.philosophers = ::atoi(argv[1]);
+  options.drink_count = ::atoi(argv[2]);
 
   // Would normally use get_opt or a cross platform version like boost Program_options
   for (int i = 3; i < argc; i++)
   {
     std::string arg = argv[i];
 
-    if (arg == "ring")
-      ring = true;
-    else if (arg == "all")
-      ring = false;
+    Topology::edge_vector_t unused;
+    if (Topology::make(arg, 0, unused))
+      options.topology = arg;
+    else if (arg.compare(0, 5, "file=") == 0)
+    {
+      options.topology = "file";
+      options.topology_path = arg.substr(5);
+    }
+    else if (arg.compare(0, 7, "degree=") == 0)
+      options.degree = ::atoi(arg.c_str() + 7);
+    else if (arg.compare(0, 5, "seed=") == 0)
+      options.seed = static_cast<unsigned long long>(::atoll(arg.c_str() + 5));
     else if (arg == "wait")
-      wait = true;
+      options.wait = true;
+    else if (arg == "pool")
+      options.pool = true;
+    else if (arg.compare(0, 5, "pool=") == 0)
+    {
+      options.pool = true;
+      options.workers = static_cast<std::size_t>(::atoi(arg.c_str() + 5));
+    }
+    else if (arg.compare(0, 7, "demand=") == 0)
+      options.demand_spec = arg.substr(7);
+    else if (arg.compare(0, 9, "tranquil=") == 0)
+      options.tranquil_spec = arg.substr(9);
+    else if (arg.compare(0, 9, "drinking=") == 0)
+      options.drinking_spec = arg.substr(9);
+    else if (arg == "sim")
+      options.simulate = true;
+    else if (arg.compare(0, 6, "delay=") == 0)
+      options.delay_spec = arg.substr(6);
+    else if (arg.compare(0, 7, "shards=") == 0)
+      options.shards = ::atoi(arg.c_str() + 7);
+    else if (arg.compare(0, 6, "shard=") == 0)
+    {
+      options.shard = ::atoi(arg.c_str() + 6);
+      auto slash = arg.find('/');
+      if (slash != std::string::npos)
+        options.shards = ::atoi(arg.c_str() + slash + 1);
+    }
+    else if (arg.compare(0, 4, "shm=") == 0)
+      options.shm_name = (arg.compare(4, 1, "/") == 0) ? arg.substr(4) : "/" + arg.substr(4);
+    else if (arg.compare(0, 4, "net=") == 0)
+      options.net_address = arg.substr(4);
+    else if (arg.compare(0, 6, "flush=") == 0)
+      options.flush_us = ::atoll(arg.c_str() + 6);
+    else if (arg == "partition")
+      options.partition = true;
+    else if (arg == "pin")
+      options.pin = true;
+    else if (arg == "huge")
+      options.huge = true;
+    else if (arg == "fixed")
+      options.fixed = true;
+    else if (arg.compare(0, 6, "trace=") == 0)
+      options.trace_path = arg.substr(6);
+    else if (arg == "stats")
+      options.stats_ms = 0;
+    else if (arg.compare(0, 6, "stats=") == 0)
+      options.stats_ms = ::atoll(arg.c_str() + 6);
+    else if (arg.compare(0, 6, "churn=") == 0)
+      options.churn_ms = ::atoll(arg.c_str() + 6);
   }
 
-  // Initialize our randomizer
-  std::srand(static_cast<int>(std::chrono::system_clock::now().time_since_epoch().count()));
+#if !defined(_WIN32)
+  // Fork before the logger starts its thread
+  if (options.shards > 1 && options.shard < 0)
+    return run_shards(argc, argv, options.shards);
+#endif
 
   Logger log;
   // Start by making sure two philosophers can negotiate bottle/request
@@ -136,8 +473,141 @@ int main(int argc, const char * argv[])
 
   log.log("Beginning tests....");
 
+  Topology::edge_vector_t edges;
+  if (options.topology == "file")
+  {
+    int file_guests = 0;
+    if (!Topology::load(options.topology_path, edges, file_guests, log))
+    {
+      log.log("Could not read topology file ", options.topology_path);
+      return 1;
+    }
+
+    // The file can ask for more guests than the command line
+    options.philosophers = std::max(options.philosophers, file_guests);
+    options.topology = options.topology_path;
+  }
+  else
+    Topology::make(options.topology, options.philosophers, edges, options.degree, options.seed);
+
+  std::unique_ptr<IDemandModel> demand;
+  if (!Demand::make(options.demand_spec, demand, options.seed))
+  {
+    log.log("Unknown or unreadable demand model ", options.demand_spec);
+    return 1;
+  }
+
+  std::unique_ptr<IDurationModel> tranquil;
+  std::unique_ptr<IDurationModel> drinking;
+  if ((!options.tranquil_spec.empty() && !Duration::make(options.tranquil_spec, tranquil))
+    || (!options.drinking_spec.empty() && !Duration::make(options.drinking_spec, drinking)))
+  {
+    log.log("Unknown duration model ", options.tranquil_spec, " ", options.drinking_spec);
+    return 1;
+  }
+
+  std::unique_ptr<IDurationModel> delay;
+  if (!options.delay_spec.empty() && !Duration::make(options.delay_spec, delay))
+  {
+    log.log("Unknown duration model ", options.delay_spec);
+    return 1;
+  }
+
+  std::unique_ptr<Simulator> simulator;
+  if (options.simulate)
+  {
+    simulator.reset(new Simulator(options.seed));
+    simulator->set_delay(delay.get());
+  }
+
+  std::unique_ptr<ShardTransport> transport;
+  SocketTransport * sockets = nullptr;
+  if (options.shard >= 0)
+  {
+    if (options.simulate || options.shard >= options.shards)
+    {
+      log.log("Can only run shard ", options.shard, " of ", options.shards, " on threads or a pool");
+      return 1;
+    }
+
+    // Every shard splits the same edges the same way, so they all
+    // agree on the new numbering
+    if (options.partition || options.pin)
+    {
+      auto before = Partition::count_cut(edges, Partition::blocks(options.philosophers, options.shards));
+      Partition::relabel(Partition::split(options.philosophers, edges, options.shards, options.seed), options.shards, edges);
+      log.log("Partitioned the guests into ", options.shards, " shards, ", before, " bottles crossed in id order");
+    }
+
+    if (options.net_address.empty())
+      transport.reset(new ShmTransport(options.shm_name, options.philosophers, edges, options.shard, options.shards));
+    else
+    {
+      sockets = new SocketTransport(options.net_address, options.philosophers, edges, options.shard, options.shards, std::chrono::microseconds(options.flush_us));
+      transport.reset(sockets);
+    }
+
+    if (!transport->is_open())
+    {
+      log.log("Could not open ", options.net_address.empty() ? "shared memory " + options.shm_name : options.net_address);
+      return 1;
+    }
+
+    log.log("Shard ", options.shard, " of ", options.shards, ", ", transport->get_cut_count(), " bottles cross between shards");
+
+    // Every shard gets its own trace
+    if (!options.trace_path.empty())
+      options.trace_path += "." + std::to_string(options.shard);
+  }
+
+  std::unique_ptr<Trace> trace;
+  if (!options.trace_path.empty())
+  {
+    trace.reset(new Trace(options.trace_path));
+    if (!trace->is_open())
+    {
+      log.log("Could not open trace file ", options.trace_path);
+      trace.reset();
+    }
+  }
+
+  options.simulator = simulator.get();
+  options.transport = transport.get();
+  options.trace = trace.get();
+  options.demand = demand.get();
+  options.tranquil = tranquil.get();
+  options.drinking = drinking.get();
+
+  // The fixed guests only know the bottles and the pool
+  if (options.fixed)
+  {
+    if (options.simulate || transport || trace || options.stats_ms >= 0 || demand)
+      log.log("Can only run fixed guests on a pool without demand, sim, shards, trace or stats");
+    else
+    {
+      fixed_test_t test{ options, edges, log };
+      if (with_degree(Topology::get_degree(options.philosophers, edges), test))
+      {
+        log.log("Tests Complete.");
+        return 0;
+      }
+
+      log.log("Nobody can have more than 16 neighbors to run fixed");
+    }
+
+    log.log("Running the dynamic guests instead.");
+  }
+
   // Run the test
-  run_test(philosophers, drink_count, ring, wait, std::chrono::minutes(5), log);
+  run_test(options, edges, std::chrono::minutes(5), log);
+
+  if (transport)
+    log.log("Shard ", options.shard, " received ", transport->get_received_count(), " tokens from other shards");
+  if (sockets)
+    log.log("Shard ", options.shard, " sent ", sockets->get_sent_count(), " tokens in ", sockets->get_frame_count(), " frames");
+
+  if (trace)
+    log.log("Trace written to ", options.trace_path);
 
   log.log("Tests Complete.");
 
@@ -0,0 +1,169 @@
+﻿//////////////////////////////////////////////////////////////////////////
+// TraceDump.cpp
+//
+// Copyright (C) 2018 Dan Sackinger - All Rights Reserved
+// You may use, distribute and modify this code under the
+// terms of the MIT license.
+//
+// Decoder for trace files:
+//  Reads the binary trace a run left behind, puts the records
+//  back in time order and prints them as text or CSV.
+//
+
+#include "../Philosopher.h"
+#include "../Trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static const char * get_state_name(std::uint8_t state)
+{
+  switch (state)
+  {
+  case Philosopher::tranquil:
+    return "tranquil";
+  case Philosopher::thirsty:
+    return "thirsty";
+  case Philosopher::drinking:
+    return "drinking";
+  }
+
+  return "unknown";
+}
+
+static void print_text(const Trace::record_t& record, double ms)
+{
+  std::cout << std::setw(14) << std::fixed << std::setprecision(6) << ms << " ms  "
+    << "Philosopher[" << record.philosopher << "] ";
+
+  switch (record.event)
+  {
+  case Trace::state_change:
+    std::cout << "is " << get_state_name(record.value);
+    break;
+  case Trace::request_sent:
+    std::cout << "requested the bottle from " << record.neighbor;
+    break;
+  case Trace::request_received:
+    std::cout << "got a request from " << record.neighbor;
+    break;
+  case Trace::bottle_sent:
+    std::cout << "sent the bottle to " << record.neighbor;
+    break;
+  case Trace::bottle_received:
+    std::cout << "got the bottle from " << record.neighbor << (record.value ? " (dirty)" : " (clean)");
+    break;
+  case Trace::drink:
+    std::cout << "drank";
+    break;
+  case Trace::fork_request_sent:
+    std::cout << "requested the fork from " << record.neighbor;
+    break;
+  case Trace::fork_request_received:
+    std::cout << "got a fork request from " << record.neighbor;
+    break;
+  case Trace::fork_sent:
+    std::cout << "sent the fork to " << record.neighbor;
+    break;
+  case Trace::fork_received:
+    std::cout << "got the fork from " << record.neighbor;
+    break;
+  case Trace::eating:
+    std::cout << (record.value ? "started eating" : "stopped eating");
+    break;
+  default:
+    std::cout << "unknown event " << static_cast<int>(record.event);
+    break;
+  }
+
+  std::cout << '\n';
+}
+
+static void print_csv(const Trace::record_t& record, long long ns)
+{
+  std::cout << ns << ','
+    << record.philosopher << ','
+    << Trace::get_event_name(record.event) << ','
+    << record.neighbor << ','
+    << static_cast<int>(record.value) << '\n';
+}
+
+int main(int argc, const char * argv[])
+{
+  if (argc < 2)
+  {
+    std::cout << "Usage: trace_dump <file> [csv]" << std::endl
+      << "  file - trace written by philo trace=file" << std::endl
+      << "  csv  - print time_ns,philosopher,event,neighbor,value rows instead of text" << std::endl;
+
+    return 0;
+  }
+
+  bool csv = (argc > 2 && std::string(argv[2]) == "csv");
+
+  std::ifstream file(argv[1], std::ios::binary);
+  if (!file)
+  {
+    std::cerr << "Could not open " << argv[1] << std::endl;
+    return 1;
+  }
+
+  std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  if (data.size() < sizeof(Trace::header_t))
+  {
+    std::cerr << argv[1] << " is too short to be a trace" << std::endl;
+    return 1;
+  }
+
+  auto header = reinterpret_cast<const Trace::header_t *>(data.data());
+  if (std::memcmp(header->magic, Trace::file_magic, sizeof(Trace::file_magic)) != 0
+    || header->version != Trace::file_version
+    || header->record_size != sizeof(Trace::record_t))
+  {
+    std::cerr << argv[1] << " is not a trace this version can read" << std::endl;
+    return 1;
+  }
+
+  auto capacity = std::min<std::uint64_t>(header->capacity,
+    (data.size() - sizeof(Trace::header_t)) / sizeof(Trace::record_t));
+  auto first = reinterpret_cast<const Trace::record_t *>(data.data() + sizeof(Trace::header_t));
+
+  // Slots nobody wrote are still zero.  Chunks from different threads
+  // interleave in the ring so sort everything else by time.
+  std::vector<Trace::record_t> records;
+  records.reserve(static_cast<std::size_t>(capacity));
+  for (std::uint64_t i = 0; i < capacity; i++)
+    if (first[i].ticks != 0)
+      records.push_back(first[i]);
+
+  std::stable_sort(records.begin(), records.end(),
+    [](const Trace::record_t& lhs, const Trace::record_t& rhs) { return lhs.ticks < rhs.ticks; });
+
+  auto rate = header->ticks_per_ns > 0 ? header->ticks_per_ns : 1.0;
+  if (csv)
+    std::cout << "time_ns,philosopher,event,neighbor,value\n";
+  else
+  {
+    std::cout << records.size() << " records";
+    if (header->cursor.load() > header->capacity)
+      std::cout << " (the ring wrapped, older records were overwritten)";
+    std::cout << '\n';
+  }
+
+  for (auto& record : records)
+  {
+    // Time since the trace was opened
+    auto ns = static_cast<double>(static_cast<std::int64_t>(record.ticks - header->start_ticks)) / rate;
+    if (csv)
+      print_csv(record, static_cast<long long>(ns));
+    else
+      print_text(record, ns / 1e6);
+  }
+
+  return 0;
+}